@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TERMINIZER_IMPLEMENTATION
+#include "terminizer.h"
+
+#define NUM_FRAMES 200
+
+static int64_t gettime_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (((int64_t)ts.tv_sec) * 1000000000) + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+  /* run with stdout redirected, e.g. ./a.out 400 240 >/dev/null </dev/null,
+     optionally naming a backend of cells, kitty or sixel and the number of
+     threads to encode on. redirect to a file instead to also see the bytes
+     painted per frame */
+  int w = argc > 1 ? atoi(argv[1]) : 400;
+  int h = argc > 2 ? atoi(argv[2]) : 240;
+  const char *backend = argc > 3 ? argv[3] : "cells";
+  int threads = argc > 4 ? atoi(argv[4]) : 1;
+
+  tz_init(w, h);
+  tz_paint_threads(threads);
+
+  if (!strcmp(backend, "kitty")) {
+    tz_backend(TZ_BACKEND_KITTY);
+  } else if (!strcmp(backend, "sixel")) {
+    tz_backend(TZ_BACKEND_SIXEL);
+  }
+
+  off_t start = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+
+  w = tz_width();
+  h = tz_height();
+
+  /* two frames differing in every pixel, so every cell is dirty each frame */
+  uint32_t *frames[2];
+
+  for (int i = 0; i < 2; i++) {
+    frames[i] = malloc(w * h * sizeof(uint32_t));
+
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++) {
+        frames[i][y * w + x] = (((x + i) * 7) & 0xff) | (((y * 13) & 0xff) << 8) | ((((x ^ y) + i) & 0xff) << 16);
+      }
+    }
+  }
+
+  int64_t diff_time = 0;
+  int64_t same_time = 0;
+  int64_t paint_time = 0;
+
+  for (int i = 0; i < NUM_FRAMES; i++) {
+    int64_t t0 = gettime_ns();
+
+    tz_blit(0, 0, w, h, frames[i & 1]);
+
+    int64_t t1 = gettime_ns();
+
+    tz_blit(0, 0, w, h, frames[i & 1]);
+
+    int64_t t2 = gettime_ns();
+
+    tz_paint();
+
+    int64_t t3 = gettime_ns();
+
+    diff_time += t1 - t0;
+    same_time += t2 - t1;
+    paint_time += t3 - t2;
+  }
+
+  double cells = (double)NUM_FRAMES * w * (h >> 1);
+
+  off_t bytes = lseek(STDOUT_FILENO, 0, SEEK_CUR) - start;
+
+  fprintf(stderr, "%dx%d cells, %d frames, %s, %d threads\n", w, h >> 1, NUM_FRAMES, backend, threads);
+  fprintf(stderr, "diff (changed):   %6.2f ns/cell\n", diff_time / cells);
+  fprintf(stderr, "diff (unchanged): %6.2f ns/cell\n", same_time / cells);
+  fprintf(stderr, "paint:            %6.2f ns/cell\n", paint_time / cells);
+
+  if (bytes > 0) {
+    fprintf(stderr, "output:           %6.0f bytes/frame\n", (double)bytes / NUM_FRAMES);
+  }
+
+  return 0;
+}
@@ -1,5 +1,3 @@
-#include <sys/time.h>
-
 #define QUICKMATHS_IMPLEMENTATION
 #include "quickmaths.h"
 
@@ -8,16 +6,134 @@
 
 #define MAX_SAMPLES 100
 
-static int64_t gettime_ms() {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return (((int64_t)tv.tv_sec) * 1000) + (tv.tv_usec / 1000);
+/* scene state */
+static mat4_t mvp_matrix;
+
+static float time_samples[MAX_SAMPLES];
+static float time_sum;
+static int time_seq;
+
+/* cube state
+
+      5--------4
+     /|       /|
+    / |      / |
+   0--------1  |
+   |  |     |  |
+   |  7-----|--6
+   | /      | /
+   |/       |/
+   2--------3 */
+static const struct tz_vertex cube_verts[8] = {
+    {-1.0f, +1.0f, -1.0f, +1.0f, 0xFF, 0x00, 0x00},
+    {+1.0f, +1.0f, -1.0f, +1.0f, 0xFF, 0xFF, 0x00},
+    {-1.0f, -1.0f, -1.0f, +1.0f, 0x00, 0xFF, 0x00},
+    {+1.0f, -1.0f, -1.0f, +1.0f, 0x00, 0x00, 0xFF},
+
+    {+1.0f, +1.0f, +1.0f, +1.0f, 0xFF, 0x00, 0x00},
+    {-1.0f, +1.0f, +1.0f, +1.0f, 0xFF, 0xFF, 0x00},
+    {+1.0f, -1.0f, +1.0f, +1.0f, 0x00, 0xFF, 0x00},
+    {-1.0f, -1.0f, +1.0f, +1.0f, 0x00, 0x00, 0xFF},
+};
+static const int cube_faces[][4] = {
+    {0, 1, 2, 3}, /* front */
+    {1, 4, 3, 6}, /* right */
+    {4, 5, 6, 7}, /* back */
+    {5, 0, 7, 2}, /* left */
+    {5, 4, 0, 1}, /* top */
+    {2, 3, 7, 6}, /* bot */
+};
+static vec3_t cube_origin = {0.0f, 0.0f, 3.5f};
+static float cube_pitch = 0.0f;
+static float cube_yaw = 0.0f;
+
+/* mesh drawn in place of the cube, if one was given */
+static struct tz_mesh *mesh;
+
+static void update(float delta_time) {
+  /* update simple moving average */
+  time_sum -= time_samples[time_seq];
+  time_sum += delta_time;
+  time_samples[time_seq] = delta_time;
+  time_seq = (time_seq + 1) % MAX_SAMPLES;
+
+  /* update rotation */
+  cube_pitch += 3.0f * delta_time;
+  cube_yaw += 5.0f * delta_time;
+}
+
+static void render() {
+  tz_clear();
+
+  /* transform verts */
+  struct tz_vertex verts[8];
+  mat4_t cube_rotate[3];
+
+  memcpy(verts, cube_verts, sizeof(verts));
+
+  mat4_rotate_pitch(cube_rotate[0], -cube_pitch);
+  mat4_rotate_yaw(cube_rotate[1], -cube_yaw);
+
+  mat4_mul(cube_rotate[2], cube_rotate[0], cube_rotate[1]);
+
+  if (mesh) {
+    /* let tz_mesh_draw transform the vertices, placing the mesh where the
+       cube would be */
+    mat4_t translate_matrix;
+    mat4_t model_matrix;
+    mat4_t mesh_matrix;
+
+    mat4_ident(translate_matrix);
+    vec3_copy(&translate_matrix[12], cube_origin);
+    mat4_mul(model_matrix, translate_matrix, cube_rotate[2]);
+    mat4_mul(mesh_matrix, mvp_matrix, model_matrix);
+
+    tz_mesh_draw(mesh, mesh_matrix);
+  }
+
+  for (int i = 0; i < sizeof(verts) / sizeof(verts[0]); i++) {
+    struct tz_vertex *v = &verts[i];
+
+    /* rotate the cube */
+    mat4_transform(v->pos, cube_rotate[2], v->pos);
+    vec3_add(v->pos, v->pos, cube_origin);
+
+    /* translate to clip space */
+    mat4_transform(v->pos, mvp_matrix, v->pos);
+  }
+
+  /* draw faces */
+  for (int i = 0; !mesh && i < sizeof(cube_faces) / sizeof(cube_faces[0]); i++) {
+    struct tz_vertex *v0 = &verts[cube_faces[i][0]];
+    struct tz_vertex *v1 = &verts[cube_faces[i][1]];
+    struct tz_vertex *v2 = &verts[cube_faces[i][2]];
+    struct tz_vertex *v3 = &verts[cube_faces[i][3]];
+
+    tz_triangle(v0, v1, v2);
+    tz_triangle(v2, v1, v3);
+  }
+
+  /* draw frame rate */
+  int fps = time_sum > 0.0f ? (int)(MAX_SAMPLES / time_sum) : 0;
+  tz_print(tz_width() - 8, 0, "\x1b[f15]%4d FPS", fps);
+}
+
+static void input(const struct tz_event *ev) {
+  if (ev->type == TZ_EVENT_KEY && (ev->key.code == 'q' || ev->key.code == TZ_KEY_ESCAPE)) {
+    tz_stop();
+  }
 }
 
-int main() {
+int main(int argc, char **argv) {
+  /* draws a mesh converted with tool-mesh.c instead of the cube if given,
+     e.g. ./a.out model.tzm */
+  if (argc > 1 && !(mesh = tz_mesh_open(argv[1]))) {
+    fprintf(stderr, "%s: not a mesh\n", argv[1]);
+    return 1;
+  }
+
   tz_init(128, 72);
 
-  /* scene state */
   const int canvas_width = tz_width();
   const int canvas_height = tz_height();
 
@@ -36,109 +152,14 @@ int main() {
 
   mat4_t modelview_matrix;
   mat4_t projection_matrix;
-  mat4_t mvp_matrix;
-
-  int64_t time_samples[MAX_SAMPLES] = {};
-  int64_t time_sum = 0;
-  int64_t time_seq = 0;
 
   mat4_camera(modelview_matrix, camera_origin, camera_axes);
   mat4_perspective(projection_matrix, 90.0f, canvas_width, canvas_height, znear, zfar);
   mat4_mul(mvp_matrix, projection_matrix, modelview_matrix);
 
-  /* cube state
-
-        5--------4
-       /|       /|
-      / |      / |
-     0--------1  |
-     |  |     |  |
-     |  7-----|--6
-     | /      | /
-     |/       |/
-     2--------3 */
-  const struct tz_vertex cube_verts[8] = {
-      {-1.0f, +1.0f, -1.0f, +1.0f, 0xFF, 0x00, 0x00},
-      {+1.0f, +1.0f, -1.0f, +1.0f, 0xFF, 0xFF, 0x00},
-      {-1.0f, -1.0f, -1.0f, +1.0f, 0x00, 0xFF, 0x00},
-      {+1.0f, -1.0f, -1.0f, +1.0f, 0x00, 0x00, 0xFF},
-
-      {+1.0f, +1.0f, +1.0f, +1.0f, 0xFF, 0x00, 0x00},
-      {-1.0f, +1.0f, +1.0f, +1.0f, 0xFF, 0xFF, 0x00},
-      {+1.0f, -1.0f, +1.0f, +1.0f, 0x00, 0xFF, 0x00},
-      {-1.0f, -1.0f, +1.0f, +1.0f, 0x00, 0x00, 0xFF},
-  };
-  const int cube_faces[][4] = {
-      {0, 1, 2, 3}, /* front */
-      {1, 4, 3, 6}, /* right */
-      {4, 5, 6, 7}, /* back */
-      {5, 0, 7, 2}, /* left */
-      {5, 4, 0, 1}, /* top */
-      {2, 3, 7, 6}, /* bot */
-  };
-  vec3_t cube_origin = {0.0f, 0.0f, 3.5f};
-  float cube_pitch = 0.0f;
-  float cube_yaw = 0.0f;
-
-  while (1) {
-    int64_t time_begin = gettime_ms();
-
-    tz_clear();
-
-    /* transform verts */
-    struct tz_vertex verts[8];
-    mat4_t cube_rotate[3];
-
-    memcpy(verts, cube_verts, sizeof(verts));
-
-    mat4_rotate_pitch(cube_rotate[0], -cube_pitch);
-    mat4_rotate_yaw(cube_rotate[1], -cube_yaw);
-
-    mat4_mul(cube_rotate[2], cube_rotate[0], cube_rotate[1]);
+  tz_run(60, update, render, input);
 
-    for (int i = 0; i < sizeof(verts) / sizeof(verts[0]); i++) {
-      struct tz_vertex *v = &verts[i];
-
-      /* rotate the cube */
-      mat4_transform(v->pos, cube_rotate[2], v->pos);
-      vec3_add(v->pos, v->pos, cube_origin);
-
-      /* translate to clip space */
-      mat4_transform(v->pos, mvp_matrix, v->pos);
-    }
-
-    /* draw faces */
-    for (int i = 0; i < sizeof(cube_faces) / sizeof(cube_faces[0]); i++) {
-      struct tz_vertex *v0 = &verts[cube_faces[i][0]];
-      struct tz_vertex *v1 = &verts[cube_faces[i][1]];
-      struct tz_vertex *v2 = &verts[cube_faces[i][2]];
-      struct tz_vertex *v3 = &verts[cube_faces[i][3]];
-
-      tz_triangle(v0, v1, v2);
-      tz_triangle(v2, v1, v3);
-    }
-
-    /* draw frame rate */
-    int fps = (int)(1000.0 / ((double)time_sum / MAX_SAMPLES));
-    tz_print(canvas_width - 8, 0, "\x1b[f15]%4d FPS", fps);
-
-    /* repaint */
-    tz_paint();
-
-    /* update simple moving average */
-    int64_t time_end = gettime_ms();
-    int64_t time_elapsed = time_end - time_begin;
-
-    time_sum -= time_samples[time_seq];
-    time_sum += time_elapsed;
-    time_samples[time_seq] = time_elapsed;
-    time_seq = (time_seq + 1) % MAX_SAMPLES;
-
-    /* update rotation */
-    float delta_time = time_elapsed / 1000.0f;
-    cube_pitch += 3.0f * delta_time;
-    cube_yaw += 5.0f * delta_time;
-  }
+  tz_mesh_close(mesh);
 
   return 0;
 }
@@ -3,9 +3,6 @@
 
 #include <stdint.h>
 
-#define TZ_MAX_COLS 512
-#define TZ_MAX_ROWS 256
-
 struct tz_vertex {
   union {
     struct {
@@ -21,13 +18,86 @@ struct tz_vertex {
   uint8_t r;
   uint8_t g;
   uint8_t b;
+
+  /* texture coordinates, used instead of the color while a texture is bound */
+  float u;
+  float v;
+};
+
+/* color of layer pixels that let the layers below show through */
+#define TZ_TRANSPARENT 0xff000000u
+
+struct tz_layer;
+struct tz_surface;
+struct tz_texture;
+struct tz_text;
+struct tz_mesh;
+struct tz_scene;
+
+/* terminal capabilities, probed asynchronously after init */
+enum {
+  TZ_CAP_TRUECOLOR = 1 << 0,
+  TZ_CAP_SYNC_OUTPUT = 1 << 1,
+  TZ_CAP_KITTY_GRAPHICS = 1 << 2,
+  TZ_CAP_LR_MARGINS = 1 << 3,
+  TZ_CAP_SIXEL = 1 << 4,
 };
 
 void tz_init(int w, int h);
 
+int tz_caps();
+
+/* called after the canvas has been resized to follow the terminal */
+void tz_on_resize(void (*callback)(int w, int h));
+
 int tz_width();
 int tz_height();
 
+/* glyph modes
+
+   by default each cell shows two pixels, one above the other, through the
+   upper half block. the finer modes rasterize at 2x2, 2x3 or 2x4 pixels per
+   cell, and as each cell is painted pick the glyph and pair of colors that
+   match its pixels best, which suits lines and plots better than shading.
+   changing the mode changes the canvas size in pixels, calling the resize
+   callback, and leaves the content to be redrawn. text always takes a whole
+   cell */
+enum {
+  TZ_GLYPH_HALF,
+  TZ_GLYPH_QUADRANT,
+  TZ_GLYPH_SEXTANT,
+  TZ_GLYPH_BRAILLE,
+};
+
+void tz_glyph_mode(int mode);
+
+/* paint backends
+
+   the cell backend paints the canvas as glyphs, while the image backends
+   split it into tiles of 16x4 cells and send each tile with a changed cell
+   as an image over its cells, through the kitty graphics protocol or as
+   sixels. check tz_caps for the protocol before picking one. text is still
+   painted as cells, over the images */
+enum {
+  TZ_BACKEND_CELLS,
+  TZ_BACKEND_KITTY,
+  TZ_BACKEND_SIXEL,
+};
+
+void tz_backend(int backend);
+
+/* encode what tz_paint sends on up to n threads, each taking a band of the
+   changed rows, for large canvases changing a lot every frame. 1, the
+   default, encodes everything on the calling thread */
+void tz_paint_threads(int n);
+
+/* let tz_paint skip cells whose glyph the terminal already shows in colors
+   within threshold of the real ones, measured in steps of luma, to save
+   bandwidth on slow links. cells skipped are painted exactly within refresh
+   paints after. only the cell backend paints lossily, and a threshold of 0,
+   the default, paints every change */
+void tz_lossy(int threshold, int refresh);
+
 /* output routines */
 void tz_viewport(int x, int y, int w, int h);
 
@@ -36,32 +106,340 @@ void tz_clear();
 int tz_print(int x, int y, const char *fmt, ...);
 void tz_blit(int x, int y, int w, int h, const uint32_t *data);
 
+/* scroll the contents of a rectangle up by dy pixels, or down if negative,
+   clearing the rows exposed. scrolling whole cell rows lets tz_paint scroll
+   the terminal itself and only send the exposed rows */
+void tz_scroll(int x, int y, int w, int h, int dy);
+
+/* 2d routines
+
+   shapes are filled a row of pixels at a time straight into the bound
+   target, at viewport coordinates like tz_blit's. they skip the projection
+   and depth test of lines and triangles, leave depth alone and only mark the
+   cells whose colors change, so panels, bars and charts drawn every frame
+   cost little more than the pixels they cover */
+void tz_fill_rect(int x, int y, int w, int h, uint32_t color);
+void tz_stroke_rect(int x, int y, int w, int h, int width, uint32_t color);
+void tz_fill_round_rect(int x, int y, int w, int h, int radius, uint32_t color);
+
+/* circles are centered on the pixel at (x, y) */
+void tz_fill_circle(int x, int y, int radius, uint32_t color);
+void tz_stroke_circle(int x, int y, int radius, int width, uint32_t color);
+
+/* fill the polygon of n points given as x, y pairs, by the even odd rule,
+   with the pixels whose centers fall inside */
+void tz_fill_polygon(const int *points, int n, uint32_t color);
+
 void tz_line(const struct tz_vertex *v0, const struct tz_vertex *v1);
 void tz_triangle(const struct tz_vertex *v0, const struct tz_vertex *v1, const struct tz_vertex *v2);
 
+/* draw n points in clip space, each a square of the point size in pixels in
+   its vertex's color, depth tested like tz_triangle. points skip the setup
+   lines and triangles go through, so millions can be drawn a frame */
+void tz_points(const struct tz_vertex *points, int n);
+
+/* size of the squares tz_points draws, 1 pixel to start with */
+void tz_point_size(int size);
+
 void tz_paint();
 
+/* layer routines
+
+   layers are canvas sized framebuffers composited in z order on top of the
+   canvas during tz_paint, only recomposing the cells that changed in any of
+   them. layers start out, and are cleared to, TZ_TRANSPARENT */
+struct tz_layer *tz_layer_create(int z);
+void tz_layer_destroy(struct tz_layer *layer);
+
+/* direct the output routines at a layer, or back at the canvas if NULL */
+void tz_layer_bind(struct tz_layer *layer);
+
+void tz_layer_z(struct tz_layer *layer, int z);
+void tz_layer_visible(struct tz_layer *layer, int visible);
+
+/* surface routines
+
+   surfaces are offscreen render targets of any size, each with their own
+   color, depth and viewport. something rendered into one once can be blit to
+   the canvas, a layer or another surface every frame. surfaces start out, and
+   are cleared to, TZ_TRANSPARENT */
+struct tz_surface *tz_surface_create(int w, int h);
+void tz_surface_destroy(struct tz_surface *surface);
+
+/* direct the output routines at a surface, or back at the canvas if NULL */
+void tz_surface_bind(struct tz_surface *surface);
+
+/* copy the w x h rectangle at (sx, sy) in the surface to (x, y) in the bound
+   target, skipping transparent pixels */
+void tz_surface_blit(const struct tz_surface *surface, int sx, int sy, int w, int h, int x, int y);
+
+/* texture routines
+
+   textures are copied from w x h pixels laid out like tz_blit's, resized to
+   powers of two and mipmapped. while one is bound, tz_triangle fills with it
+   at the vertices' u and v instead of their colors, repeating outside of 0
+   to 1 and picking the mip level matching the triangle's size on screen */
+struct tz_texture *tz_texture_create(int w, int h, const uint32_t *data);
+void tz_texture_destroy(struct tz_texture *texture);
+
+/* texture tz_triangle, or NULL to go back to vertex colors */
+void tz_texture_bind(struct tz_texture *texture);
+
+/* text routines
+
+   text objects hold formatted text, decoded from UTF-8 with tz_print's
+   color escapes and split into the cells it takes, so text drawn every frame
+   is only parsed again when it changes. drawing it only marks the cells whose
+   content changed. colors not set by escapes are the ones current when the
+   text was set */
+struct tz_text *tz_text_create();
+void tz_text_destroy(struct tz_text *text);
+
+void tz_text_set(struct tz_text *text, const char *fmt, ...);
+
+/* draw the text at (x, y) like tz_print, returning the x after it */
+int tz_text_draw(const struct tz_text *text, int x, int y);
+
+/* mesh routines
+
+   meshes are files of vertices laid out as tz_vertex and triangles of three
+   32-bit vertex indices, as written by tool-mesh.c from OBJ and PLY models.
+   opening one maps the file into memory rather than reading it, so even
+   large meshes open in about the same time, and are paged in as they're
+   drawn. returns NULL if the file isn't a mesh written for this build */
+struct tz_mesh *tz_mesh_open(const char *path);
+void tz_mesh_close(struct tz_mesh *mesh);
+
+int tz_mesh_vertices(const struct tz_mesh *mesh, const struct tz_vertex **vertices);
+int tz_mesh_triangles(const struct tz_mesh *mesh, const uint32_t **indices);
+
+/* draw the mesh, with its positions taken to clip space by a column major
+   4x4 matrix. meshes converted with levels of detail are drawn at the
+   coarsest level whose error covers at most about a pixel on screen, so the
+   triangles drawn follow the mesh's size on screen rather than the model */
+void tz_mesh_draw(const struct tz_mesh *mesh, const float *matrix);
+
+/* the level of detail tz_mesh_draw would draw the mesh at, 0 being the full
+   mesh */
+int tz_mesh_level(const struct tz_mesh *mesh, const float *matrix);
+
+/* scene routines
+
+   scenes hold meshes placed by model matrices in a bounding volume hierarchy
+   over their bounding spheres, so drawing one culls whole groups of objects
+   against the view at once and only transforms and rasterizes the meshes in
+   view, however many are out of it. the hierarchy is rebuilt on the next
+   draw after objects are added or removed, and only refitted after they're
+   moved */
+struct tz_scene *tz_scene_create();
+void tz_scene_destroy(struct tz_scene *scene);
+
+/* add a mesh drawn through a column major model matrix, returning the
+   object's id. the mesh must stay open while it's in the scene */
+int tz_scene_add(struct tz_scene *scene, const struct tz_mesh *mesh, const float *matrix);
+void tz_scene_move(struct tz_scene *scene, int id, const float *matrix);
+void tz_scene_remove(struct tz_scene *scene, int id);
+
+/* draw the objects in view of a column major view projection matrix like
+   tz_mesh_draw, returning how many were drawn */
+int tz_scene_draw(struct tz_scene *scene, const float *matrix);
+
+/* draw count instances of the mesh, each through its own column major matrix
+   to clip space like tz_mesh_draw, the matrices 16 floats apart. instances
+   are culled by the mesh's bounding sphere before any of their vertices are
+   transformed, and have their vertex colors multiplied by their color from
+   colors, if given, so white meshes take the instances' colors */
+void tz_draw_instanced(const struct tz_mesh *mesh, const float *matrices, const uint32_t *colors, int count);
+
 /* input routines */
 int tz_can_read();
 int tz_read(char *out, int n);
 
 int tz_prompt(int y, const char *prompt, char *out, int n);
 
+/* input events
+
+   input is decoded into key, mouse, paste and focus events. keys are unicode
+   code points or one of the TZ_KEY_ values, mouse coordinates are in canvas
+   pixels at the top of the cell, and pasted text arrives in order across as
+   many events as it takes, the last one having paste.end set */
+enum {
+  TZ_EVENT_KEY,
+  TZ_EVENT_MOUSE,
+  TZ_EVENT_PASTE,
+  TZ_EVENT_FOCUS,
+};
+
+enum {
+  TZ_KEY_TAB = '\t',
+  TZ_KEY_ENTER = '\r',
+  TZ_KEY_ESCAPE = 0x1b,
+  TZ_KEY_BACKSPACE = 0x7f,
+
+  /* past the end of unicode */
+  TZ_KEY_UP = 0x110000,
+  TZ_KEY_DOWN,
+  TZ_KEY_LEFT,
+  TZ_KEY_RIGHT,
+  TZ_KEY_HOME,
+  TZ_KEY_END,
+  TZ_KEY_PAGE_UP,
+  TZ_KEY_PAGE_DOWN,
+  TZ_KEY_INSERT,
+  TZ_KEY_DELETE,
+  TZ_KEY_F1,
+  TZ_KEY_F12 = TZ_KEY_F1 + 11,
+};
+
+enum {
+  TZ_MOD_SHIFT = 1 << 0,
+  TZ_MOD_ALT = 1 << 1,
+  TZ_MOD_CTRL = 1 << 2,
+};
+
+enum {
+  TZ_MOUSE_NONE,
+  TZ_MOUSE_LEFT,
+  TZ_MOUSE_MIDDLE,
+  TZ_MOUSE_RIGHT,
+  TZ_MOUSE_WHEEL_UP,
+  TZ_MOUSE_WHEEL_DOWN,
+};
+
+enum {
+  TZ_MOUSE_PRESS,
+  TZ_MOUSE_RELEASE,
+  TZ_MOUSE_MOVE,
+};
+
+struct tz_event {
+  int type;
+  int mods;
+
+  union {
+    struct {
+      int code;
+    } key;
+
+    struct {
+      int button;
+      int action;
+      int x;
+      int y;
+    } mouse;
+
+    struct {
+      int len;
+      int end;
+      char text[24];
+    } paste;
+
+    struct {
+      int focused;
+    } focus;
+  };
+};
+
+/* reports the terminal sends besides keys, off by default */
+enum {
+  TZ_INPUT_MOUSE = 1 << 0,
+  TZ_INPUT_PASTE = 1 << 1,
+  TZ_INPUT_FOCUS = 1 << 2,
+};
+
+void tz_input_modes(int modes);
+
+/* returns 1 and the oldest event not yet handed out, or 0 if there are none */
+int tz_poll_event(struct tz_event *ev);
+
+/* read and decode input on a thread of its own, so none is lost or delayed
+   while the caller is busy painting. events are passed over a lock-free
+   queue, and when it fills up the thread stops reading until tz_poll_event
+   has caught up. tz_read, tz_can_read and tz_prompt mustn't be used while it
+   runs */
+int tz_input_thread_start();
+void tz_input_thread_stop();
+
+/* event loop
+
+   sleeps until there's something to do, handing input to the input callback
+   as soon as it arrives and producing frames at a steady fps. each frame
+   calls update with the seconds elapsed since the previous one, then render
+   to draw, then paints. a terminal resize produces a frame straight away, and
+   frames are held back while the terminal is still busy with the last one.
+   input events are handed over straight away, even with the input thread
+   running.
+   any callback may be NULL. returns once tz_stop is called, or stdin closes */
+void tz_run(int fps, void (*update)(float dt), void (*render)(), void (*input)(const struct tz_event *ev));
+void tz_stop();
+
+/* recording routines
+
+   records everything tz_paint writes to a file, one timestamped frame per
+   paint, starting with a full repaint. with TZ_RECORD_DELTA each frame is
+   stored as copies from the previous one wherever it repeats it. recordings
+   are read back, frame by frame, with tz_recording_read, which hands out the
+   frame's bytes and the nanoseconds since recording began, and returns the
+   frame's length, 0 at the end or -1 if the file is damaged */
+enum {
+  TZ_RECORD_DELTA = 1 << 0,
+};
+
+struct tz_recording;
+
+int tz_record_start(const char *path, int flags);
+void tz_record_stop();
+
+struct tz_recording *tz_recording_open(const char *path);
+int tz_recording_read(struct tz_recording *rec, const char **data, int64_t *time_ns);
+void tz_recording_close(struct tz_recording *rec);
+
+/* broadcast routines
+
+   serves what's painted to any number of viewers attached to a unix domain
+   socket, e.g. with tool-attach.c. each viewer is sent the cells that differ
+   from what it was sent last, and one that can't keep up is skipped until it
+   has, then getting everything it missed in one go. viewers are assumed to
+   support truecolor */
+int tz_serve(const char *path);
+void tz_serve_stop();
+
 #endif
 
 #ifdef TERMINIZER_IMPLEMENTATION
 
 #include <ctype.h>
-#include <locale.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+
+/* with TZ_ZLIB defined, kitty images are compressed with zlib, which must
+   then be linked */
+#ifdef TZ_ZLIB
+#include <zlib.h>
+#endif
+
 #define TZ_MIN(a, b)        (((a) < (b)) ? (a) : (b))
 #define TZ_MAX(a, b)        (((a) > (b)) ? (a) : (b))
 #define TZ_CLAMP(x, lo, hi) TZ_MAX((lo), TZ_MIN((hi), (x)))
@@ -70,25 +448,486 @@ int tz_prompt(int y, const char *prompt, char *out, int n);
 #define TZ_SUBPIXEL_STEP    (1 << TZ_SUBPIXEL_BITS)
 #define TZ_SUBPIXEL_MASK    (TZ_SUBPIXEL_STEP - 1)
 
-static struct {
-  struct termios old_tty;
-  struct sigaction old_sa;
+/* rows are padded to a multiple of 64 pixels, keeping every row of the color,
+   depth and char buffers cache line aligned and giving each row a whole number
+   of dirty words */
+#define TZ_ROW_ALIGN        64
+#define TZ_CACHE_LINE       64
+
+#define TZ_BUFFER_SIZE      4096
+
+/* how long to wait on the terminal before giving up on a query */
+#define TZ_PROBE_TIMEOUT_MS 500
+
+/* scrolls queued for the terminal between paints */
+#define TZ_MAX_SCROLLS      16
+
+/* input events queued between the input thread and the caller, must be a
+   power of two */
+#define TZ_EVENT_QUEUE_SIZE 256
+
+/* how long a lone escape waits for the rest of a sequence before it's taken
+   to be the escape key */
+#define TZ_ESCAPE_TIMEOUT_MS 25
+
+/* recordings start with an 8 byte magic followed by the flags, and the canvas
+   size in cells at the time, as 32-bit little endian words. each frame then
+   has a header of its 64-bit timestamp, and its 32-bit decoded and stored
+   lengths, ahead of the stored bytes */
+#define TZ_RECORD_MAGIC     "TZREC001"
+#define TZ_RECORD_HEADER    20
+#define TZ_RECORD_FRAME     16
+
+/* meshes start with an 8 byte magic followed by the size of a tz_vertex, the
+   number of vertices and triangles and the number of levels of detail, as
+   32-bit little endian words, padded so the vertices after them are 16 byte
+   aligned. the triangles follow. meshes with levels of detail then have the
+   bounding sphere of their vertices as 4 floats, a tz_mesh_level for each
+   level, the first being the full mesh, and the triangles of the rest in
+   turn. each level only uses the vertices up to its count */
+#define TZ_MESH_MAGIC       "TZMESH01"
+#define TZ_MESH_HEADER      32
+#define TZ_MAX_MESH_LEVELS  16
+
+/* error of a mesh's level of detail on screen, in pixels, above which the
+   finer level is drawn */
+#define TZ_MESH_LEVEL_PIXELS 1.0f
+
+/* most objects in a leaf of a scene's hierarchy */
+#define TZ_SCENE_LEAF       4
+
+/* delta frames match runs of at least this many bytes against the previous
+   frame, found through a hash of their first 4 bytes */
+#define TZ_DELTA_MIN_MATCH  8
+#define TZ_DELTA_HASH_BITS  12
+
+/* the image backends send tiles of this many cells, the columns dividing 64
+   so a tile's dirty bits sit in one word of each row */
+#define TZ_TILE_COLS        16
+#define TZ_TILE_ROWS        4
+
+/* kitty graphics payloads go out in chunks of at most 4096 base64 bytes */
+#define TZ_KITTY_CHUNK      3072
+
+/* most threads tz_paint_threads starts, and the fewest dirty cells worth
+   waking them for */
+#define TZ_MAX_PAINT_THREADS 16
+#define TZ_PARALLEL_MIN_CELLS 4096
+
+/* char standing for a code point stored aside, and the code point stored
+   in the cell to the right of a double width char, which covers it */
+#define TZ_CHAR_CODE        0x80
+#define TZ_WIDE_TAIL        0x110000u
+
+/* most mip levels in a texture, capping its sides at 32768 texels */
+#define TZ_MAX_TEXTURE_LEVELS 16
+
+/* cell size in pixels assumed for sixels when the terminal doesn't say */
+#define TZ_CELL_PX_W        10
+#define TZ_CELL_PX_H        20
+
+#ifdef MSG_NOSIGNAL
+#define TZ_SEND_FLAGS       MSG_NOSIGNAL
+#else
+#define TZ_SEND_FLAGS       0
+#endif
 
+#ifdef TZ_PACKED_CELLS
+
+/* with TZ_PACKED_CELLS defined, each terminal cell is stored as a single
+   record instead of in separate color, depth and char buffers, so the paint
+   and diff passes read one cache line for every five cells they visit. the
+   depth pair fits in what would otherwise be padding */
+struct tz_cell {
+  uint32_t color[2];
+  uint8_t depth[2];
+  uint8_t c;
+};
+
+#endif
+
+/* framebuffer storage. each buffer is indexed by row * stride + col, with one
+   row of dirty bits and chars per cell row and one row of color and depth per
+   pixel row */
+struct tz_surface {
   int rows;
   int cols;
-  int y;
+  int stride;
+
+  /* color tz_clear resets pixels to */
+  uint32_t clear_color;
 
+  /* viewport, stashed here while the surface isn't bound */
   int x0, y0;
   int x1, y1;
 
+  uint64_t *dirty;
+
+  /* cells drawn since tz_clear last reset them, laid out like the dirty
+     bits. tz_paint hands dirty bits over to the screen, so they're kept
+     here too, and together the two cover every cell that might hold
+     anything but the clear color and far depth */
+  uint64_t *drawn;
+#ifdef TZ_PACKED_CELLS
+  struct tz_cell *cells;
+#else
+  uint32_t *color;
+  uint8_t *depth;
+  uint8_t *chars;
+#endif
+
+  /* chars are ASCII, or TZ_CHAR_CODE with the code point stored here, which
+     is only allocated once the first one is drawn so the passes over every
+     pixel only ever read a byte of char */
+  uint32_t *codes;
+};
+
+struct tz_layer {
+  struct tz_surface surface;
+
+  int z;
+  int visible;
+
+  /* next layer up */
+  struct tz_layer *next;
+};
+
+/* textures are stored as a chain of mip levels, each a power of two on both
+   sides with its texels in morton order, so that the texels sampled across
+   a small patch of screen sit close together in memory */
+struct tz_texture {
+  int levels;
+  int log_w[TZ_MAX_TEXTURE_LEVELS];
+  int log_h[TZ_MAX_TEXTURE_LEVELS];
+  uint32_t *level[TZ_MAX_TEXTURE_LEVELS];
+  uint32_t *texels;
+};
+
+/* a level of detail as stored in a mesh, with the largest distance its
+   surface strays from the full mesh's */
+struct tz_mesh_level {
+  uint32_t num_triangles;
+  uint32_t num_vertices;
+  float error;
+};
+
+/* a mesh file mapped into memory */
+struct tz_mesh {
+  void *map;
+  size_t size;
+
+  const struct tz_vertex *vertices;
+  const uint32_t *indices;
+  int num_vertices;
+  int num_triangles;
+
+  /* bounding sphere in model space, as stored with the levels of detail or
+     measured when opened otherwise */
+  float sphere[4];
+
+  /* levels of detail past the full mesh, if any, with their error measured
+     against the bounding sphere */
+  const struct tz_mesh_level *levels;
+  const uint32_t *level_indices[TZ_MAX_MESH_LEVELS];
+  int num_levels;
+};
+
+/* a mesh placed in a scene, with its bounding sphere in model space and in
+   the world. removed objects have no mesh and link to the next free id */
+struct tz_scene_object {
+  const struct tz_mesh *mesh;
+  float matrix[16];
+  float local[4];
+  float sphere[4];
+  int next_free;
+};
+
+/* a box in a scene's hierarchy. leaves hold count objects from first in the
+   scene's order, other nodes have no count and their children at first and
+   first + 1, always after them */
+struct tz_scene_node {
+  float min[3];
+  float max[3];
+  int first;
+  int count;
+};
+
+struct tz_scene {
+  struct tz_scene_object *objects;
+  int num_objects;
+  int cap;
+  int free_id;
+
+  /* the hierarchy, with ids of the objects in the leaves in order and keys
+     to sort them by while building it */
+  struct tz_scene_node *nodes;
+  int num_nodes;
+  int *order;
+  uint64_t *keys;
+  int built;
+  int moved;
+
+  /* frustum planes of the matrix being drawn, their lengths and how many
+     objects were drawn */
+  float planes[6][4];
+  float plane_len[6];
+  int drawn;
+};
+
+/* a scroll of whole cell rows to be replayed on the terminal during the next
+   paint, in canvas cells */
+struct tz_scroll_op {
+  int row0, row1;
+  int col0, col1;
+  int n;
+};
+
+/* single producer, single consumer ring of input events. head and tail only
+   ever increase, and each sits on its own cache line as they're written from
+   different threads */
+struct tz_event_queue {
+  _Alignas(TZ_CACHE_LINE) atomic_uint head;
+  _Alignas(TZ_CACHE_LINE) atomic_uint tail;
+  struct tz_event events[TZ_EVENT_QUEUE_SIZE];
+};
+
+/* input decoding state, only touched by whoever is producing events */
+struct tz_decoder {
+  /* start of a sequence carried over until the rest is read */
+  char buf[64];
+  int len;
+  int64_t time;
+
+  int pasting;
+};
+
+/* growable buffer that escape sequences are encoded into before being written
+   out in one go */
+struct tz_buf {
+  char *data;
+  int len;
+  int cap;
+};
+
+/* a char of formatted text, with the cells it takes */
+struct tz_text_char {
+  uint32_t c;
   uint32_t fg_color;
   uint32_t bg_color;
+  int width;
+};
+
+/* formatted text parsed into chars. the text as formatted and the colors it
+   started with tell whether setting it again changes anything, and tz_print
+   carries on with the colors it ended with */
+struct tz_text {
+  struct tz_buf source;
+  struct tz_buf scratch;
+  uint32_t fg_color[2];
+  uint32_t bg_color[2];
+
+  struct tz_text_char *chars;
+  int len;
+  int cap;
+};
+
+/* a viewer attached to the broadcast socket, with a copy of the cells it was
+   last sent and dirty bits for every cell changed since, laid out like the
+   screen's */
+struct tz_client {
+  int fd;
+
+  int rows;
+  int cols;
+  int stride;
+
+  /* the glyph mode the copy was made in, and its colors and glyph for each
+     terminal cell */
+  int glyph_mode;
+  uint64_t *dirty;
+  uint32_t *color;
+  uint32_t *glyphs;
+
+  /* output the socket hasn't taken yet, nothing more is encoded until it
+     has */
+  struct tz_buf out;
+  int sent;
+
+  struct tz_client *next;
+};
+
+/* a band of rows encoded by a paint worker into a buffer of its own */
+struct tz_band {
+  int row0, row1;
+  struct tz_buf out;
+};
+
+struct tz_recording {
+  FILE *file;
+  int flags;
+
+  /* the frame handed out last, and the one before it for delta frames to
+     copy from */
+  struct tz_buf frame;
+  struct tz_buf prev;
+  struct tz_buf stored;
+};
+
+static struct {
+  struct termios old_tty;
+  struct sigaction old_sa;
+  struct sigaction old_winch_sa;
+
+  /* set by the SIGWINCH handler, the resize itself is deferred until the
+     next paint where it's safe to reallocate the framebuffer */
+  volatile sig_atomic_t resize_pending;
+  void (*resize_callback)(int w, int h);
+
+  /* canvas size in terminal cells requested at init, or zero to follow the
+     terminal */
+  int req_rows;
+  int req_cols;
+
+  /* canvas size in terminal cells, and in framebuffer cells of 1x2 pixels,
+     which only match in half block mode */
+  int cell_rows;
+  int cell_cols;
+  int rows;
+  int cols;
+  int term_cols;
+
+  /* glyph mode, the pixels each terminal cell holds, and the glyph shown
+     for each combination of them taking the foreground color */
+  int glyph_mode;
+  int cell_w;
+  int cell_h;
+  uint32_t glyphs[256];
+
+  /* dirty bits of the terminal cells in the finer glyph modes, gathered from
+     the framebuffer's */
+  uint64_t *cell_dirty;
+
+  /* paint backend, the terminal's cell size in pixels, and scratch space for
+     encoding images */
+  int backend;
+  int cell_px_w;
+  int cell_px_h;
+  struct tz_buf image;
+  struct tz_buf image_z;
+  uint8_t *sixel_masks;
+  int sixel_masks_size;
+
+  /* screen row of the top of the canvas, or -1 while it's still unknown and
+     the canvas is addressed relative to the saved cursor */
+  atomic_int y;
+
+  /* capabilities are assumed until the probe replies have been collected.
+     the replies may be read on the input thread while painting reads the
+     results, so those are atomic, and caps is set before probing is cleared */
+  atomic_int caps;
+  int probe_caps;
+  atomic_int probing;
+  int64_t probe_deadline;
+  atomic_int cursor_pending;
+
+  /* partial probe reply carried over between reads */
+  char pending[64];
+  int pending_len;
+
+  /* viewport of the bound target */
+  int x0, y0;
+  int x1, y1;
 
-  uint64_t dirty[TZ_MAX_ROWS][TZ_MAX_COLS / 64];
+  uint32_t fg_color;
+  uint32_t bg_color;
 
-  uint32_t color[TZ_MAX_ROWS << 1][TZ_MAX_COLS];
-  uint8_t depth[TZ_MAX_ROWS << 1][TZ_MAX_COLS];
-  char chars[TZ_MAX_ROWS][TZ_MAX_COLS];
+  /* what tz_print last formatted, so printing the same again isn't parsed */
+  struct tz_text print_text;
+
+  struct tz_scroll_op scrolls[TZ_MAX_SCROLLS];
+  int num_scrolls;
+
+  /* the canvas is drawn to unless a layer is bound, and is also what gets
+     painted until layers exist, at which point the layers and canvas are
+     composited into a separate screen surface which is painted instead */
+  struct tz_surface canvas;
+  struct tz_surface composite;
+  struct tz_surface *screen;
+  struct tz_surface *target;
+
+  /* sorted by z, lowest first */
+  struct tz_layer *layers;
+
+  /* texture tz_triangle fills with, if any */
+  struct tz_texture *texture;
+
+  /* size of tz_points' squares, less than 1 meaning 1 */
+  int point_size;
+
+  /* where the row being filled crosses tz_fill_polygon's edges */
+  float *span_xs;
+  int span_xs_cap;
+
+  /* mesh vertices transformed to clip space by tz_mesh_draw */
+  struct tz_vertex *mesh_verts;
+  int mesh_verts_cap;
+
+  struct tz_buf out;
+
+  /* cleared by tz_stop to return from tz_run */
+  volatile sig_atomic_t running;
+
+  int input_modes;
+  struct tz_decoder decoder;
+  struct tz_event_queue events;
+  atomic_int input_eof;
+
+  /* the input thread is stopped through one pipe and signals new events
+     through the other */
+  pthread_t input_thread;
+  int input_threaded;
+  int stop_pipe[2];
+  int wake_pipe[2];
+
+  /* workers encoding bands of the dirty rows alongside tz_paint, which
+     encodes the first band itself. each paint bumps the generation to wake
+     them and waits for busy to drop back to zero */
+  int paint_threads;
+  pthread_t *workers;
+  struct tz_band *bands;
+  pthread_mutex_t pool_lock;
+  pthread_cond_t pool_wake;
+  pthread_cond_t pool_done;
+  unsigned pool_generation;
+  int pool_busy;
+  int pool_quit;
+  const struct tz_surface *pool_screen;
+  uint64_t *pool_dirty;
+  int pool_words;
+  int pool_truecolor;
+
+  /* lossy painting settings, the colors and glyph the terminal shows for
+     each cell, zero where unknown, and the cells shown in colors off from
+     the real ones, cycled through a band of rows per paint */
+  int lossy_threshold;
+  int lossy_refresh;
+  int lossy_phase;
+  uint32_t *shown;
+  uint64_t *stale;
+
+  /* recording of the painted frames, with the last one kept for delta
+     frames */
+  FILE *record;
+  int record_flags;
+  int64_t record_start;
+  struct tz_buf record_prev;
+  struct tz_buf record_delta;
+
+  /* broadcast socket and the viewers attached to it */
+  int serving;
+  int serve_fd;
+  struct sockaddr_un serve_addr;
+  struct tz_client *clients;
 } tz;
 
 static const uint32_t ansi_lut[256] = {
@@ -135,12 +974,20 @@ static int tz_ctz64(uint64_t x) {
   return r;
 }
 
+static int tz_popcount64(uint64_t v) {
+  return (int)__popcnt64(v);
+}
+
 #else
 
 static inline int tz_ctz64(uint64_t v) {
   return v ? __builtin_ctzll(v) : 64;
 }
 
+static inline int tz_popcount64(uint64_t v) {
+  return __builtin_popcountll(v);
+}
+
 #endif
 
 static uint8_t tz_clamp_u8(int c) {
@@ -163,596 +1010,5451 @@ static uint32_t tz_color(uint8_t r, uint8_t g, uint8_t b) {
   return (b << 16) | (g << 8) | r;
 }
 
-static void tz_write(const char *fmt, ...) {
-  char buf[TZ_MAX_COLS];
-  va_list args;
-  ssize_t res;
-  int len;
+static void *tz_alloc(size_t size) {
+  void *ptr = NULL;
 
-  va_start(args, fmt);
-  len = vsnprintf(buf, sizeof(buf), fmt, args);
-  va_end(args);
+  if (posix_memalign(&ptr, TZ_CACHE_LINE, size)) {
+    fprintf(stderr, "terminizer: failed to allocate %zu bytes\n", size);
+    exit(EXIT_FAILURE);
+  }
 
-  res = write(STDOUT_FILENO, buf, len);
-  (void)res;
+  memset(ptr, 0, size);
+
+  return ptr;
 }
 
-static void tz_get_cursor(int *row, int *col) {
-  char buf[32];
-  int len;
+static inline uint64_t *tz_dirty_at(const struct tz_surface *s, int col, int row) {
+  return &s->dirty[row * (s->stride / 64) + (col / 64)];
+}
 
-  tz_write("\x1b[6n");
+static inline uint64_t *tz_drawn_at(const struct tz_surface *s, int col, int row) {
+  return &s->drawn[row * (s->stride / 64) + (col / 64)];
+}
 
-  len = tz_read(buf, sizeof(buf));
+#ifdef TZ_PACKED_CELLS
 
-  if (len <= 0) {
-    *row = 0;
-    *col = 0;
-    return;
-  }
+/* how far apart the colors and chars of neighbouring pixels in a row are */
+#define TZ_COLOR_STEP (int)(sizeof(struct tz_cell) / sizeof(uint32_t))
+#define TZ_CHAR_STEP (int)sizeof(struct tz_cell)
 
-  sscanf(buf, "\x1b[%d;%dR", row, col);
+static inline uint32_t *tz_color_at(const struct tz_surface *s, int x, int y) {
+  return &s->cells[(y >> 1) * s->stride + x].color[y & 1];
 }
 
-static void tz_get_bounds(int *rows, int *cols) {
-  int row[2];
-  int col[2];
+static inline uint8_t *tz_depth_at(const struct tz_surface *s, int x, int y) {
+  return &s->cells[(y >> 1) * s->stride + x].depth[y & 1];
+}
 
-  /* save initial cursor position */
-  tz_get_cursor(&row[0], &col[0]);
+static inline uint8_t *tz_char_at(const struct tz_surface *s, int x, int y) {
+  return &s->cells[(y >> 1) * s->stride + x].c;
+}
 
-  /* move the cursor really far and query how far it actually moved */
-  tz_write("\x1b[9999;9999H");
-  tz_get_cursor(&row[1], &col[1]);
+#else
 
-  /* restore initial cursor position */
-  tz_write("\x1b[%d;%dH", row[0], col[0]);
+#define TZ_COLOR_STEP 1
+#define TZ_CHAR_STEP 1
 
-  *rows = row[1];
-  *cols = col[1];
+static inline uint32_t *tz_color_at(const struct tz_surface *s, int x, int y) {
+  return &s->color[y * s->stride + x];
 }
 
-static void tz_set_dirty(int x, int y) {
-  uint64_t dirty_bit = UINT64_C(1) << (x & 63);
-  tz.dirty[y >> 1][x / 64] |= dirty_bit;
+static inline uint8_t *tz_depth_at(const struct tz_surface *s, int x, int y) {
+  return &s->depth[y * s->stride + x];
 }
 
-static void tz_flush_pixel(int x, int y, uint8_t r, uint8_t g, uint8_t b, uint8_t depth) {
-  /* assume pixel is dirty */
-  tz_set_dirty(x, y);
+static inline uint8_t *tz_char_at(const struct tz_surface *s, int x, int y) {
+  return &s->chars[(y >> 1) * s->stride + x];
+}
+
+#endif
+
+/* code point of the char in the cell holding pixel (x, y), or 0 */
+static inline uint32_t tz_get_char(const struct tz_surface *s, int x, int y) {
+  uint8_t c = *tz_char_at(s, x, y);
 
-  tz.color[y][x] = tz_color(r, g, b);
-  tz.depth[y][x] = depth;
-  tz.chars[y >> 1][x] = 0;
+  return c == TZ_CHAR_CODE ? s->codes[(y >> 1) * s->stride + x] : c;
 }
 
-static void tz_set_color(int x, int y, uint32_t color) {
-  uint32_t *old_color = &tz.color[y][x];
-  char *old_c = &tz.chars[y >> 1][x];
+static void tz_put_char(struct tz_surface *s, int x, int y, uint32_t c) {
+  if (c < 0x80) {
+    *tz_char_at(s, x, y) = (uint8_t)c;
+    return;
+  }
 
-  if (*old_color != color || *old_c != 0) {
-    tz_set_dirty(x, y);
+  if (!s->codes) {
+    s->codes = tz_alloc(s->rows * s->stride * sizeof(uint32_t));
   }
 
-  *old_color = color;
-  *old_c = 0;
+  *tz_char_at(s, x, y) = TZ_CHAR_CODE;
+  s->codes[(y >> 1) * s->stride + x] = c;
 }
 
-static void tz_set_char(int x, int y, uint32_t fg_color, uint32_t bg_color, uint8_t c) {
-  uint32_t *old_fg_color = &tz.color[y & ~1][x];
-  uint32_t *old_bg_color = &tz.color[y | 1][x];
-  char *old_c = &tz.chars[y >> 1][x];
+/* returns space for at least n more bytes at the end of the buffer */
+static char *tz_buf_reserve(struct tz_buf *buf, int n) {
+  if (buf->len + n > buf->cap) {
+    int cap = TZ_MAX(TZ_MAX(buf->cap * 2, buf->len + n), TZ_BUFFER_SIZE);
+    char *data = realloc(buf->data, cap);
 
-  if (*old_fg_color != fg_color || *old_bg_color != bg_color || *old_c != c) {
-    tz_set_dirty(x, y);
+    if (!data) {
+      fprintf(stderr, "terminizer: failed to allocate %d bytes\n", cap);
+      exit(EXIT_FAILURE);
+    }
+
+    buf->data = data;
+    buf->cap = cap;
   }
 
-  *old_fg_color = fg_color;
-  *old_bg_color = bg_color;
-  *old_c = c;
+  return buf->data + buf->len;
 }
 
-static void tz_reset() {
-  /* reset cursor */
-  tz_write("\x1b[%d;1H", 1 + tz.y + tz.rows);
-  tz_write("\x1b[0m");
-  tz_write("\x1b[?25h");
+static char *tz_put_dec(char *p, int v) {
+  char digits[12];
+  int n = 0;
 
-  /* reset tty */
-  tcsetattr(0, TCSANOW, &tz.old_tty);
+  do {
+    digits[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+
+  while (n) {
+    *p++ = digits[--n];
+  }
+
+  return p;
 }
 
-static void tz_sigint(int sig) {
-  tz_reset();
+static char *tz_put_dec3(char *p, int v) {
+  p[0] = '0' + v / 100;
+  p[1] = '0' + (v / 10) % 10;
+  p[2] = '0' + v % 10;
+  return p + 3;
+}
 
-  /* uninstall ourself and re-raise */
-  sigaction(SIGINT, &tz.old_sa, NULL);
-  raise(SIGINT);
+static void tz_write(const char *fmt, ...) {
+  char *buf = tz_buf_reserve(&tz.out, TZ_BUFFER_SIZE);
+  va_list args;
+  int len;
+
+  va_start(args, fmt);
+  len = vsnprintf(buf, TZ_BUFFER_SIZE, fmt, args);
+  va_end(args);
+
+  tz.out.len += TZ_CLAMP(len, 0, TZ_BUFFER_SIZE - 1);
 }
 
-int tz_prompt(int y, const char *prompt, char *out, int n) {
-  y += tz.y0;
+static void tz_flush() {
+  int off = 0;
 
-  /* draw prompt */
-  int row = y >> 1;
-  tz_write("\x1b[%d;1H", 1 + row);
-  tz_write(prompt);
+  while (off < tz.out.len) {
+    ssize_t res = write(STDOUT_FILENO, tz.out.data + off, tz.out.len - off);
 
-  /* read line */
-  char buf[TZ_MAX_COLS];
-  int done = 0;
+    if (res < 0) {
+      struct pollfd fds = {
+          .fd = STDOUT_FILENO,
+          .events = POLLOUT,
+      };
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        poll(&fds, 1, -1);
+      } else if (errno != EINTR) {
+        break;
+      }
+
+      continue;
+    }
+
+    off += res;
+  }
+
+  tz.out.len = 0;
+}
+
+static int64_t tz_time_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static int64_t tz_time_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((int64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static int tz_get_cursor(int *row, int *col) {
+  char buf[64];
   int len = 0;
+  int64_t deadline = tz_time_ms() + TZ_PROBE_TIMEOUT_MS;
 
-  while (!done) {
-    int res = tz_read(buf, sizeof(buf));
+  tz_write("\x1b[6n");
+  tz_flush();
 
-    if (!res) {
+  /* wait for the report, giving up if the terminal doesn't answer */
+  while (len < (int)sizeof(buf) - 1) {
+    struct pollfd fds = {
+        .fd = STDIN_FILENO,
+        .events = POLLIN,
+    };
+    int timeout = (int)(deadline - tz_time_ms());
+
+    if (timeout <= 0 || poll(&fds, 1, timeout) <= 0) {
       break;
     }
 
-    if (buf[0] == '\x1b') {
-      /* FIXME line editing and history */
-    } else if (buf[0] == '\x7F') {
-      /* handle backspace */
-      if (len) {
-        tz_write("\b \b");
-        len--;
-      }
-    } else {
-      for (int i = 0; i < res; i++) {
-        char c = buf[i];
+    int res = read(STDIN_FILENO, buf + len, sizeof(buf) - 1 - len);
 
-        if (c == '\0' || c == '\r') {
-          done = 1;
-          break;
-        }
+    if (res <= 0) {
+      break;
+    }
 
-        tz_write("%c", c);
+    len += res;
+    buf[len] = 0;
 
-        if (isprint(c) && len < n) {
-          out[len++] = c;
-        }
-      }
-    }
-  }
+    char *report = strrchr(buf, '\x1b');
 
-  if (len < n) {
-    out[len] = 0;
+    if (buf[len - 1] == 'R' && report && sscanf(report, "\x1b[%d;%dR", row, col) == 2) {
+      return 1;
+    }
   }
 
-  /* erase prompt */
-  tz_write("\x1b[1K");
+  *row = 0;
+  *col = 0;
 
-  return len;
+  return 0;
 }
 
-int tz_read(char *out, int n) {
-  int res = read(STDIN_FILENO, out, n);
+static int tz_get_winsize(int *rows, int *cols) {
+  struct winsize ws;
 
-  if (res <= 0) {
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) || !ws.ws_row || !ws.ws_col) {
     return 0;
   }
 
-  if (out[0] == '\x3') {
-    raise(SIGINT);
-    return 0;
+  *rows = ws.ws_row;
+  *cols = ws.ws_col;
+
+  /* not every terminal reports its size in pixels */
+  if (ws.ws_xpixel && ws.ws_ypixel) {
+    tz.cell_px_w = ws.ws_xpixel / ws.ws_col;
+    tz.cell_px_h = ws.ws_ypixel / ws.ws_row;
   }
 
-  return res;
+  return 1;
 }
 
-int tz_can_read() {
-  struct pollfd fds = {
-      .fd = STDIN_FILENO,
-      .events = POLLIN,
-  };
+static void tz_get_bounds(int *rows, int *cols) {
+  int row[2];
+  int col[2];
 
-  int ret = poll(&fds, 1, 0);
+  /* save initial cursor position */
+  tz_get_cursor(&row[0], &col[0]);
 
-  return ret > 0;
+  /* move the cursor really far and query how far it actually moved */
+  tz_write("\x1b[9999;9999H");
+
+  if (!tz_get_cursor(&row[1], &col[1])) {
+    /* the terminal didn't answer, fall back to the classic size */
+    row[1] = 24;
+    col[1] = 80;
+  }
+
+  /* restore initial cursor position */
+  tz_write("\x1b[%d;%dH", row[0], col[0]);
+
+  *rows = row[1];
+  *cols = col[1];
 }
 
-void tz_paint() {
-  int last_fg_color = -1;
-  int last_bg_color = -1;
-  int last_row = -1;
-  int last_col = -1;
+/* writes a move to a cell of the canvas, whose top is at screen row y or
+   unknown if negative. it only formats into p, so signal handlers can use it */
+static char *tz_put_goto(char *p, int y, int row, int col) {
+  if (y >= 0) {
+    *p++ = '\x1b';
+    *p++ = '[';
+    p = tz_put_dec(p, 1 + y + row);
+    *p++ = ';';
+    p = tz_put_dec(p, 1 + col);
+    *p++ = 'H';
+
+    return p;
+  }
 
-  /* emit "begin synchronized update" code */
-  tz_write("\x1b[?2026");
+  /* the top of the canvas isn't known yet, so move relative to the cursor
+     saved there at init. restoring the cursor also restores the attributes
+     saved with it, which the caller must account for */
+  *p++ = '\x1b';
+  *p++ = '8';
+
+  if (row) {
+    *p++ = '\x1b';
+    *p++ = '[';
+    p = tz_put_dec(p, row);
+    *p++ = 'B';
+  }
 
-  for (int row = 0; row < tz.rows; row++) {
-    for (int col = 0; col < tz.cols; col += 64) {
-      uint64_t dirty = tz.dirty[row][col / 64];
+  if (col) {
+    *p++ = '\x1b';
+    *p++ = '[';
+    p = tz_put_dec(p, col);
+    *p++ = 'C';
+  }
 
-      if (!dirty) {
-        continue;
-      }
+  return p;
+}
 
-      tz.dirty[row][col / 64] = 0;
+/* returns whether the move restored the saved cursor's attributes */
+static int tz_buf_goto(struct tz_buf *buf, int row, int col) {
+  int y = tz.y;
+  char *p = tz_put_goto(tz_buf_reserve(buf, 32), y, row, col);
 
-      while (dirty) {
-        int dirty_bit = tz_ctz64(dirty);
-        dirty &= ~(UINT64_C(1) << dirty_bit);
-        col |= dirty_bit;
+  buf->len = p - buf->data;
+
+  return y < 0;
+}
+
+static int tz_goto(int row, int col) {
+  return tz_buf_goto(&tz.out, row, col);
+}
+
+static void tz_probe_caps() {
+  const char *colorterm = getenv("COLORTERM");
+
+  /* assume the capabilities used before probing existed until the replies
+     say otherwise */
+  tz.caps = TZ_CAP_TRUECOLOR | TZ_CAP_SYNC_OUTPUT;
+  tz.probe_caps = 0;
+
+  if (colorterm && (!strcmp(colorterm, "truecolor") || !strcmp(colorterm, "24bit"))) {
+    tz.probe_caps |= TZ_CAP_TRUECOLOR;
+  }
+
+  /* truecolor: set a direct color and ask for the current sgr back */
+  tz_write("\x1b[38:2::1:2:3m\x1bP$qm\x1b\\\x1b[0m");
+
+  /* synchronized output and left / right margins: request the modes' state */
+  tz_write("\x1b[?2026$p");
+  tz_write("\x1b[?69$p");
+
+  /* kitty graphics: query support with a 1x1 image */
+  tz_write("\x1b_Gi=31,s=1,v=1,a=q,t=d,f=24;AAAA\x1b\\");
+
+  /* every terminal answers the primary device attributes, and answers them in
+     order, so its reply marks the end of the replies to the probes above */
+  tz_write("\x1b[c");
+
+  tz.probing = 1;
+  tz.probe_deadline = tz_time_ms() + TZ_PROBE_TIMEOUT_MS;
+}
+
+static void tz_finish_probe() {
+  tz.caps = tz.probe_caps;
+  tz.probing = 0;
+}
+
+static int tz_probe_active() {
+  if (tz.probing && tz_time_ms() > tz.probe_deadline) {
+    tz_finish_probe();
+  }
+
+  return tz.probing || tz.cursor_pending;
+}
+
+/* returns the length of the probe reply at the start of buf, 0 if it isn't
+   one, or -1 if it may be one that hasn't been fully read yet */
+static int tz_parse_reply(const char *buf, int len) {
+  int partial = tz_probe_active() ? -1 : 0;
+
+  if (buf[0] != '\x1b') {
+    return 0;
+  }
+
+  if (len < 2) {
+    return partial;
+  }
+
+  if (buf[1] == '[') {
+    int i = 2;
+
+    while (i < len && buf[i] >= 0x20 && buf[i] <= 0x3f) {
+      i++;
+    }
+
+    if (i >= len) {
+      return partial;
+    }
 
-        uint32_t fg_color = tz.color[(row << 1) + 0][col];
-        uint32_t bg_color = tz.color[(row << 1) + 1][col];
+    char final = buf[i];
 
-        if (last_row == -1 || last_col == -1) {
-          tz_write("\x1b[%d;%dH", 1 + tz.y + row, 1 + col);
+    if (final == 'c' && buf[2] == '?') {
+      /* primary device attributes, all probes have been answered. attribute
+         4 is sixel support */
+      for (int j = 3, attr = 0; j <= i; j++) {
+        if (buf[j] >= '0' && buf[j] <= '9') {
+          attr = attr * 10 + buf[j] - '0';
         } else {
-          int dy = row - last_row;
-          int dx = col - last_col;
-
-          if (dx || dy) {
-            tz_write("\x1b[%d;%dH", 1 + tz.y + row, 1 + col);
-          } else if (dx > 0) {
-            tz_write("\x1b[%dC", dx);
-          } else if (dx < 0) {
-            tz_write("\x1b[%dD", -dx);
-          } else if (dy > 0) {
-            tz_write("\x1b[%dB", dy);
-          } else if (dy < 0) {
-            tz_write("\x1b[%dA", -dy);
+          if (attr == 4 && tz.probing) {
+            tz.probe_caps |= TZ_CAP_SIXEL;
           }
-        }
 
-        if (fg_color != last_fg_color) {
-          uint8_t r = tz_red(fg_color);
-          uint8_t g = tz_green(fg_color);
-          uint8_t b = tz_blue(fg_color);
-          tz_write("\x1b[38;2;%03d;%03d;%03dm", r, g, b);
+          attr = 0;
         }
+      }
 
-        if (bg_color != last_bg_color) {
-          uint8_t r = tz_red(bg_color);
-          uint8_t g = tz_green(bg_color);
-          uint8_t b = tz_blue(bg_color);
-          tz_write("\x1b[48;2;%03d;%03d;%03dm", r, g, b);
-        }
+      if (tz.probing) {
+        tz_finish_probe();
+      }
+    } else if (final == 'y' && buf[2] == '?' && buf[i - 1] == '$') {
+      int mode = 0, value = 0;
 
-        if (tz.chars[row][col]) {
-          tz_write("%c", tz.chars[row][col]);
-        } else {
-          tz_write("%lc", 0x2580);
-        }
+      sscanf(buf + 3, "%d;%d", &mode, &value);
 
-        last_fg_color = fg_color;
-        last_bg_color = bg_color;
-        last_col = col + 1;
-        last_row = row;
+      if (mode == 2026 && value >= 1 && value <= 3) {
+        tz.probe_caps |= TZ_CAP_SYNC_OUTPUT;
+      } else if (mode == 69 && value >= 1 && value <= 3) {
+        tz.probe_caps |= TZ_CAP_LR_MARGINS;
+      }
+    } else if (final == 'R' && tz.cursor_pending) {
+      int row = 0, col = 0;
 
-        /* reset col offset for next iteration */
-        col &= ~63;
+      sscanf(buf + 2, "%d;%d", &row, &col);
+
+      /* the cursor was parked at the top of the canvas when queried */
+      tz.y = TZ_MAX(row - 1, 0);
+      tz.cursor_pending = 0;
+    } else {
+      return 0;
+    }
+
+    return i + 1;
+  }
+
+  if (buf[1] == 'P' || buf[1] == '_') {
+    const char *end = NULL;
+
+    for (int i = 2; i + 1 < len; i++) {
+      if (buf[i] == '\x1b' && buf[i + 1] == '\\') {
+        end = buf + i + 2;
+        break;
       }
     }
+
+    if (!end) {
+      return len < (int)sizeof(tz.pending) ? partial : 0;
+    }
+
+    char reply[sizeof(tz.pending) * 2];
+    int n = TZ_MIN((int)(end - buf), (int)sizeof(reply) - 1);
+
+    memcpy(reply, buf, n);
+    reply[n] = 0;
+
+    if (!strncmp(reply, "\x1bP1$r", 5) && (strstr(reply, "1:2:3") || strstr(reply, "1;2;3"))) {
+      tz.probe_caps |= TZ_CAP_TRUECOLOR;
+    } else if (!strncmp(reply, "\x1b_Gi=31;OK", 10)) {
+      tz.probe_caps |= TZ_CAP_KITTY_GRAPHICS;
+    } else if (strncmp(reply, "\x1bP", 2) && strncmp(reply, "\x1b_G", 3)) {
+      return 0;
+    }
+
+    return (int)(end - buf);
   }
 
-  /* reset mode */
-  tz_write("\x1b[0m");
+  return 0;
+}
 
-  /* emit "end synchronized update" code */
-  tz_write("\x1b[?2026l");
+/* strips replies to our queries out of the input, returning the new length */
+static int tz_filter_replies(char *buf, int len) {
+  int out = 0;
 
-  /* check for ctrl-c after painting is done */
-  char buf[TZ_MAX_COLS];
+  for (int i = 0; i < len;) {
+    int n = tz_parse_reply(buf + i, len - i);
 
-  while (tz_can_read()) {
-    tz_read(buf, sizeof(buf));
+    if (n < 0) {
+      /* hold on to the start of a reply until the rest arrives */
+      tz.pending_len = TZ_MIN(len - i, (int)sizeof(tz.pending));
+      memcpy(tz.pending, buf + i, tz.pending_len);
+      break;
+    }
+
+    if (n > 0) {
+      i += n;
+      continue;
+    }
+
+    buf[out++] = buf[i++];
   }
+
+  return out;
 }
 
-static int tz_skip_primitive(const struct tz_vertex *v0, const struct tz_vertex *v1, const struct tz_vertex *v2) {
-  const struct tz_vertex *prim[] = {v0, v1, v2};
-  int outside_viewport = 1;
+static uint8_t tz_ansi256(uint32_t color) {
+  static const uint8_t levels[6] = {0x00, 0x5f, 0x87, 0xaf, 0xd7, 0xff};
+  int rgb[3] = {tz_red(color), tz_green(color), tz_blue(color)};
+  int idx[3];
+  int cube_err = 0;
 
+  /* nearest entry of the 6x6x6 color cube */
   for (int i = 0; i < 3; i++) {
-    const struct tz_vertex *v = prim[i];
-    int outside_xy = v->x < -v->w || v->x > v->w || v->y < -v->w || v->y > v->w;
-    int outside_z = v->z < 0.0f || v->z > v->w;
+    idx[i] = rgb[i] < 0x30 ? 0 : rgb[i] < 0x73 ? 1 : (rgb[i] - 0x23) / 0x28;
 
-    outside_viewport &= outside_xy;
+    int d = rgb[i] - levels[idx[i]];
+    cube_err += d * d;
+  }
 
-    /* ignore primitives with any vertex outside of the near / far plane */
-    if (outside_z) {
+  /* nearest entry of the grayscale ramp */
+  int avg = (rgb[0] + rgb[1] + rgb[2]) / 3;
+  int gray = avg > 0xee ? 23 : avg < 0x08 ? 0 : (avg - 0x08) / 10;
+  int gray_err = 0;
+
+  for (int i = 0; i < 3; i++) {
+    int d = rgb[i] - (0x08 + gray * 10);
+    gray_err += d * d;
+  }
+
+  if (gray_err < cube_err) {
+    return 232 + gray;
+  }
+
+  return 16 + idx[0] * 36 + idx[1] * 6 + idx[2];
+}
+
+static void tz_set_dirty(int x, int y) {
+  uint64_t dirty_bit = UINT64_C(1) << (x & 63);
+  *tz_dirty_at(tz.target, x, y >> 1) |= dirty_bit;
+}
+
+/* set bits [col0, col1) of a row of cell bits a word at a time */
+static void tz_set_span_bits(uint64_t *bits, int col0, int col1) {
+  while (col0 < col1) {
+    int bit = col0 & 63;
+    int n = TZ_MIN(col1 - col0, 64 - bit);
+
+    bits[col0 / 64] |= (UINT64_C(-1) >> (64 - n)) << bit;
+
+    col0 += n;
+  }
+}
+
+static void tz_set_dirty_span(struct tz_surface *s, int row, int col0, int col1) {
+  tz_set_span_bits(tz_dirty_at(s, 0, row), col0, col1);
+}
+
+static void tz_set_dirty_all(struct tz_surface *s) {
+  for (int row = 0; row < s->rows; row++) {
+    tz_set_dirty_span(s, row, 0, s->cols);
+  }
+}
+
+/* code points taking no cells and two cells, in ascending order */
+static const uint32_t tz_zero_width[][2] = {
+    {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x0610, 0x061a}, {0x064b, 0x065f},
+    {0x1ab0, 0x1aff}, {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x202a, 0x202e}, {0x2060, 0x2064},
+    {0x20d0, 0x20ff}, {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f}, {0xfeff, 0xfeff}, {0xe0100, 0xe01ef},
+};
+
+static const uint32_t tz_double_width[][2] = {
+    {0x1100, 0x115f},   {0x231a, 0x231b},   {0x2329, 0x232a},   {0x23e9, 0x23ec},   {0x23f0, 0x23f0},
+    {0x23f3, 0x23f3},   {0x25fd, 0x25fe},   {0x2614, 0x2615},   {0x2648, 0x2653},   {0x267f, 0x267f},
+    {0x2693, 0x2693},   {0x26a1, 0x26a1},   {0x26aa, 0x26ab},   {0x26bd, 0x26be},   {0x26c4, 0x26c5},
+    {0x26ce, 0x26ce},   {0x26d4, 0x26d4},   {0x26ea, 0x26ea},   {0x26f2, 0x26f3},   {0x26f5, 0x26f5},
+    {0x26fa, 0x26fa},   {0x26fd, 0x26fd},   {0x2705, 0x2705},   {0x270a, 0x270b},   {0x2728, 0x2728},
+    {0x274c, 0x274c},   {0x274e, 0x274e},   {0x2753, 0x2755},   {0x2757, 0x2757},   {0x2795, 0x2797},
+    {0x27b0, 0x27b0},   {0x27bf, 0x27bf},   {0x2b1b, 0x2b1c},   {0x2b50, 0x2b50},   {0x2b55, 0x2b55},
+    {0x2e80, 0x303e},   {0x3041, 0x33ff},   {0x3400, 0x4dbf},   {0x4e00, 0x9fff},   {0xa000, 0xa4cf},
+    {0xa960, 0xa97f},   {0xac00, 0xd7a3},   {0xf900, 0xfaff},   {0xfe10, 0xfe19},   {0xfe30, 0xfe6f},
+    {0xff00, 0xff60},   {0xffe0, 0xffe6},   {0x16fe0, 0x16fe4}, {0x17000, 0x18aff}, {0x1b000, 0x1b2ff},
+    {0x1f004, 0x1f004}, {0x1f0cf, 0x1f0cf}, {0x1f18e, 0x1f18e}, {0x1f191, 0x1f19a}, {0x1f200, 0x1f251},
+    {0x1f300, 0x1f64f}, {0x1f680, 0x1f6ff}, {0x1f900, 0x1f9ff}, {0x1fa70, 0x1faff}, {0x20000, 0x2fffd},
+    {0x30000, 0x3fffd},
+};
+
+static int tz_in_ranges(uint32_t c, const uint32_t (*ranges)[2], int n) {
+  int lo = 0;
+  int hi = n - 1;
+
+  while (lo <= hi) {
+    int mid = (lo + hi) >> 1;
+
+    if (c < ranges[mid][0]) {
+      hi = mid - 1;
+    } else if (c > ranges[mid][1]) {
+      lo = mid + 1;
+    } else {
       return 1;
     }
   }
 
-  /* ignore primitives completely outside of the viewport */
-  return outside_viewport;
+  return 0;
 }
 
-void tz_triangle(const struct tz_vertex *v0, const struct tz_vertex *v1, const struct tz_vertex *v2) {
-  if (tz_skip_primitive(v0, v1, v2)) {
+/* cells a code point takes, 0 for controls and combining marks, which are
+   dropped rather than combined */
+static int tz_char_width(uint32_t c) {
+  if (c < 0x20 || (c >= 0x7f && c < 0xa0)) {
+    return 0;
+  }
+
+  if (c < 0x300) {
+    return 1;
+  }
+
+  if (tz_in_ranges(c, tz_zero_width, sizeof(tz_zero_width) / sizeof(tz_zero_width[0]))) {
+    return 0;
+  }
+
+  return 1 + tz_in_ranges(c, tz_double_width, sizeof(tz_double_width) / sizeof(tz_double_width[0]));
+}
+
+/* decodes the code point at the start of p, setting len to the bytes it
+   takes. malformed bytes decode to U+FFFD one at a time */
+static uint32_t tz_decode_utf8(const uint8_t *p, int n, int *len) {
+  static const uint32_t min[4] = {0, 0x80, 0x800, 0x10000};
+  int extra = p[0] < 0x80 ? 0 : p[0] < 0xc0 ? -1 : p[0] < 0xe0 ? 1 : p[0] < 0xf0 ? 2 : p[0] < 0xf8 ? 3 : -1;
+
+  *len = 1;
+
+  if (extra <= 0 || extra >= n) {
+    return extra ? 0xfffd : p[0];
+  }
+
+  uint32_t c = p[0] & (0x7f >> (extra + 1));
+
+  for (int i = 1; i <= extra; i++) {
+    if ((p[i] & 0xc0) != 0x80) {
+      return 0xfffd;
+    }
+
+    c = (c << 6) | (p[i] & 0x3f);
+  }
+
+  if (c < min[extra] || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff)) {
+    return 0xfffd;
+  }
+
+  *len = extra + 1;
+
+  return c;
+}
+
+static int tz_is_wide(const struct tz_surface *s, int x, int y) {
+  return *tz_char_at(s, x, y) == TZ_CHAR_CODE && tz_char_width(tz_get_char(s, x, y)) == 2;
+}
+
+static int tz_is_tail(const struct tz_surface *s, int x, int y) {
+  return *tz_char_at(s, x, y) == TZ_CHAR_CODE && tz_get_char(s, x, y) == TZ_WIDE_TAIL;
+}
+
+/* blanks the cell at (x, y) if it holds half of a double width char whose
+   other half is gone, as the terminal clears both halves when either is
+   overwritten */
+static void tz_fix_wide(struct tz_surface *s, int x, int y) {
+  if (x < 0 || x >= s->cols || *tz_char_at(s, x, y) != TZ_CHAR_CODE) {
     return;
   }
 
-  /* translate to ndc space */
-  float x0_norm = v0->x / v0->w;
-  float y0_norm = v0->y / v0->w;
-  float z0_norm = v0->z / v0->w;
-  float x1_norm = v1->x / v1->w;
-  float y1_norm = v1->y / v1->w;
-  float z1_norm = v1->z / v1->w;
-  float x2_norm = v2->x / v2->w;
-  float y2_norm = v2->y / v2->w;
-  float z2_norm = v2->z / v2->w;
+  int left = x - tz.cell_w;
+  int right = x + tz.cell_w;
+  int orphan = 0;
 
-  /* translate to screen space */
-  int half_w = (tz.x1 - tz.x0 + 1) >> 1;
-  int half_h = (tz.y1 - tz.y0 + 1) >> 1;
-  int mid_x = tz.x0 + half_w;
-  int mid_y = tz.y0 + half_h;
+  if (tz_is_tail(s, x, y)) {
+    orphan = left < 0 || !tz_is_wide(s, left, y);
+  } else if (tz_is_wide(s, x, y)) {
+    orphan = right >= s->cols || !tz_is_tail(s, right, y);
+  }
+
+  if (orphan) {
+    *tz_char_at(s, x, y) = ' ';
+    *tz_dirty_at(s, x, y >> 1) |= UINT64_C(1) << (x & 63);
+  }
+}
+
+/* checks the dirty cells and their neighbours for broken double width chars
+   once per paint, rather than on every pixel write */
+static void tz_fix_wide_all(struct tz_surface *s) {
+  if (!s->codes) {
+    return;
+  }
+
+  for (int row = 0; row < s->rows; row++) {
+    for (int col = 0; col < s->cols; col += 64) {
+      uint64_t dirty = *tz_dirty_at(s, col, row);
+
+      while (dirty) {
+        int dirty_bit = tz_ctz64(dirty);
+        dirty &= ~(UINT64_C(1) << dirty_bit);
+
+        int x = col | dirty_bit;
+
+        tz_fix_wide(s, x - tz.cell_w, row << 1);
+        tz_fix_wide(s, x, row << 1);
+        tz_fix_wide(s, x + tz.cell_w, row << 1);
+      }
+    }
+  }
+}
+
+static void tz_flush_pixel(int x, int y, uint8_t r, uint8_t g, uint8_t b, uint8_t depth) {
+  /* assume pixel is dirty */
+  tz_set_dirty(x, y);
+
+  *tz_color_at(tz.target, x, y) = tz_color(r, g, b);
+  *tz_depth_at(tz.target, x, y) = depth;
+  *tz_char_at(tz.target, x, y) = 0;
+}
+
+static void tz_set_color(int x, int y, uint32_t color) {
+  uint32_t *old_color = tz_color_at(tz.target, x, y);
+  uint8_t *old_c = tz_char_at(tz.target, x, y);
+
+  if (*old_color != color || *old_c != 0) {
+    tz_set_dirty(x, y);
+  }
+
+  *old_color = color;
+  *old_c = 0;
+}
+
+static void tz_set_char(int x, int y, uint32_t fg_color, uint32_t bg_color, uint32_t c) {
+  uint32_t *old_fg_color = tz_color_at(tz.target, x, y & ~1);
+  uint32_t *old_bg_color = tz_color_at(tz.target, x, y | 1);
+  uint32_t old_c = tz_get_char(tz.target, x, y);
+
+  if (*old_fg_color != fg_color || *old_bg_color != bg_color || old_c != c) {
+    tz_set_dirty(x, y);
+  }
+
+  *old_fg_color = fg_color;
+  *old_bg_color = bg_color;
+  tz_put_char(tz.target, x, y, c);
+}
+
+static void tz_reset() {
+  /* stop any reports turned on */
+  tz_input_modes(0);
+
+  /* images stay up like cells do, but sixels go back to scrolling */
+  if (tz.backend == TZ_BACKEND_SIXEL) {
+    tz_write("\x1b[?8452l");
+  }
+
+  /* reset cursor */
+  tz_goto(tz.cell_rows, 0);
+  tz_write("\x1b[0m");
+  tz_write("\x1b[?25h");
+  tz_flush();
+
+  /* reset tty */
+  tcsetattr(0, TCSANOW, &tz.old_tty);
+}
+
+/* tears down at exit what a SIGINT handler can't safely touch */
+static void tz_exit() {
+  tz_input_thread_stop();
+  tz_paint_threads(1);
+  tz_serve_stop();
+  tz_record_stop();
+  tz_reset();
+}
+
+static void tz_sigwinch(int sig) {
+  (void)sig;
+
+  tz.resize_pending = 1;
+}
+
+static void tz_sigint(int sig) {
+  /* ^C may land in the middle of a paint, or on the input thread, so only
+     write out a fixed reset with the cursor moved below the canvas and leave
+     the rest of the teardown to exit. end any synchronized update and scroll
+     margins a paint was interrupted in, as well as reports */
+  static const char reset[] = "\x1b[?2026l\x1b[r\x1b[?69l\x1b[?1002l\x1b[?1006l\x1b[?2004l\x1b[?1004l\x1b[?8452l";
+  char buf[sizeof(reset) + 64];
+  char *p = buf + sizeof(reset) - 1;
+
+  memcpy(buf, reset, sizeof(reset) - 1);
+  p = tz_put_goto(p, tz.y, tz.cell_rows, 0);
+  memcpy(p, "\x1b[0m\x1b[?25h", 10);
+  p += 10;
+
+  ssize_t ret = write(STDOUT_FILENO, buf, p - buf);
+  (void)ret;
+
+  /* reset tty */
+  tcsetattr(0, TCSANOW, &tz.old_tty);
+
+  /* uninstall ourself and re-raise */
+  sigaction(SIGINT, &tz.old_sa, NULL);
+  raise(sig);
+}
+
+/* reads input with any probe replies removed, returning -1 on eof */
+static int tz_read_input(char *out, int n) {
+  int len = TZ_MIN(tz.pending_len, n);
+
+  memcpy(out, tz.pending, len);
+  tz.pending_len = 0;
+
+  if (!len || tz_probe_active()) {
+    int res = read(STDIN_FILENO, out + len, n - len);
+
+    if (res <= 0 && !len) {
+      return -1;
+    }
+
+    len += TZ_MAX(res, 0);
+  }
+
+  len = tz_filter_replies(out, len);
+
+  if (len && out[0] == '\x3') {
+    raise(SIGINT);
+    return 0;
+  }
+
+  return len;
+}
+
+static int tz_queue_push(const struct tz_event *ev) {
+  struct tz_event_queue *q = &tz.events;
+  unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+  if (tail - head >= TZ_EVENT_QUEUE_SIZE) {
+    return 0;
+  }
+
+  q->events[tail & (TZ_EVENT_QUEUE_SIZE - 1)] = *ev;
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+
+  return 1;
+}
+
+static int tz_queue_pop(struct tz_event *ev) {
+  struct tz_event_queue *q = &tz.events;
+  unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+  if (head == tail) {
+    return 0;
+  }
+
+  *ev = q->events[head & (TZ_EVENT_QUEUE_SIZE - 1)];
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+  return 1;
+}
+
+/* how many bytes of input can be read without risking overflowing the queue,
+   every event decoded consumes at least one of them */
+static int tz_input_room() {
+  struct tz_event_queue *q = &tz.events;
+  unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+  /* room is kept back for the bytes the decoder is carrying over */
+  int room = TZ_EVENT_QUEUE_SIZE - (int)(tail - head) - (int)sizeof(tz.decoder.buf);
+
+  return TZ_MIN(room, TZ_BUFFER_SIZE);
+}
+
+static const int tz_tilde_keys[] = {
+    0,
+    TZ_KEY_HOME,
+    TZ_KEY_INSERT,
+    TZ_KEY_DELETE,
+    TZ_KEY_END,
+    TZ_KEY_PAGE_UP,
+    TZ_KEY_PAGE_DOWN,
+    TZ_KEY_HOME,
+    TZ_KEY_END,
+    0,
+    0,
+    TZ_KEY_F1 + 0,
+    TZ_KEY_F1 + 1,
+    TZ_KEY_F1 + 2,
+    TZ_KEY_F1 + 3,
+    TZ_KEY_F1 + 4,
+    0,
+    TZ_KEY_F1 + 5,
+    TZ_KEY_F1 + 6,
+    TZ_KEY_F1 + 7,
+    TZ_KEY_F1 + 8,
+    TZ_KEY_F1 + 9,
+    0,
+    TZ_KEY_F1 + 10,
+    TZ_KEY_F1 + 11,
+};
+
+/* decodes a single key, a control character or a utf-8 encoded code point */
+static int tz_decode_key(const uint8_t *p, int n, struct tz_event *ev, int force) {
+  uint8_t c = p[0];
+
+  ev->type = TZ_EVENT_KEY;
+
+  if (c == '\t' || c == '\r' || c == 0x1b || c == 0x7f) {
+    ev->key.code = c;
+  } else if (c == '\b') {
+    ev->key.code = TZ_KEY_BACKSPACE;
+  } else if (c < 0x20) {
+    /* ctrl-space sends nul, ctrl-a to ctrl-z send 1 to 26 */
+    ev->key.code = c ? c + 0x60 : ' ';
+    ev->mods |= TZ_MOD_CTRL;
+  } else if (c < 0x80) {
+    ev->key.code = c;
+  } else {
+    int len = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+
+    if (n < len && !force) {
+      return 0;
+    }
+
+    /* U+FFFD replacement character for anything malformed */
+    int code = len == 4 ? c & 0x07 : len == 3 ? c & 0x0f : c & 0x1f;
+
+    for (int i = 1; i < len; i++) {
+      if (i >= n || (p[i] & 0xc0) != 0x80) {
+        len = 1;
+        break;
+      }
+
+      code = (code << 6) | (p[i] & 0x3f);
+    }
+
+    ev->key.code = len > 1 ? code : 0xfffd;
+
+    return len;
+  }
+
+  return 1;
+}
+
+/* decodes a control sequence, that's the escape and [ already matched */
+static int tz_decode_csi(const uint8_t *p, int n, struct tz_event *ev, int force) {
+  int i = 2;
+
+  while (i < n && p[i] >= 0x20 && p[i] <= 0x3f) {
+    i++;
+  }
+
+  if (i >= n) {
+    if (!force) {
+      return 0;
+    }
+
+    /* nothing more is coming, drop what there is */
+    ev->type = -1;
+    return n;
+  }
+
+  uint8_t final = p[i];
+  uint8_t prefix = p[2] >= 0x3c && p[2] <= 0x3f ? p[2] : 0;
+  int params[4] = {0};
+  int num_params = 0;
+
+  for (int j = prefix ? 3 : 2; j < i && num_params < 4; j++) {
+    if (p[j] >= '0' && p[j] <= '9') {
+      params[num_params] = params[num_params] * 10 + (p[j] - '0');
+    } else if (p[j] == ';' || p[j] == ':') {
+      num_params++;
+    }
+  }
+
+  ev->type = TZ_EVENT_KEY;
+
+  /* xterm style modifiers are one more than the mask */
+  if (params[1] > 1 && prefix != '<') {
+    ev->mods = (params[1] - 1) & (TZ_MOD_SHIFT | TZ_MOD_ALT | TZ_MOD_CTRL);
+  }
+
+  if (prefix == '<' && (final == 'M' || final == 'm')) {
+    /* sgr mouse report */
+    int b = params[0];
+
+    ev->type = TZ_EVENT_MOUSE;
+    ev->mods = (b & 4 ? TZ_MOD_SHIFT : 0) | (b & 8 ? TZ_MOD_ALT : 0) | (b & 16 ? TZ_MOD_CTRL : 0);
+
+    if (b & 64) {
+      ev->mouse.button = b & 1 ? TZ_MOUSE_WHEEL_DOWN : TZ_MOUSE_WHEEL_UP;
+      ev->mouse.action = TZ_MOUSE_PRESS;
+    } else {
+      ev->mouse.button = (b & 3) == 3 ? TZ_MOUSE_NONE : TZ_MOUSE_LEFT + (b & 3);
+      ev->mouse.action = b & 32 ? TZ_MOUSE_MOVE : final == 'M' ? TZ_MOUSE_PRESS : TZ_MOUSE_RELEASE;
+    }
+
+    ev->mouse.x = (params[1] - 1) * tz.cell_w;
+    int top = tz.y;
+
+    ev->mouse.y = (params[2] - 1 - TZ_MAX(top, 0)) * tz.cell_h;
+  } else if (prefix) {
+    ev->type = -1;
+  } else if (final >= 'A' && final <= 'D') {
+    static const int arrows[] = {TZ_KEY_UP, TZ_KEY_DOWN, TZ_KEY_RIGHT, TZ_KEY_LEFT};
+    ev->key.code = arrows[final - 'A'];
+  } else if (final == 'H' || final == 'F') {
+    ev->key.code = final == 'H' ? TZ_KEY_HOME : TZ_KEY_END;
+  } else if (final >= 'P' && final <= 'S') {
+    ev->key.code = TZ_KEY_F1 + (final - 'P');
+  } else if (final == 'Z') {
+    ev->key.code = TZ_KEY_TAB;
+    ev->mods |= TZ_MOD_SHIFT;
+  } else if ((final == 'I' || final == 'O') && i == 2) {
+    ev->type = TZ_EVENT_FOCUS;
+    ev->focus.focused = final == 'I';
+  } else if (final == '~' && (params[0] == 200 || params[0] == 201)) {
+    /* bracketed paste markers */
+    tz.decoder.pasting = params[0] == 200;
+    ev->type = -1;
+  } else if (final == '~' && params[0] < (int)(sizeof(tz_tilde_keys) / sizeof(tz_tilde_keys[0])) &&
+             tz_tilde_keys[params[0]]) {
+    ev->key.code = tz_tilde_keys[params[0]];
+  } else {
+    ev->type = -1;
+  }
+
+  return i + 1;
+}
+
+/* decodes pasted text up to the end of the paste */
+static int tz_decode_paste(const uint8_t *p, int n, struct tz_event *ev, int force) {
+  static const char end_marker[] = "\x1b[201~";
+  const int marker_len = sizeof(end_marker) - 1;
+  int len = 0;
+
+  ev->type = TZ_EVENT_PASTE;
+
+  /* find the end marker, or the start of what could be one */
+  while (len < n && len < (int)sizeof(ev->paste.text)) {
+    if (p[len] == 0x1b) {
+      int avail = TZ_MIN(n - len, marker_len);
+
+      if (!memcmp(p + len, end_marker, avail)) {
+        if (avail == marker_len) {
+          break;
+        }
+
+        if (!force) {
+          break;
+        }
+      }
+    }
+
+    len++;
+  }
+
+  if (!len && n - len < marker_len && !force) {
+    return 0;
+  }
+
+  memcpy(ev->paste.text, p, len);
+  ev->paste.len = len;
+
+  /* swallow the end marker along with the text before it */
+  if (n - len >= marker_len && !memcmp(p + len, end_marker, marker_len)) {
+    ev->paste.end = 1;
+    tz.decoder.pasting = 0;
+
+    return len + marker_len;
+  }
+
+  return len;
+}
+
+/* decodes the event at the start of buf, returning the bytes it took, or 0 if
+   it's incomplete. when forced, whatever is there is decoded anyway. sets the
+   event type to -1 for anything that isn't handed out */
+static int tz_decode_event(const char *buf, int n, struct tz_event *ev, int force) {
+  const uint8_t *p = (const uint8_t *)buf;
+
+  memset(ev, 0, sizeof(*ev));
+
+  if (tz.decoder.pasting) {
+    return tz_decode_paste(p, n, ev, force);
+  }
+
+  if (p[0] != 0x1b) {
+    return tz_decode_key(p, n, ev, force);
+  }
+
+  if (n < 2) {
+    if (!force) {
+      return 0;
+    }
+
+    ev->type = TZ_EVENT_KEY;
+    ev->key.code = TZ_KEY_ESCAPE;
+
+    return 1;
+  }
+
+  if (p[1] == '[') {
+    return tz_decode_csi(p, n, ev, force);
+  }
+
+  if (p[1] == 'O' && n > 2) {
+    /* ss3 sequences sent by arrows, home, end and f1 to f4 in application
+       mode end in the same final bytes as their control sequences */
+    tz_decode_csi(p, 3, ev, 1);
+
+    if (p[2] == 'M') {
+      ev->type = TZ_EVENT_KEY;
+      ev->key.code = TZ_KEY_ENTER;
+    }
+
+    return 3;
+  }
+
+  if (p[1] == 'O' && !force) {
+    return 0;
+  }
+
+  /* alt sends escape followed by the key */
+  int res = tz_decode_key(p + 1, n - 1, ev, force);
+
+  ev->mods |= TZ_MOD_ALT;
+
+  return res ? res + 1 : 0;
+}
+
+/* decodes input and queues the events, carrying over any incomplete sequence
+   at the end. forced decoding flushes out a sequence that's timed out */
+static void tz_decode(const char *in, int n, int force) {
+  struct tz_decoder *d = &tz.decoder;
+  char buf[sizeof(d->buf) + TZ_BUFFER_SIZE];
+  int len = d->len;
+  int off = 0;
+
+  n = TZ_MIN(n, TZ_BUFFER_SIZE);
+
+  memcpy(buf, d->buf, len);
+
+  if (n) {
+    memcpy(buf + len, in, n);
+    len += n;
+  }
+
+  while (off < len) {
+    struct tz_event ev;
+
+    /* anything too long to carry over isn't going to be understood */
+    int res = tz_decode_event(buf + off, len - off, &ev, force || len - off > (int)sizeof(d->buf));
+
+    if (!res) {
+      break;
+    }
+
+    if (ev.type >= 0) {
+      tz_queue_push(&ev);
+    }
+
+    off += res;
+  }
+
+  if (len - off != d->len) {
+    d->time = tz_time_ms();
+  }
+
+  d->len = len - off;
+  memmove(d->buf, buf + off, d->len);
+}
+
+/* milliseconds until a carried over sequence times out, or -1 if there's
+   none */
+static int tz_input_timeout() {
+  if (!tz.decoder.len || tz.decoder.pasting) {
+    return -1;
+  }
+
+  return (int)TZ_MAX(tz.decoder.time + TZ_ESCAPE_TIMEOUT_MS - tz_time_ms(), 0);
+}
+
+static void tz_expire_input() {
+  /* text inside a paste can't be confused with a key, so only the end of the
+     paste is waited for */
+  if (tz.decoder.len && !tz.decoder.pasting && !tz_input_timeout()) {
+    tz_decode(NULL, 0, 1);
+  }
+}
+
+/* reads what input is available into the queue, returning -1 on eof. once the
+   queue is full input is either left unread, or thrown away if discard is set */
+static int tz_pump_input(int discard) {
+  char buf[TZ_BUFFER_SIZE];
+  int room = tz_input_room();
+
+  if (room <= 0 && !discard) {
+    return 0;
+  }
+
+  int len = tz_read_input(buf, room > 0 ? room : (int)sizeof(buf));
+
+  if (len < 0) {
+    atomic_store(&tz.input_eof, 1);
+    return -1;
+  }
+
+  if (room > 0) {
+    tz_decode(buf, len, 0);
+  }
+
+  return len;
+}
+
+static void *tz_input_main(void *arg) {
+  (void)arg;
+
+  while (1) {
+    struct pollfd fds[2] = {
+        {.fd = tz.stop_pipe[0], .events = POLLIN},
+        {.fd = STDIN_FILENO, .events = POLLIN},
+    };
+
+    /* with the queue full, only wait to be stopped while it drains */
+    int room = tz_input_room();
+    int res = poll(fds, room > 0 ? 2 : 1, room > 0 ? tz_input_timeout() : 1);
+
+    if (res > 0 && fds[0].revents) {
+      break;
+    }
+
+    unsigned tail = atomic_load_explicit(&tz.events.tail, memory_order_relaxed);
+    int eof = 0;
+
+    if (res > 0 && room > 0 && (fds[1].revents & (POLLIN | POLLHUP))) {
+      eof = tz_pump_input(0) < 0;
+    }
+
+    tz_expire_input();
+
+    if (eof || atomic_load_explicit(&tz.events.tail, memory_order_relaxed) != tail) {
+      /* nobody may be listening, in which case the pipe filling up is fine */
+      ssize_t ret = write(tz.wake_pipe[1], "", 1);
+      (void)ret;
+    }
+
+    if (eof) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+/* waits for input to decode or events from the input thread */
+static void tz_wait_input(int timeout) {
+  struct pollfd fds = {
+      .fd = tz.input_threaded ? tz.wake_pipe[0] : STDIN_FILENO,
+      .events = POLLIN,
+  };
+
+  if (!tz.input_threaded) {
+    int expire = tz_input_timeout();
+
+    if (expire >= 0 && (timeout < 0 || expire < timeout)) {
+      timeout = expire;
+    }
+  }
+
+  if (poll(&fds, 1, timeout) > 0 && tz.input_threaded) {
+    char buf[64];
+    ssize_t ret = read(tz.wake_pipe[0], buf, sizeof(buf));
+    (void)ret;
+  }
+}
+
+int tz_prompt(int y, const char *prompt, char *out, int n) {
+  y += tz.y0;
+
+  /* draw prompt */
+  int row = y / tz.cell_h;
+  tz_goto(row, 0);
+  tz_write("\x1b[0m");
+  tz_write(prompt);
+  tz_flush();
+
+  /* read line */
+  struct tz_event ev;
+  int done = 0;
+  int len = 0;
+
+  while (!done) {
+    if (!tz_poll_event(&ev)) {
+      if (atomic_load(&tz.input_eof)) {
+        break;
+      }
+
+      /* the input thread sets eof before waking us, so this can't miss it */
+      tz_wait_input(-1);
+      continue;
+    }
+
+    if (ev.type == TZ_EVENT_KEY && ev.key.code == TZ_KEY_ENTER) {
+      done = 1;
+    } else if (ev.type == TZ_EVENT_KEY && ev.key.code == TZ_KEY_BACKSPACE) {
+      /* handle backspace */
+      if (len) {
+        tz_write("\b \b");
+        len--;
+      }
+    } else if (ev.type == TZ_EVENT_KEY && !(ev.mods & ~TZ_MOD_SHIFT)) {
+      if (ev.key.code < 0x80 && isprint(ev.key.code) && len < n) {
+        tz_write("%c", ev.key.code);
+        out[len++] = ev.key.code;
+      }
+    } else if (ev.type == TZ_EVENT_PASTE) {
+      for (int i = 0; i < ev.paste.len; i++) {
+        char c = ev.paste.text[i];
+
+        if (isprint(c) && len < n) {
+          tz_write("%c", c);
+          out[len++] = c;
+        }
+      }
+    }
+
+    tz_flush();
+  }
+
+  if (len < n) {
+    out[len] = 0;
+  }
+
+  /* erase prompt */
+  tz_write("\x1b[1K");
+  tz_flush();
+
+  return len;
+}
+
+int tz_read(char *out, int n) {
+  return TZ_MAX(tz_read_input(out, n), 0);
+}
+
+int tz_can_read() {
+  struct pollfd fds = {
+      .fd = STDIN_FILENO,
+      .events = POLLIN,
+  };
+
+  /* a held back partial reply is handed out once probing has given up */
+  if (tz.pending_len && !tz_probe_active()) {
+    return 1;
+  }
+
+  int ret = poll(&fds, 1, 0);
+
+  return ret > 0;
+}
+
+void tz_input_modes(int modes) {
+  int changed = modes ^ tz.input_modes;
+
+  /* button event tracking reported in sgr form */
+  if (changed & TZ_INPUT_MOUSE) {
+    tz_write(modes & TZ_INPUT_MOUSE ? "\x1b[?1002h\x1b[?1006h" : "\x1b[?1002l\x1b[?1006l");
+  }
+
+  if (changed & TZ_INPUT_PASTE) {
+    tz_write(modes & TZ_INPUT_PASTE ? "\x1b[?2004h" : "\x1b[?2004l");
+  }
+
+  if (changed & TZ_INPUT_FOCUS) {
+    tz_write(modes & TZ_INPUT_FOCUS ? "\x1b[?1004h" : "\x1b[?1004l");
+  }
+
+  tz.input_modes = modes;
+
+  if (changed) {
+    tz_flush();
+  }
+}
+
+int tz_poll_event(struct tz_event *ev) {
+  if (!tz.input_threaded) {
+    if (tz_can_read()) {
+      tz_pump_input(0);
+    }
+
+    tz_expire_input();
+  }
+
+  return tz_queue_pop(ev);
+}
+
+/* starts a thread with SIGWINCH blocked, leaving it to the threads the
+   program started, one of which may be waiting in tz_run for it */
+static int tz_spawn(pthread_t *thread, void *(*start)(void *), void *arg) {
+  sigset_t winch_mask, saved_mask;
+
+  sigemptyset(&winch_mask);
+  sigaddset(&winch_mask, SIGWINCH);
+  pthread_sigmask(SIG_BLOCK, &winch_mask, &saved_mask);
+
+  int res = pthread_create(thread, NULL, start, arg);
+
+  pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+
+  return res;
+}
+
+int tz_input_thread_start() {
+  if (tz.input_threaded) {
+    return 1;
+  }
+
+  if (pipe(tz.stop_pipe)) {
+    return 0;
+  }
+
+  if (pipe(tz.wake_pipe)) {
+    close(tz.stop_pipe[0]);
+    close(tz.stop_pipe[1]);
+    return 0;
+  }
+
+  /* the thread never waits on the consumer to read its wakeups */
+  fcntl(tz.wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+  if (tz_spawn(&tz.input_thread, tz_input_main, NULL)) {
+    close(tz.stop_pipe[0]);
+    close(tz.stop_pipe[1]);
+    close(tz.wake_pipe[0]);
+    close(tz.wake_pipe[1]);
+    return 0;
+  }
+
+  tz.input_threaded = 1;
+
+  return 1;
+}
+
+void tz_input_thread_stop() {
+  if (!tz.input_threaded) {
+    return;
+  }
+
+  ssize_t ret = write(tz.stop_pipe[1], "", 1);
+  (void)ret;
+
+  pthread_join(tz.input_thread, NULL);
+
+  close(tz.stop_pipe[0]);
+  close(tz.stop_pipe[1]);
+  close(tz.wake_pipe[0]);
+  close(tz.wake_pipe[1]);
+
+  tz.input_threaded = 0;
+}
+
+static int tz_can_write() {
+  struct pollfd fds = {
+      .fd = STDOUT_FILENO,
+      .events = POLLOUT,
+  };
+
+  /* anything that can't be polled, like a regular file, never blocks */
+  int ret = poll(&fds, 1, 0);
+
+  return ret != 0;
+}
+
+/* encodes an sgr sequence setting the foreground ('3') or background ('4')
+   color */
+static char *tz_put_color(char *p, char layer, uint32_t color, int truecolor) {
+  *p++ = '\x1b';
+  *p++ = '[';
+  *p++ = layer;
+  *p++ = '8';
+  *p++ = ';';
+
+  if (truecolor) {
+    *p++ = '2';
+    *p++ = ';';
+    p = tz_put_dec3(p, tz_red(color));
+    *p++ = ';';
+    p = tz_put_dec3(p, tz_green(color));
+    *p++ = ';';
+    p = tz_put_dec3(p, tz_blue(color));
+  } else {
+    *p++ = '5';
+    *p++ = ';';
+    p = tz_put_dec(p, tz_ansi256(color));
+  }
+
+  *p++ = 'm';
+
+  return p;
+}
+
+static void tz_resize_surface(struct tz_surface *s, int rows, int cols) {
+  int stride = (cols + TZ_ROW_ALIGN - 1) & ~(TZ_ROW_ALIGN - 1);
+
+  struct tz_surface old = *s;
+
+  s->rows = rows;
+  s->cols = cols;
+  s->stride = stride;
+  s->dirty = tz_alloc(rows * (stride / 64) * sizeof(uint64_t));
+  s->drawn = tz_alloc(rows * (stride / 64) * sizeof(uint64_t));
+#ifdef TZ_PACKED_CELLS
+  s->cells = tz_alloc(rows * stride * sizeof(struct tz_cell));
+#else
+  s->color = tz_alloc((rows << 1) * stride * sizeof(uint32_t));
+  s->depth = tz_alloc((rows << 1) * stride * sizeof(uint8_t));
+  s->chars = tz_alloc(rows * stride * sizeof(uint8_t));
+#endif
+  s->codes = old.codes ? tz_alloc(rows * stride * sizeof(uint32_t)) : NULL;
+
+  /* preserve the content overlapping the old and new surface */
+  int copy_rows = TZ_MIN(rows, old.rows);
+  int copy_cols = TZ_MIN(cols, old.cols);
+
+  for (int row = 0; row < copy_rows; row++) {
+#ifdef TZ_PACKED_CELLS
+    memcpy(&s->cells[row * stride], &old.cells[row * old.stride], copy_cols * sizeof(struct tz_cell));
+#else
+    for (int i = row << 1; i <= (row << 1) + 1; i++) {
+      memcpy(tz_color_at(s, 0, i), tz_color_at(&old, 0, i), copy_cols * sizeof(uint32_t));
+      memcpy(tz_depth_at(s, 0, i), tz_depth_at(&old, 0, i), copy_cols * sizeof(uint8_t));
+    }
+
+    memcpy(tz_char_at(s, 0, row << 1), tz_char_at(&old, 0, row << 1), copy_cols * sizeof(uint8_t));
+#endif
+
+    if (old.codes) {
+      memcpy(&s->codes[row * stride], &old.codes[row * old.stride], copy_cols * sizeof(uint32_t));
+    }
+
+    /* carry over pending dirty bits, dropping any past the new width */
+    for (int col = 0; col < copy_cols; col += 64) {
+      int bits = TZ_MIN(copy_cols - col, 64);
+
+      *tz_dirty_at(s, col, row) = *tz_dirty_at(&old, col, row) & (UINT64_C(-1) >> (64 - bits));
+    }
+  }
+
+  /* rather than carry over what was drawn, the next clear goes over every
+     cell once */
+  memset(s->drawn, 0xff, rows * (stride / 64) * sizeof(uint64_t));
+
+  free(old.dirty);
+  free(old.drawn);
+#ifdef TZ_PACKED_CELLS
+  free(old.cells);
+#else
+  free(old.color);
+  free(old.depth);
+  free(old.chars);
+#endif
+  free(old.codes);
+
+  /* clear and mark newly exposed cells dirty */
+  for (int row = 0; row < rows; row++) {
+    int col0 = row < copy_rows ? copy_cols : 0;
+
+    for (int y = row << 1; y <= (row << 1) + 1; y++) {
+      for (int x = col0; x < cols; x++) {
+        *tz_color_at(s, x, y) = s->clear_color;
+        *tz_depth_at(s, x, y) = 0xff;
+      }
+    }
+
+    tz_set_dirty_span(s, row, col0, cols);
+  }
+}
+
+static void tz_free_surface(struct tz_surface *s) {
+  free(s->dirty);
+  free(s->drawn);
+#ifdef TZ_PACKED_CELLS
+  free(s->cells);
+#else
+  free(s->color);
+  free(s->depth);
+  free(s->chars);
+#endif
+  free(s->codes);
+
+  memset(s, 0, sizeof(*s));
+}
+
+static void tz_bind(struct tz_surface *s) {
+  /* each target keeps its own viewport */
+  tz.target->x0 = tz.x0;
+  tz.target->y0 = tz.y0;
+  tz.target->x1 = tz.x1;
+  tz.target->y1 = tz.y1;
+
+  tz.target = s;
+
+  tz.x0 = s->x0;
+  tz.y0 = s->y0;
+  tz.x1 = s->x1;
+  tz.y1 = s->y1;
+}
+
+static void tz_fit_viewport(struct tz_surface *s, int old_rows, int old_cols) {
+  int full = s->x0 == 0 && s->y0 == 0 && s->x1 == old_cols - 1 && s->y1 == (old_rows << 1) - 1;
+
+  /* keep viewports covering the whole surface doing so, and clamp others */
+  if (full) {
+    s->x1 = s->cols - 1;
+    s->y1 = (s->rows << 1) - 1;
+  } else {
+    s->x1 = TZ_MIN(s->x1, s->cols - 1);
+    s->y1 = TZ_MIN(s->y1, (s->rows << 1) - 1);
+  }
+}
+
+/* forgets what lossy painting knows the terminal shows, for when every cell
+   is about to be painted exactly anyway */
+static void tz_forget_shown() {
+  free(tz.shown);
+  free(tz.stale);
+
+  tz.shown = NULL;
+  tz.stale = NULL;
+}
+
+/* sizes the framebuffer for a canvas of rows x cols terminal cells */
+static void tz_resize_framebuffer(int rows, int cols) {
+  int fb_rows = (rows * tz.cell_h + 1) >> 1;
+  int fb_cols = cols * tz.cell_w;
+
+  tz_resize_surface(&tz.canvas, fb_rows, fb_cols);
+
+  for (struct tz_layer *layer = tz.layers; layer; layer = layer->next) {
+    tz_resize_surface(&layer->surface, fb_rows, fb_cols);
+  }
+
+  if (tz.screen == &tz.composite) {
+    tz_resize_surface(&tz.composite, fb_rows, fb_cols);
+  }
+
+  /* laid out like the framebuffer's dirty bits, which have at least as many
+     words per row */
+  free(tz.cell_dirty);
+  tz.cell_dirty = tz_alloc(rows * (tz.canvas.stride >> 6) * sizeof(uint64_t));
+
+  tz_forget_shown();
+
+  tz.cell_rows = rows;
+  tz.cell_cols = cols;
+  tz.rows = fb_rows;
+  tz.cols = fb_cols;
+}
+
+/* deletes kitty images, which unlike sixels aren't overwritten by painting
+   cells over them */
+static void tz_delete_images() {
+  if (tz.backend == TZ_BACKEND_KITTY) {
+    tz_write("\x1b_Ga=d,d=A,q=2\x1b\\");
+  }
+}
+
+/* resizes the canvas to rows x cols terminal cells, y rows down the screen,
+   keeping what it can */
+static void tz_resize_canvas(int rows, int cols, int y) {
+  int old_rows = tz.rows;
+  int old_cols = tz.cols;
+  struct tz_surface *target = tz.target;
+  int lossy = tz.shown != NULL;
+
+  /* stash the bound viewport with the rest while resizing */
+  tz_bind(&tz.canvas);
+  tz_resize_framebuffer(rows, cols);
+
+  /* if the canvas moved on screen, or the terminal missed scrolls that have
+     already been applied to the framebuffer, none of what was painted is
+     valid. neither are images, whose tiles have moved, nor cells painted
+     lossily, which are no longer known to be stale */
+  if (y != tz.y || tz.num_scrolls || tz.backend != TZ_BACKEND_CELLS || lossy) {
+    /* an unknown top is only ever learned from the cursor report, which may
+       have just arrived on the input thread */
+    if (y >= 0) {
+      tz.y = y;
+    }
+
+    tz.num_scrolls = 0;
+
+    tz_delete_images();
+
+    tz_set_dirty_all(tz.screen);
+  }
+
+  /* keep default viewports covering the whole canvas */
+  tz_fit_viewport(&tz.canvas, old_rows, old_cols);
+
+  for (struct tz_layer *layer = tz.layers; layer; layer = layer->next) {
+    tz_fit_viewport(&layer->surface, old_rows, old_cols);
+  }
+
+  tz.x0 = tz.canvas.x0;
+  tz.y0 = tz.canvas.y0;
+  tz.x1 = tz.canvas.x1;
+  tz.y1 = tz.canvas.y1;
+
+  tz_bind(target);
+
+  if (tz.resize_callback) {
+    tz.resize_callback(tz_width(), tz_height());
+  }
+}
+
+static void tz_resize() {
+  int term_rows, term_cols;
+
+  tz.resize_pending = 0;
+
+  if (!tz_get_winsize(&term_rows, &term_cols)) {
+    return;
+  }
+
+  tz.term_cols = term_cols;
+
+  int rows = tz.req_rows ? TZ_MIN(tz.req_rows, term_rows) : term_rows;
+  int cols = tz.req_cols ? TZ_MIN(tz.req_cols, term_cols) : term_cols;
+  int old_y = tz.y;
+  int y = old_y < 0 ? old_y : TZ_CLAMP(old_y, 0, term_rows - rows);
+
+  if (rows != tz.cell_rows || cols != tz.cell_cols || y != old_y) {
+    tz_resize_canvas(rows, cols, y);
+  }
+}
+
+static void tz_composite() {
+  struct tz_surface *screen = &tz.composite;
+
+  for (int row = 0; row < tz.rows; row++) {
+    for (int col = 0; col < tz.cols; col += 64) {
+      /* gather the cells changed in the canvas or any visible layer */
+      uint64_t *canvas_dirty = tz_dirty_at(&tz.canvas, col, row);
+      uint64_t dirty = *canvas_dirty;
+
+      *tz_drawn_at(&tz.canvas, col, row) |= dirty;
+      *canvas_dirty = 0;
+
+      for (struct tz_layer *layer = tz.layers; layer; layer = layer->next) {
+        uint64_t *layer_dirty = tz_dirty_at(&layer->surface, col, row);
+
+        if (layer->visible) {
+          dirty |= *layer_dirty;
+        }
+
+        *tz_drawn_at(&layer->surface, col, row) |= *layer_dirty;
+        *layer_dirty = 0;
+      }
+
+      while (dirty) {
+        int dirty_bit = tz_ctz64(dirty);
+        dirty &= ~(UINT64_C(1) << dirty_bit);
+
+        int x = col | dirty_bit;
+        int y = row << 1;
+
+        uint32_t color[2] = {*tz_color_at(&tz.canvas, x, y), *tz_color_at(&tz.canvas, x, y + 1)};
+        uint32_t c = tz_get_char(&tz.canvas, x, y);
+
+        /* text replaces the whole cell, while pixels only replace what's
+           below them where they aren't transparent, leaving the background of
+           any text they land on */
+        for (struct tz_layer *layer = tz.layers; layer; layer = layer->next) {
+          if (!layer->visible) {
+            continue;
+          }
+
+          uint32_t top = *tz_color_at(&layer->surface, x, y);
+          uint32_t bottom = *tz_color_at(&layer->surface, x, y + 1);
+          uint32_t layer_c = tz_get_char(&layer->surface, x, y);
+
+          if (layer_c) {
+            color[0] = top;
+            color[1] = bottom;
+            c = layer_c;
+            continue;
+          }
+
+          if (c && (top != TZ_TRANSPARENT || bottom != TZ_TRANSPARENT)) {
+            color[0] = color[1];
+            c = 0;
+          }
+
+          if (top != TZ_TRANSPARENT) {
+            color[0] = top;
+          }
+
+          if (bottom != TZ_TRANSPARENT) {
+            color[1] = bottom;
+          }
+        }
+
+        /* only mark the screen dirty where the result differs */
+        uint32_t *screen_color[2] = {tz_color_at(screen, x, y), tz_color_at(screen, x, y + 1)};
+        uint32_t screen_c = tz_get_char(screen, x, y);
+
+        if (*screen_color[0] != color[0] || *screen_color[1] != color[1] || screen_c != c) {
+          *tz_dirty_at(screen, x, row) |= UINT64_C(1) << dirty_bit;
+        }
+
+        *screen_color[0] = color[0];
+        *screen_color[1] = color[1];
+        tz_put_char(screen, x, y, c);
+      }
+    }
+  }
+}
+
+/* pixels of each terminal cell in every glyph mode */
+static const uint8_t tz_cell_sizes[][2] = {{1, 2}, {2, 2}, {2, 3}, {2, 4}};
+
+/* braille dot of each pixel of a 2x4 cell, row by row */
+static const uint8_t tz_braille_dots[8] = {0x01, 0x08, 0x02, 0x10, 0x04, 0x20, 0x40, 0x80};
+
+/* quadrant glyph of each 2x2 mask */
+static const uint32_t tz_quadrants[16] = {
+    ' ',    0x2598, 0x259d, 0x2580, 0x2596, 0x258c, 0x259e, 0x259b,
+    0x2597, 0x259a, 0x2590, 0x259c, 0x2584, 0x2599, 0x259f, 0x2588,
+};
+
+/* fills the glyph table of one of the finer modes, indexed by a mask of the
+   pixels taking the foreground color, bit y * 2 + x for the pixel at (x, y) */
+static void tz_build_glyphs(int mode) {
+  int n = 1 << (tz_cell_sizes[mode][0] * tz_cell_sizes[mode][1]);
+
+  for (int mask = 0; mask < n; mask++) {
+    uint32_t glyph = 0;
+
+    switch (mode) {
+      case TZ_GLYPH_QUADRANT: {
+        glyph = tz_quadrants[mask];
+      } break;
+
+      case TZ_GLYPH_SEXTANT: {
+        /* U+1FB00 onwards has every mask in order, except the four already
+           covered by space, the left and right half blocks and the full
+           block */
+        if (mask == 0) {
+          glyph = ' ';
+        } else if (mask == 0x15) {
+          glyph = 0x258c;
+        } else if (mask == 0x2a) {
+          glyph = 0x2590;
+        } else if (mask == 0x3f) {
+          glyph = 0x2588;
+        } else {
+          glyph = 0x1fb00 + mask - 1 - (mask > 0x15) - (mask > 0x2a);
+        }
+      } break;
+
+      case TZ_GLYPH_BRAILLE: {
+        glyph = 0x2800;
+
+        for (int i = 0; i < 8; i++) {
+          if (mask & (1 << i)) {
+            glyph |= tz_braille_dots[i];
+          }
+        }
+      } break;
+    }
+
+    tz.glyphs[mask] = glyph;
+  }
+}
+
+/* squeezes the even bits of a word into its low half, setting each where
+   either bit of the pair was set */
+static inline uint64_t tz_merge_pairs(uint64_t x) {
+  x = (x | (x >> 1)) & UINT64_C(0x5555555555555555);
+  x = (x | (x >> 1)) & UINT64_C(0x3333333333333333);
+  x = (x | (x >> 2)) & UINT64_C(0x0f0f0f0f0f0f0f0f);
+  x = (x | (x >> 4)) & UINT64_C(0x00ff00ff00ff00ff);
+  x = (x | (x >> 8)) & UINT64_C(0x0000ffff0000ffff);
+  x = (x | (x >> 16)) & UINT64_C(0x00000000ffffffff);
+
+  return x;
+}
+
+/* returns the dirty bits of the terminal cells, laid out like the
+   framebuffer's. in the finer glyph modes these are gathered from the dirty
+   bits of the framebuffer cells each terminal cell overlaps, which are then
+   cleared, and in half block mode they're one and the same */
+static uint64_t *tz_cell_dirty(uint64_t *dirty, int words) {
+  if (tz.glyph_mode == TZ_GLYPH_HALF) {
+    return dirty;
+  }
+
+  int cell_words = (tz.cell_cols + 63) >> 6;
+
+  for (int row = 0; row < tz.cell_rows; row++) {
+    int fb_row0 = (row * tz.cell_h) >> 1;
+    int fb_row1 = (row * tz.cell_h + tz.cell_h - 1) >> 1;
+    uint64_t *cell_dirty = &tz.cell_dirty[row * words];
+
+    /* every finer mode is two pixels wide */
+    for (int i = 0; i < cell_words; i++) {
+      uint64_t lo = 0;
+      uint64_t hi = 0;
+
+      for (int fb_row = fb_row0; fb_row <= fb_row1; fb_row++) {
+        lo |= dirty[fb_row * words + i * 2];
+        hi |= i * 2 + 1 < words ? dirty[fb_row * words + i * 2 + 1] : 0;
+      }
+
+      cell_dirty[i] = tz_merge_pairs(lo) | (tz_merge_pairs(hi) << 32);
+    }
+  }
+
+  memset(dirty, 0, tz.rows * words * sizeof(uint64_t));
+
+  return tz.cell_dirty;
+}
+
+/* weights each channel by how bright it looks, out of 256 */
+static inline int tz_luma(uint32_t color) {
+  return ((color & 0xff) * 77 + ((color >> 8) & 0xff) * 150 + ((color >> 16) & 0xff) * 29) >> 8;
+}
+
+static inline int tz_color_dist(uint32_t a, uint32_t b) {
+  int dr = (int)(a & 0xff) - (int)(b & 0xff);
+  int dg = (int)((a >> 8) & 0xff) - (int)((b >> 8) & 0xff);
+  int db = (int)((a >> 16) & 0xff) - (int)((b >> 16) & 0xff);
+
+  return dr * dr + dg * dg + db * db;
+}
+
+/* returns the char drawn in a terminal cell, or 0, and the pixel it was
+   drawn at. in the finer glyph modes a char belongs to the cell holding its
+   top pixel */
+static inline uint32_t tz_cell_char(const struct tz_surface *s, int row, int col, int *x, int *y) {
+  int x0 = col * tz.cell_w;
+  int y0 = row * tz.cell_h;
+
+  for (int py = (y0 + 1) & ~1; py < y0 + tz.cell_h; py += 2) {
+    for (int px = x0; px < x0 + tz.cell_w; px++) {
+      if (*tz_char_at(s, px, py)) {
+        *x = px;
+        *y = py;
+        return tz_get_char(s, px, py);
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* fits two colors to the pixels of a terminal cell in the finer glyph modes,
+   returning the glyph that draws them. the pixels are split between the
+   darkest and brightest of them, whichever each is closer to, and each color
+   is the average of its side */
+static uint32_t tz_fit_cell(const struct tz_surface *s, int row, int col, uint32_t *fg_color, uint32_t *bg_color) {
+  int x0 = col * tz.cell_w;
+  int y0 = row * tz.cell_h;
+  int n = tz.cell_w * tz.cell_h;
+  int x, y;
+
+  /* text takes the whole cell, in the colors it was drawn with */
+  uint32_t c = tz_cell_char(s, row, col, &x, &y);
+
+  if (c) {
+    *fg_color = *tz_color_at(s, x, y);
+    *bg_color = *tz_color_at(s, x, y + 1);
+    return c;
+  }
+
+  uint32_t pixels[8] = {0};
+  int lo = 0;
+  int hi = 0;
+  int lo_luma = 256;
+  int hi_luma = -1;
+
+  for (int i = 0; i < n; i++) {
+    uint32_t color = *tz_color_at(s, x0 + (i & 1), y0 + (i >> 1));
+    int luma = tz_luma(color);
+
+    pixels[i] = color;
+
+    if (luma < lo_luma) {
+      lo = i;
+      lo_luma = luma;
+    }
+
+    if (luma > hi_luma) {
+      hi = i;
+      hi_luma = luma;
+    }
+  }
+
+  /* colors differing only in hue have the same brightness */
+  for (int i = 0; i < n && pixels[hi] == pixels[lo]; i++) {
+    hi = i;
+  }
+
+  if (pixels[hi] == pixels[lo]) {
+    *fg_color = *bg_color = pixels[lo];
+    return ' ';
+  }
+
+  uint32_t sums[2][3] = {{0}};
+  int counts[2] = {0};
+  int mask = 0;
+
+  for (int i = 0; i < n; i++) {
+    int fg = tz_color_dist(pixels[i], pixels[hi]) < tz_color_dist(pixels[i], pixels[lo]);
+
+    mask |= fg << i;
+    sums[fg][0] += pixels[i] & 0xff;
+    sums[fg][1] += (pixels[i] >> 8) & 0xff;
+    sums[fg][2] += (pixels[i] >> 16) & 0xff;
+    counts[fg]++;
+  }
+
+  uint32_t colors[2];
+
+  for (int i = 0; i < 2; i++) {
+    colors[i] = (sums[i][0] / counts[i]) | ((sums[i][1] / counts[i]) << 8) | ((sums[i][2] / counts[i]) << 16);
+  }
+
+  *fg_color = colors[1];
+  *bg_color = colors[0];
+
+  return tz.glyphs[mask];
+}
+
+/* returns the code point of a terminal cell's glyph and the colors to draw
+   it in. the cell covered by a double width char returns TZ_WIDE_TAIL, and
+   isn't drawn itself */
+static inline uint32_t tz_cell_at(const struct tz_surface *s, int row, int col, uint32_t *fg_color,
+                                  uint32_t *bg_color) {
+  if (tz.glyph_mode != TZ_GLYPH_HALF) {
+    return tz_fit_cell(s, row, col, fg_color, bg_color);
+  }
+
+  uint8_t c = *tz_char_at(s, col, row << 1);
+
+  *fg_color = *tz_color_at(s, col, (row << 1) + 0);
+  *bg_color = *tz_color_at(s, col, (row << 1) + 1);
+
+  /* U+2580 upper half block */
+  return !c ? 0x2580 : c == TZ_CHAR_CODE ? s->codes[row * s->stride + col] : c;
+}
+
+/* encodes a cell's colors, where they differ from the last ones and show,
+   and its glyph. needs at most 64 bytes */
+static inline char *tz_put_cell(char *p, uint32_t fg_color, uint32_t bg_color, uint32_t glyph, int *last_fg_color,
+                                int *last_bg_color, int truecolor) {
+  /* a space shows no foreground and a full block no background */
+  if (fg_color != (uint32_t)*last_fg_color && glyph != ' ') {
+    p = tz_put_color(p, '3', fg_color, truecolor);
+    *last_fg_color = fg_color;
+  }
+
+  if (bg_color != (uint32_t)*last_bg_color && glyph != 0x2588) {
+    p = tz_put_color(p, '4', bg_color, truecolor);
+    *last_bg_color = bg_color;
+  }
+
+  /* the half block is by far the most common, and cheapest spelled out */
+  if (glyph == 0x2580) {
+    *p++ = '\xe2';
+    *p++ = '\x96';
+    *p++ = '\x80';
+  } else if (glyph < 0x80) {
+    *p++ = (char)glyph;
+  } else if (glyph < 0x800) {
+    *p++ = (char)(0xc0 | (glyph >> 6));
+    *p++ = (char)(0x80 | (glyph & 0x3f));
+  } else if (glyph < 0x10000) {
+    *p++ = (char)(0xe0 | (glyph >> 12));
+    *p++ = (char)(0x80 | ((glyph >> 6) & 0x3f));
+    *p++ = (char)(0x80 | (glyph & 0x3f));
+  } else {
+    *p++ = (char)(0xf0 | (glyph >> 18));
+    *p++ = (char)(0x80 | ((glyph >> 12) & 0x3f));
+    *p++ = (char)(0x80 | ((glyph >> 6) & 0x3f));
+    *p++ = (char)(0x80 | (glyph & 0x3f));
+  }
+
+  return p;
+}
+
+static const char tz_base64_digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static char *tz_put_base64(char *p, const uint8_t *data, int n) {
+  int i = 0;
+
+  for (; i + 3 <= n; i += 3) {
+    uint32_t v = ((uint32_t)data[i] << 16) | ((uint32_t)data[i + 1] << 8) | data[i + 2];
+
+    p[0] = tz_base64_digits[v >> 18];
+    p[1] = tz_base64_digits[(v >> 12) & 63];
+    p[2] = tz_base64_digits[(v >> 6) & 63];
+    p[3] = tz_base64_digits[v & 63];
+    p += 4;
+  }
+
+  /* pad the last group */
+  if (i < n) {
+    uint32_t v = ((uint32_t)data[i] << 16) | (i + 1 < n ? (uint32_t)data[i + 1] << 8 : 0);
+
+    p[0] = tz_base64_digits[v >> 18];
+    p[1] = tz_base64_digits[(v >> 12) & 63];
+    p[2] = i + 1 < n ? tz_base64_digits[(v >> 6) & 63] : '=';
+    p[3] = '=';
+    p += 4;
+  }
+
+  return p;
+}
+
+/* packs a rectangle of pixels as rows of 24-bit rgb into the image buffer */
+static uint8_t *tz_pack_rgb(const struct tz_surface *s, int x0, int y0, int w, int h) {
+  tz.image.len = 0;
+
+  uint8_t *data = (uint8_t *)tz_buf_reserve(&tz.image, w * h * 3);
+  uint8_t *p = data;
+
+  for (int y = y0; y < y0 + h; y++) {
+    for (int x = x0; x < x0 + w; x++) {
+      uint32_t color = *tz_color_at(s, x, y);
+
+      p[0] = color & 0xff;
+      p[1] = (color >> 8) & 0xff;
+      p[2] = (color >> 16) & 0xff;
+      p += 3;
+    }
+  }
+
+  return data;
+}
+
+/* sends the pixels of a tile as a kitty image placed at the cursor, below
+   any text. each tile keeps its own image id, so sending it again replaces
+   the image rather than piling up another */
+static void tz_put_kitty_tile(const struct tz_surface *s, int id, int row0, int col0, int rows, int cols) {
+  int w = cols * tz.cell_w;
+  int h = rows * tz.cell_h;
+  int n = w * h * 3;
+  const uint8_t *data = tz_pack_rgb(s, col0 * tz.cell_w, row0 * tz.cell_h, w, h);
+  const char *compression = "";
+
+#ifdef TZ_ZLIB
+  uLongf size = compressBound(n);
+
+  tz.image_z.len = 0;
+  uint8_t *z = (uint8_t *)tz_buf_reserve(&tz.image_z, (int)size);
+
+  if (compress2(z, &size, data, n, 1) == Z_OK) {
+    data = z;
+    n = (int)size;
+    compression = ",o=z";
+  }
+#endif
+
+  tz_write("\x1b_Ga=T,f=24,s=%d,v=%d,i=%d,p=1,c=%d,r=%d,C=1,z=-1,q=2%s", w, h, id, cols, rows, compression);
+
+  for (int off = 0; off < n; off += TZ_KITTY_CHUNK) {
+    int len = TZ_MIN(n - off, TZ_KITTY_CHUNK);
+    char *p = tz_buf_reserve(&tz.out, TZ_KITTY_CHUNK / 3 * 4 + 16);
+
+    /* the first chunk carries on from the keys above */
+    if (off) {
+      *p++ = '\x1b';
+      *p++ = '_';
+      *p++ = 'G';
+    } else {
+      *p++ = ',';
+    }
+
+    *p++ = 'm';
+    *p++ = '=';
+    *p++ = off + len < n ? '1' : '0';
+    *p++ = ';';
+
+    p = tz_put_base64(p, data + off, len);
+
+    *p++ = '\x1b';
+    *p++ = '\\';
+
+    tz.out.len = p - tz.out.data;
+  }
+}
+
+/* sends the pixels of a tile as sixels at the cursor. sixels are drawn in
+   the terminal's own pixels, so the tile is scaled up to its cells by
+   nearest neighbour, and quantized to a 6x6x6 color cube */
+static void tz_put_sixel_tile(const struct tz_surface *s, int row0, int col0, int rows, int cols) {
+  int w = cols * tz.cell_px_w;
+  int h = rows * tz.cell_px_h;
+  int x0 = col0 * tz.cell_w;
+  int y0 = row0 * tz.cell_h;
+
+  /* the source column of each pixel, followed by the color of each pixel */
+  tz.image.len = 0;
+
+  int *src_x = (int *)tz_buf_reserve(&tz.image, w * sizeof(int) + w * h);
+  uint8_t *index = (uint8_t *)(src_x + w);
+  uint8_t used[216] = {0};
+
+  for (int x = 0; x < w; x++) {
+    src_x[x] = x0 + x * (cols * tz.cell_w) / w;
+  }
+
+  for (int y = 0, last_src_y = -1; y < h; y++) {
+    int src_y = y0 + y * (rows * tz.cell_h) / h;
+    uint8_t *dst = &index[y * w];
+
+    /* most rows repeat the one above */
+    if (src_y == last_src_y) {
+      memcpy(dst, dst - w, w);
+      continue;
+    }
+
+    for (int x = 0; x < w; x++) {
+      uint32_t color = *tz_color_at(s, src_x[x], src_y);
+      int r = ((color & 0xff) * 5 + 127) / 255;
+      int g = (((color >> 8) & 0xff) * 5 + 127) / 255;
+      int b = (((color >> 16) & 0xff) * 5 + 127) / 255;
+
+      dst[x] = r * 36 + g * 6 + b;
+      used[dst[x]] = 1;
+    }
+
+    last_src_y = src_y;
+  }
+
+  /* one row of sixels per color, cleared again as each is written out */
+  if (tz.sixel_masks_size < 216 * w) {
+    free(tz.sixel_masks);
+    tz.sixel_masks_size = 216 * w;
+    tz.sixel_masks = tz_alloc(tz.sixel_masks_size);
+  }
+
+  tz_write("\x1bP0;0;0q\"1;1;%d;%d", w, h);
+
+  for (int i = 0; i < 216; i++) {
+    if (used[i]) {
+      tz_write("#%d;2;%d;%d;%d", i, i / 36 * 20, i / 6 % 6 * 20, i % 6 * 20);
+    }
+  }
+
+  /* each band of six rows is written one color at a time */
+  for (int band = 0; band < h; band += 6) {
+    uint8_t colors[216];
+    uint8_t in_band[216] = {0};
+    int num_colors = 0;
+
+    for (int y = band; y < TZ_MIN(band + 6, h); y++) {
+      for (int x = 0; x < w; x++) {
+        int i = index[y * w + x];
+
+        if (!in_band[i]) {
+          in_band[i] = 1;
+          colors[num_colors++] = i;
+        }
+
+        tz.sixel_masks[i * w + x] |= 1 << (y - band);
+      }
+    }
+
+    for (int i = 0; i < num_colors; i++) {
+      uint8_t *mask = &tz.sixel_masks[colors[i] * w];
+      int end = w;
+
+      /* leave off the empty sixels at the end */
+      while (!mask[end - 1]) {
+        end--;
+      }
+
+      char *p = tz_buf_reserve(&tz.out, w + 16);
+
+      *p++ = '#';
+      p = tz_put_dec(p, colors[i]);
+
+      for (int x = 0; x < end;) {
+        int run = 1;
+
+        while (x + run < end && mask[x + run] == mask[x]) {
+          run++;
+        }
+
+        if (run > 3) {
+          *p++ = '!';
+          p = tz_put_dec(p, run);
+          *p++ = 63 + mask[x];
+        } else {
+          for (int j = 0; j < run; j++) {
+            *p++ = 63 + mask[x];
+          }
+        }
+
+        x += run;
+      }
+
+      *p++ = '$';
+
+      tz.out.len = p - tz.out.data;
+
+      memset(mask, 0, w);
+    }
+
+    tz_write("-");
+  }
+
+  tz_write("\x1b\\");
+}
+
+/* sends the tiles holding any changed cell as images over their cells,
+   clearing the cells' dirty bits except for those holding text, which is
+   painted over the images */
+static void tz_paint_tiles(const struct tz_surface *screen, uint64_t *cell_dirty, int words) {
+  int tiles_per_row = (tz.cell_cols + TZ_TILE_COLS - 1) / TZ_TILE_COLS;
+
+  for (int row0 = 0; row0 < tz.cell_rows; row0 += TZ_TILE_ROWS) {
+    int rows = TZ_MIN(TZ_TILE_ROWS, tz.cell_rows - row0);
+
+    for (int col0 = 0; col0 < tz.cell_cols; col0 += TZ_TILE_COLS) {
+      int cols = TZ_MIN(TZ_TILE_COLS, tz.cell_cols - col0);
+      uint64_t mask = ((UINT64_C(1) << cols) - 1) << (col0 & 63);
+      uint64_t dirty = 0;
+
+      for (int row = row0; row < row0 + rows; row++) {
+        dirty |= cell_dirty[row * words + (col0 >> 6)];
+      }
+
+      if (!(dirty & mask)) {
+        continue;
+      }
+
+      /* blank the cells first, kitty only showing images below text through
+         the default background, and sixels being overwritten by the text
+         painted afterwards anyway */
+      for (int row = row0; row < row0 + rows; row++) {
+        uint64_t *dirty_word = &cell_dirty[row * words + (col0 >> 6)];
+
+        tz_goto(row, col0);
+        tz_write("\x1b[0m\x1b[%dX", cols);
+
+        *dirty_word &= ~mask;
+
+        for (int col = col0; col < col0 + cols; col++) {
+          int x, y;
+
+          if (tz_cell_char(screen, row, col, &x, &y)) {
+            *dirty_word |= UINT64_C(1) << (col & 63);
+          }
+        }
+      }
+
+      tz_goto(row0, col0);
+
+      if (tz.backend == TZ_BACKEND_KITTY) {
+        int id = 1 + (row0 / TZ_TILE_ROWS) * tiles_per_row + col0 / TZ_TILE_COLS;
+
+        tz_put_kitty_tile(screen, id, row0, col0, rows, cols);
+      } else {
+        tz_put_sixel_tile(screen, row0, col0, rows, cols);
+      }
+    }
+  }
+}
+
+static void tz_free_client(struct tz_client *c) {
+  close(c->fd);
+  free(c->dirty);
+  free(c->color);
+  free(c->glyphs);
+  free(c->out.data);
+  free(c);
+}
+
+/* matches the client's copy to the screen size and glyph mode, starting it
+   over from a cleared screen when either changes */
+static void tz_client_fit(struct tz_client *c, const struct tz_surface *screen) {
+  if (c->rows == screen->rows && c->cols == screen->cols && c->glyph_mode == tz.glyph_mode) {
+    return;
+  }
+
+  free(c->dirty);
+  free(c->color);
+  free(c->glyphs);
+
+  c->rows = screen->rows;
+  c->cols = screen->cols;
+  c->stride = screen->stride;
+  c->glyph_mode = tz.glyph_mode;
+
+  /* there are never more terminal cells than framebuffer cells */
+  size_t cells = (size_t)c->rows * c->stride;
+
+  c->dirty = tz_alloc(c->rows * (c->stride >> 6) * sizeof(uint64_t));
+  c->color = tz_alloc(cells * 2 * sizeof(uint32_t));
+  c->glyphs = tz_alloc(cells * sizeof(uint32_t));
+
+  /* no real color matches, so every cell gets sent */
+  memset(c->dirty, 0xff, c->rows * (c->stride >> 6) * sizeof(uint64_t));
+  memset(c->color, 0xff, cells * 2 * sizeof(uint32_t));
+
+  memcpy(tz_buf_reserve(&c->out, 16), "\x1b[0m\x1b[2J", 8);
+  c->out.len += 8;
+}
+
+static void tz_client_encode(struct tz_client *c, const struct tz_surface *screen) {
+  int last_fg_color = -1;
+  int last_bg_color = -1;
+  int last_row = -1;
+  int last_col = -1;
+  int words = c->stride >> 6;
+  int start = c->out.len;
+
+  memcpy(tz_buf_reserve(&c->out, 16), "\x1b[?2026h", 8);
+  c->out.len += 8;
+
+  uint64_t *cell_dirty = tz_cell_dirty(c->dirty, words);
+
+  for (int row = 0; row < tz.cell_rows; row++) {
+    for (int col = 0; col < tz.cell_cols; col += 64) {
+      uint64_t *dirty_word = &cell_dirty[row * words + (col >> 6)];
+      uint64_t dirty = *dirty_word;
+
+      *dirty_word = 0;
+
+      while (dirty) {
+        int dirty_bit = tz_ctz64(dirty);
+        dirty &= ~(UINT64_C(1) << dirty_bit);
+        col |= dirty_bit;
+
+        uint32_t fg_color, bg_color;
+        uint32_t glyph = tz_cell_at(screen, row, col, &fg_color, &bg_color);
+        int i = row * c->stride + col;
+
+        if (glyph == TZ_WIDE_TAIL) {
+          /* drawn along with the char before it, which moved the cursor past */
+          if (row == last_row && col == last_col) {
+            last_col = col + 1;
+          }
+
+          c->glyphs[i] = glyph;
+        } else if (c->color[i * 2] != fg_color || c->color[i * 2 + 1] != bg_color || c->glyphs[i] != glyph) {
+          /* only send cells that differ from what the client already has */
+          char *p = tz_buf_reserve(&c->out, 96);
+
+          c->color[i * 2] = fg_color;
+          c->color[i * 2 + 1] = bg_color;
+          c->glyphs[i] = glyph;
+
+          if (row != last_row || col != last_col) {
+            *p++ = '\x1b';
+            *p++ = '[';
+            p = tz_put_dec(p, row + 1);
+            *p++ = ';';
+            p = tz_put_dec(p, col + 1);
+            *p++ = 'H';
+          }
+
+          p = tz_put_cell(p, fg_color, bg_color, glyph, &last_fg_color, &last_bg_color, 1);
+
+          c->out.len = p - c->out.data;
+
+          last_row = row;
+          last_col = col + 1;
+        }
+
+        col &= ~63;
+      }
+    }
+  }
+
+  if (last_row < 0) {
+    /* nothing changed, don't send an empty update */
+    c->out.len = start;
+    return;
+  }
+
+  memcpy(tz_buf_reserve(&c->out, 16), "\x1b[0m\x1b[?2026l", 12);
+  c->out.len += 12;
+}
+
+/* sends as much pending output as the socket takes without blocking,
+   returning 0 if the client has gone */
+static int tz_client_send(struct tz_client *c) {
+  while (c->sent < c->out.len) {
+    ssize_t res = send(c->fd, c->out.data + c->sent, c->out.len - c->sent, TZ_SEND_FLAGS);
+
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+
+    c->sent += res;
+  }
+
+  c->out.len = 0;
+  c->sent = 0;
+
+  return 1;
+}
+
+/* called with the screen about to be painted, before its dirty bits are
+   cleared */
+static void tz_serve_update(const struct tz_surface *screen) {
+  int fd;
+
+  /* attach any new viewers */
+  while ((fd = accept(tz.serve_fd, NULL, NULL)) >= 0) {
+    struct tz_client *c = calloc(1, sizeof(*c));
+
+    if (!c) {
+      close(fd);
+      continue;
+    }
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    c->fd = fd;
+    c->next = tz.clients;
+    tz.clients = c;
+  }
+
+  for (struct tz_client **link = &tz.clients; *link;) {
+    struct tz_client *c = *link;
+    int words = screen->stride >> 6;
+
+    tz_client_fit(c, screen);
+
+    /* gather what changed for every client, whether or not it gets sent
+       this frame */
+    for (int i = 0; i < c->rows * words; i++) {
+      c->dirty[i] |= screen->dirty[i];
+    }
+
+    /* scrolled cells were moved on the terminal rather than marked dirty */
+    for (int i = 0; i < tz.num_scrolls; i++) {
+      const struct tz_scroll_op *op = &tz.scrolls[i];
+
+      for (int row = op->row0; row <= op->row1; row++) {
+        for (int col = op->col0; col <= op->col1; col++) {
+          c->dirty[row * words + (col >> 6)] |= UINT64_C(1) << (col & 63);
+        }
+      }
+    }
+
+    /* a client still busy with an earlier frame is left to catch up */
+    int ok = tz_client_send(c);
+
+    if (ok && !c->out.len) {
+      tz_client_encode(c, screen);
+      ok = tz_client_send(c);
+    }
+
+    if (!ok) {
+      *link = c->next;
+      tz_free_client(c);
+      continue;
+    }
+
+    link = &c->next;
+  }
+}
+
+static void tz_put_u32(char *p, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    p[i] = (char)(v >> (i * 8));
+  }
+}
+
+static uint32_t tz_get_u32(const char *p) {
+  uint32_t v = 0;
+
+  for (int i = 0; i < 4; i++) {
+    v |= (uint32_t)(uint8_t)p[i] << (i * 8);
+  }
+
+  return v;
+}
+
+static char *tz_put_varint(char *p, uint32_t v) {
+  while (v >= 0x80) {
+    *p++ = (char)(v | 0x80);
+    v >>= 7;
+  }
+
+  *p++ = (char)v;
+
+  return p;
+}
+
+/* returns NULL if the varint runs past end */
+static const char *tz_get_varint(const char *p, const char *end, uint32_t *v) {
+  *v = 0;
+
+  for (int shift = 0; p < end && shift < 35; shift += 7) {
+    uint8_t b = *p++;
+
+    *v |= (uint32_t)(b & 0x7f) << shift;
+
+    if (!(b & 0x80)) {
+      return p;
+    }
+  }
+
+  return NULL;
+}
+
+static uint32_t tz_delta_hash(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return (v * 2654435761u) >> (32 - TZ_DELTA_HASH_BITS);
+}
+
+/* encodes cur as a sequence of literal runs and copies out of prev. each run
+   starts with a varint of its length shifted up by one, the low bit set for
+   copies which are followed by a varint of the offset in prev to copy from */
+static void tz_delta_encode(struct tz_buf *out, const char *prev, int prev_len, const char *cur, int len) {
+  static int table[1 << TZ_DELTA_HASH_BITS];
+  int literal = 0;
+  int i = 0;
+
+  for (int j = 0; j < (1 << TZ_DELTA_HASH_BITS); j++) {
+    table[j] = -1;
+  }
+
+  /* index every 4th position of prev back to front, so the earliest
+     occurrence of each hash wins. a run of TZ_DELTA_MIN_MATCH + 3 bytes or
+     more still has a long enough tail that starts at an indexed position */
+  for (int j = (prev_len - 4) & ~3; j >= 0; j -= 4) {
+    table[tz_delta_hash(prev + j)] = j;
+  }
+
+  while (i < len) {
+    int match_pos = i + 4 <= len ? table[tz_delta_hash(cur + i)] : -1;
+    int match_len = 0;
+
+    if (match_pos >= 0) {
+      while (i + match_len < len && match_pos + match_len < prev_len &&
+             cur[i + match_len] == prev[match_pos + match_len]) {
+        match_len++;
+      }
+    }
+
+    /* step further the longer nothing has matched, so output that has little
+       in common with the last frame doesn't cost a lookup per byte */
+    if (match_len < TZ_DELTA_MIN_MATCH) {
+      i += 1 + ((i - literal) >> 6);
+      continue;
+    }
+
+    char *p = tz_buf_reserve(out, 15 + (i - literal));
+
+    if (i > literal) {
+      p = tz_put_varint(p, (uint32_t)(i - literal) << 1);
+      memcpy(p, cur + literal, i - literal);
+      p += i - literal;
+    }
+
+    p = tz_put_varint(p, ((uint32_t)match_len << 1) | 1);
+    p = tz_put_varint(p, match_pos);
+
+    out->len = p - out->data;
+
+    i += match_len;
+    literal = i;
+  }
+
+  if (len > literal) {
+    char *p = tz_buf_reserve(out, 5 + (len - literal));
+
+    p = tz_put_varint(p, (uint32_t)(len - literal) << 1);
+    memcpy(p, cur + literal, len - literal);
+    p += len - literal;
+
+    out->len = p - out->data;
+  }
+}
+
+/* returns 0 if the delta doesn't decode to exactly len bytes */
+static int tz_delta_decode(struct tz_buf *out, const char *prev, int prev_len, const char *delta, int size, int len) {
+  const char *p = delta;
+  const char *end = delta + size;
+  char *dst = tz_buf_reserve(out, len);
+  int n = 0;
+
+  while (p < end) {
+    uint32_t run, offset = 0;
+
+    if (!(p = tz_get_varint(p, end, &run))) {
+      return 0;
+    }
+
+    uint32_t run_len = run >> 1;
+
+    if (run_len > (uint32_t)(len - n)) {
+      return 0;
+    }
+
+    if (run & 1) {
+      if (!(p = tz_get_varint(p, end, &offset)) || offset > (uint32_t)prev_len ||
+          run_len > (uint32_t)prev_len - offset) {
+        return 0;
+      }
+
+      memcpy(dst + n, prev + offset, run_len);
+    } else {
+      if (run_len > (uint32_t)(end - p)) {
+        return 0;
+      }
+
+      memcpy(dst + n, p, run_len);
+      p += run_len;
+    }
+
+    n += run_len;
+  }
+
+  out->len = n;
+
+  return n == len;
+}
+
+static void tz_record_frame(const char *data, int len) {
+  const char *stored = data;
+  int size = len;
+
+  if (tz.record_flags & TZ_RECORD_DELTA) {
+    tz.record_delta.len = 0;
+    tz_delta_encode(&tz.record_delta, tz.record_prev.data, tz.record_prev.len, data, len);
+
+    stored = tz.record_delta.data;
+    size = tz.record_delta.len;
+
+    /* the next frame is stored against this one */
+    tz.record_prev.len = 0;
+    memcpy(tz_buf_reserve(&tz.record_prev, len), data, len);
+    tz.record_prev.len = len;
+  }
+
+  char header[TZ_RECORD_FRAME];
+  uint64_t time = tz_time_ns() - tz.record_start;
+
+  tz_put_u32(header + 0, (uint32_t)time);
+  tz_put_u32(header + 4, (uint32_t)(time >> 32));
+  tz_put_u32(header + 8, len);
+  tz_put_u32(header + 12, size);
+
+  fwrite(header, 1, sizeof(header), tz.record);
+  fwrite(stored, 1, size, tz.record);
+
+  /* a crash shouldn't lose the frames leading up to it */
+  fflush(tz.record);
+}
+
+/* encodes the dirty cells of rows row0 up to row1 into out, clearing their
+   dirty bits, starting out not knowing where the cursor is or which colors
+   are set */
+static void tz_encode_rows(struct tz_buf *out, const struct tz_surface *screen, uint64_t *cell_dirty, int words,
+                           int row0, int row1, int truecolor) {
+  int last_fg_color = -1;
+  int last_bg_color = -1;
+  int last_row = -1;
+  int last_col = -1;
+
+  for (int row = row0; row < row1; row++) {
+    for (int col = 0; col < tz.cell_cols; col += 64) {
+      uint64_t *dirty_word = &cell_dirty[row * words + (col >> 6)];
+      uint64_t dirty = *dirty_word;
+
+      if (!dirty) {
+        continue;
+      }
+
+      *dirty_word = 0;
+
+      while (dirty) {
+        int dirty_bit = tz_ctz64(dirty);
+        dirty &= ~(UINT64_C(1) << dirty_bit);
+        col |= dirty_bit;
+
+        uint32_t fg_color, bg_color;
+        uint32_t glyph = tz_cell_at(screen, row, col, &fg_color, &bg_color);
+
+        /* drawn along with the char before it, which moved the cursor past */
+        if (glyph == TZ_WIDE_TAIL) {
+          if (row == last_row && col == last_col) {
+            last_col = col + 1;
+          }
+
+          col &= ~63;
+          continue;
+        }
+
+        /* move the cursor unless it's already sitting on this cell */
+        if (row != last_row || col != last_col) {
+          if (tz_buf_goto(out, row, col)) {
+            last_fg_color = last_bg_color = -1;
+          }
+        }
+
+        char *p = tz_buf_reserve(out, 64);
+
+        p = tz_put_cell(p, fg_color, bg_color, glyph, &last_fg_color, &last_bg_color, truecolor);
+
+        out->len = p - out->data;
+
+        last_col = col + 1;
+        last_row = row;
+
+        /* reset col offset for next iteration */
+        col &= ~63;
+      }
+    }
+  }
+}
+
+static void *tz_worker_main(void *arg) {
+  struct tz_band *band = &tz.bands[(intptr_t)arg];
+  unsigned generation = 0;
+
+  pthread_mutex_lock(&tz.pool_lock);
+
+  for (;;) {
+    while (generation == tz.pool_generation && !tz.pool_quit) {
+      pthread_cond_wait(&tz.pool_wake, &tz.pool_lock);
+    }
+
+    if (tz.pool_quit) {
+      break;
+    }
+
+    generation = tz.pool_generation;
+
+    pthread_mutex_unlock(&tz.pool_lock);
+
+    band->out.len = 0;
+    tz_encode_rows(&band->out, tz.pool_screen, tz.pool_dirty, tz.pool_words, band->row0, band->row1,
+                   tz.pool_truecolor);
+
+    pthread_mutex_lock(&tz.pool_lock);
+
+    if (!--tz.pool_busy) {
+      pthread_cond_signal(&tz.pool_done);
+    }
+  }
+
+  pthread_mutex_unlock(&tz.pool_lock);
+
+  return NULL;
+}
+
+static void tz_stop_workers() {
+  if (tz.paint_threads <= 1) {
+    return;
+  }
+
+  pthread_mutex_lock(&tz.pool_lock);
+  tz.pool_quit = 1;
+  pthread_cond_broadcast(&tz.pool_wake);
+  pthread_mutex_unlock(&tz.pool_lock);
+
+  for (int i = 1; i < tz.paint_threads; i++) {
+    pthread_join(tz.workers[i - 1], NULL);
+  }
+
+  pthread_mutex_destroy(&tz.pool_lock);
+  pthread_cond_destroy(&tz.pool_wake);
+  pthread_cond_destroy(&tz.pool_done);
+
+  for (int i = 0; i < tz.paint_threads; i++) {
+    free(tz.bands[i].out.data);
+  }
+
+  free(tz.bands);
+  free(tz.workers);
+
+  tz.bands = NULL;
+  tz.workers = NULL;
+  tz.paint_threads = 1;
+}
+
+void tz_paint_threads(int n) {
+  tz_stop_workers();
+
+  n = TZ_CLAMP(n, 1, TZ_MAX_PAINT_THREADS);
+
+  if (n == 1) {
+    return;
+  }
+
+  tz.bands = calloc(n, sizeof(struct tz_band));
+  tz.workers = calloc(n - 1, sizeof(pthread_t));
+  tz.pool_generation = 0;
+  tz.pool_busy = 0;
+  tz.pool_quit = 0;
+
+  pthread_mutex_init(&tz.pool_lock, NULL);
+  pthread_cond_init(&tz.pool_wake, NULL);
+  pthread_cond_init(&tz.pool_done, NULL);
+
+  /* make do with however many workers could be started */
+  tz.paint_threads = 1;
+
+  while (tz.paint_threads < n) {
+    if (tz_spawn(&tz.workers[tz.paint_threads - 1], tz_worker_main, (void *)(intptr_t)tz.paint_threads)) {
+      break;
+    }
+
+    tz.paint_threads++;
+  }
+}
+
+/* encodes the dirty cells into tz.out, splitting the rows into bands with
+   about as many dirty cells each to encode in parallel when there are enough
+   of them. each band begins as if nothing was known about the terminal's
+   state, so the output only differs from encoding it all at once in the
+   cursor moves and colors starting each band */
+static void tz_encode_cells(const struct tz_surface *screen, uint64_t *cell_dirty, int words, int truecolor) {
+  int n = tz.paint_threads;
+  int total = 0;
+
+  if (n > 1) {
+    for (int i = 0; i < tz.cell_rows * words; i++) {
+      total += tz_popcount64(cell_dirty[i]);
+    }
+  }
+
+  if (total < TZ_PARALLEL_MIN_CELLS) {
+    tz_encode_rows(&tz.out, screen, cell_dirty, words, 0, tz.cell_rows, truecolor);
+    return;
+  }
+
+  /* cut a band whenever its share of the dirty cells has been reached */
+  int band = 0;
+  int count = 0;
+
+  tz.bands[0].row0 = 0;
+
+  for (int row = 0; row < tz.cell_rows && band < n - 1; row++) {
+    for (int i = 0; i < words; i++) {
+      count += tz_popcount64(cell_dirty[row * words + i]);
+    }
+
+    if (count >= (int)((int64_t)total * (band + 1) / n)) {
+      tz.bands[band].row1 = row + 1;
+      tz.bands[++band].row0 = row + 1;
+    }
+  }
+
+  tz.bands[band].row1 = tz.cell_rows;
+
+  /* leave any bands not needed empty */
+  while (++band < n) {
+    tz.bands[band].row0 = tz.bands[band].row1 = tz.cell_rows;
+  }
+
+  pthread_mutex_lock(&tz.pool_lock);
+
+  tz.pool_screen = screen;
+  tz.pool_dirty = cell_dirty;
+  tz.pool_words = words;
+  tz.pool_truecolor = truecolor;
+  tz.pool_busy = n - 1;
+  tz.pool_generation++;
+
+  pthread_cond_broadcast(&tz.pool_wake);
+  pthread_mutex_unlock(&tz.pool_lock);
+
+  tz_encode_rows(&tz.out, screen, cell_dirty, words, tz.bands[0].row0, tz.bands[0].row1, truecolor);
+
+  pthread_mutex_lock(&tz.pool_lock);
+
+  while (tz.pool_busy) {
+    pthread_cond_wait(&tz.pool_done, &tz.pool_lock);
+  }
+
+  pthread_mutex_unlock(&tz.pool_lock);
+
+  /* join the bands up in order, to be written out together */
+  for (int i = 1; i < n; i++) {
+    struct tz_band *b = &tz.bands[i];
+
+    memcpy(tz_buf_reserve(&tz.out, b->out.len), b->out.data, b->out.len);
+    tz.out.len += b->out.len;
+  }
+}
+
+void tz_lossy(int threshold, int refresh) {
+  /* paint whatever was left stale exactly before going back to lossless */
+  if (threshold <= 0 && tz.shown) {
+    tz_forget_shown();
+    tz_set_dirty_all(tz.screen);
+  }
+
+  tz.lossy_threshold = TZ_MAX(threshold, 0);
+  tz.lossy_refresh = TZ_MAX(refresh, 1);
+}
+
+/* squared distance between two colors, weighting each channel by its share
+   of luma so that a step of n in all three is n * n */
+static int tz_color_dist2(uint32_t a, uint32_t b) {
+  int dr = tz_red(a) - tz_red(b);
+  int dg = tz_green(a) - tz_green(b);
+  int db = tz_blue(a) - tz_blue(b);
+
+  return (77 * dr * dr + 150 * dg * dg + 29 * db * db) >> 8;
+}
+
+/* drops the dirty cells whose glyph the terminal shows in colors close enough
+   to the real ones, marking them stale, and adds back the stale cells of the
+   band of rows due to be painted exactly. the comparison is against what was
+   last sent rather than the previous frame, so small changes can't add up to
+   more than the threshold */
+static void tz_lossy_filter(const struct tz_surface *screen, uint64_t *cell_dirty, int words) {
+  int stride = screen->stride;
+
+  if (!tz.shown) {
+    tz.shown = tz_alloc((size_t)tz.cell_rows * stride * 3 * sizeof(uint32_t));
+    tz.stale = tz_alloc(tz.cell_rows * words * sizeof(uint64_t));
+  }
+
+  int limit = tz.lossy_threshold * tz.lossy_threshold;
+  int phase = tz.lossy_phase++ % tz.lossy_refresh;
+  int refresh0 = (int)((int64_t)tz.cell_rows * phase / tz.lossy_refresh);
+  int refresh1 = (int)((int64_t)tz.cell_rows * (phase + 1) / tz.lossy_refresh);
+
+  for (int row = 0; row < tz.cell_rows; row++) {
+    for (int col = 0; col < tz.cell_cols; col += 64) {
+      uint64_t *dirty_word = &cell_dirty[row * words + (col >> 6)];
+      uint64_t *stale_word = &tz.stale[row * words + (col >> 6)];
+      uint64_t due = row >= refresh0 && row < refresh1 ? *stale_word : 0;
+      uint64_t todo = *dirty_word | due;
+
+      while (todo) {
+        int dirty_bit = tz_ctz64(todo);
+        uint64_t mask = UINT64_C(1) << dirty_bit;
+        todo &= ~mask;
+        col |= dirty_bit;
+
+        uint32_t fg_color, bg_color;
+        uint32_t glyph = tz_cell_at(screen, row, col, &fg_color, &bg_color);
+        uint32_t *shown = &tz.shown[(row * stride + col) * 3];
+
+        if (!(due & mask) && shown[2] == glyph) {
+          int fg_dist = tz_color_dist2(shown[0], fg_color);
+          int bg_dist = tz_color_dist2(shown[1], bg_color);
+
+          if (fg_dist <= limit && bg_dist <= limit) {
+            *dirty_word &= ~mask;
+            *stale_word = shown[0] != fg_color || shown[1] != bg_color ? *stale_word | mask : *stale_word & ~mask;
+            col &= ~63;
+            continue;
+          }
+        }
+
+        shown[0] = fg_color;
+        shown[1] = bg_color;
+        shown[2] = glyph;
+
+        *dirty_word |= mask;
+        *stale_word &= ~mask;
+
+        col &= ~63;
+      }
+    }
+  }
+}
+
+/* moves what lossy painting knows the terminal shows along with a scroll
+   about to be replayed on it, forgetting the rows exposed */
+static void tz_lossy_scroll(const struct tz_scroll_op *op, int stride) {
+  int words = stride >> 6;
+  int step = op->n > 0 ? 1 : -1;
+  int first = op->n > 0 ? op->row0 : op->row1;
+  int last = op->n > 0 ? op->row1 : op->row0;
+
+  for (int row = first; row != last + step; row += step) {
+    int src_row = row + op->n;
+    int exposed = src_row < op->row0 || src_row > op->row1;
+
+    for (int col = op->col0; col <= op->col1; col++) {
+      uint32_t *shown = &tz.shown[(row * stride + col) * 3];
+      uint64_t *stale_word = &tz.stale[row * words + (col >> 6)];
+      uint64_t mask = UINT64_C(1) << (col & 63);
+
+      *stale_word &= ~mask;
+
+      if (exposed) {
+        memset(shown, 0, 3 * sizeof(uint32_t));
+        continue;
+      }
+
+      memcpy(shown, &tz.shown[(src_row * stride + col) * 3], 3 * sizeof(uint32_t));
+      *stale_word |= tz.stale[src_row * words + (col >> 6)] & mask;
+    }
+  }
+}
+
+void tz_paint() {
+  /* apply any resize signalled since the last paint */
+  if (tz.resize_pending) {
+    tz_resize();
+  }
+
+  if (tz.screen == &tz.composite) {
+    tz_composite();
+  } else {
+    /* painting takes the canvas' own dirty bits, so keep them for tz_clear */
+    for (int i = 0; i < tz.canvas.rows * (tz.canvas.stride >> 6); i++) {
+      tz.canvas.drawn[i] |= tz.canvas.dirty[i];
+    }
+  }
+
+  struct tz_surface *screen = tz.screen;
+
+  tz_fix_wide_all(screen);
+
+  if (tz.serving) {
+    tz_serve_update(screen);
+  }
+
+  int sync_output = tz.caps & TZ_CAP_SYNC_OUTPUT;
+  int truecolor = tz.caps & TZ_CAP_TRUECOLOR;
+
+  /* emit "begin synchronized update" code */
+  if (sync_output) {
+    tz_write("\x1b[?2026h");
+  }
+
+  /* replay scrolls on the terminal before updating any cells, the dirty bits
+     have already been shifted to match */
+  for (int i = 0; i < tz.num_scrolls; i++) {
+    struct tz_scroll_op *op = &tz.scrolls[i];
+    int lr_margins = op->col0 != 0 || op->col1 != tz.term_cols - 1;
+    int y = tz.y;
+
+    tz_write("\x1b[0m\x1b[%d;%dr", 1 + y + op->row0, 1 + y + op->row1);
+
+    if (lr_margins) {
+      tz_write("\x1b[?69h\x1b[%d;%ds", 1 + op->col0, 1 + op->col1);
+    }
+
+    tz_write(op->n > 0 ? "\x1b[%dS" : "\x1b[%dT", abs(op->n));
+
+    /* restore full screen margins, which also homes the cursor */
+    if (lr_margins) {
+      tz_write("\x1b[s\x1b[?69l");
+    }
+
+    tz_write("\x1b[r");
+
+    if (tz.shown) {
+      tz_lossy_scroll(op, screen->stride);
+    }
+  }
+
+  tz.num_scrolls = 0;
+
+  int words = screen->stride >> 6;
+  uint64_t *cell_dirty = tz_cell_dirty(screen->dirty, words);
+
+  if (tz.backend != TZ_BACKEND_CELLS) {
+    tz_paint_tiles(screen, cell_dirty, words);
+  } else if (tz.lossy_threshold) {
+    tz_lossy_filter(screen, cell_dirty, words);
+  }
+
+  tz_encode_cells(screen, cell_dirty, words, truecolor);
+
+  /* reset mode */
+  tz_write("\x1b[0m");
+
+  /* emit "end synchronized update" code */
+  if (sync_output) {
+    tz_write("\x1b[?2026l");
+  }
+
+  if (tz.record) {
+    tz_record_frame(tz.out.data, tz.out.len);
+  }
+
+  tz_flush();
+
+  /* tz_run and the input thread read input themselves as it arrives */
+  if (tz.running || tz.input_threaded) {
+    return;
+  }
+
+  /* check for ctrl-c and probe replies after painting is done, queueing any
+     other input until the queue is full and then throwing it away */
+  while (tz_can_read()) {
+    if (tz_pump_input(1) < 0) {
+      break;
+    }
+  }
+}
+
+static void tz_run_frame(int64_t *last_frame, void (*update)(float dt), void (*render)()) {
+  int64_t now = tz_time_ns();
+
+  if (tz.resize_pending) {
+    tz_resize();
+  }
+
+  if (update) {
+    update((now - *last_frame) / 1e9f);
+  }
+
+  if (render) {
+    render();
+  }
+
+  tz_paint();
+
+  *last_frame = now;
+}
+
+/* hands out queued events, returning 0 once stdin has closed and every event
+   before that has been handed out */
+static int tz_run_input(void (*input)(const struct tz_event *ev)) {
+  struct tz_event ev;
+
+  if (!tz.input_threaded) {
+    tz_expire_input();
+  }
+
+  while (tz_queue_pop(&ev)) {
+    if (input) {
+      input(&ev);
+    }
+  }
+
+  return !atomic_load(&tz.input_eof);
+}
+
+/* reads stdin, or with the input thread running just the wakeups it sends */
+static int tz_run_fd() {
+  return tz.input_threaded ? tz.wake_pipe[0] : STDIN_FILENO;
+}
+
+static void tz_run_read() {
+  if (tz.input_threaded) {
+    tz_wait_input(0);
+  } else {
+    tz_pump_input(0);
+  }
+}
+
+#ifdef __linux__
+
+void tz_run(int fps, void (*update)(float dt), void (*render)(), void (*input)(const struct tz_event *ev)) {
+  int64_t period = 1000000000 / TZ_MAX(fps, 1);
+  int64_t last_frame = tz_time_ns();
+  int frame_due = 1;
+  int awaiting_output = 0;
+
+  /* SIGWINCH is only let through while waiting, so a resize can't slip in
+     between checking for one and going to sleep. the threads started by
+     terminizer block it, so it's always delivered here */
+  sigset_t winch_mask, saved_mask, wait_mask;
+  sigemptyset(&winch_mask);
+  sigaddset(&winch_mask, SIGWINCH);
+  pthread_sigmask(SIG_BLOCK, &winch_mask, &saved_mask);
+  wait_mask = saved_mask;
+  sigdelset(&wait_mask, SIGWINCH);
+
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+  if (epfd < 0 || tfd < 0) {
+    goto done;
+  }
+
+  /* schedule frames against absolute times so they don't drift, if a frame
+     runs long the expirations it covered are simply folded into the next */
+  struct itimerspec its = {
+      .it_interval = {period / 1000000000, period % 1000000000},
+      .it_value = {(last_frame + period) / 1000000000, (last_frame + period) % 1000000000},
+  };
+
+  timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+
+  struct epoll_event ev = {.events = EPOLLIN, .data.fd = tfd};
+  epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+
+  /* stdin may not be pollable, e.g. when redirected from /dev/null, in which
+     case there's simply no input */
+  int input_fd = tz_run_fd();
+
+  ev.data.fd = input_fd;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, input_fd, &ev);
+
+  tz.running = 1;
+
+  while (tz.running) {
+    if (tz.resize_pending) {
+      frame_due = 1;
+    }
+
+    /* wait for the terminal to drain the last frame before sending another */
+    if (frame_due && !awaiting_output) {
+      if (tz_can_write()) {
+        tz_run_frame(&last_frame, update, render);
+        frame_due = 0;
+      } else {
+        ev.events = EPOLLOUT;
+        ev.data.fd = STDOUT_FILENO;
+        awaiting_output = !epoll_ctl(epfd, EPOLL_CTL_ADD, STDOUT_FILENO, &ev);
+      }
+
+      continue;
+    }
+
+    struct epoll_event events[3];
+    int timeout = tz.input_threaded ? -1 : tz_input_timeout();
+    int n = epoll_pwait(epfd, events, 3, timeout, &wait_mask);
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+
+      if (fd == tfd) {
+        uint64_t expirations;
+
+        if (read(tfd, &expirations, sizeof(expirations)) > 0) {
+          frame_due = 1;
+        }
+      } else if (fd == input_fd) {
+        tz_run_read();
+      } else if (fd == STDOUT_FILENO) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, STDOUT_FILENO, NULL);
+        awaiting_output = 0;
+      }
+    }
+
+    if (!tz_run_input(input)) {
+      tz.running = 0;
+    }
+  }
+
+done:
+  if (tfd >= 0) {
+    close(tfd);
+  }
+
+  if (epfd >= 0) {
+    close(epfd);
+  }
+
+  pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+
+  tz.running = 0;
+}
+
+#else
+
+void tz_run(int fps, void (*update)(float dt), void (*render)(), void (*input)(const struct tz_event *ev)) {
+  int64_t period = 1000000000 / TZ_MAX(fps, 1);
+  int64_t last_frame = tz_time_ns();
+  int64_t next_frame = last_frame;
+
+  tz.running = 1;
+
+  while (tz.running) {
+    int64_t now = tz_time_ns();
+
+    if (tz.resize_pending || (now >= next_frame && tz_can_write())) {
+      tz_run_frame(&last_frame, update, render);
+
+      /* advance by whole periods so frames don't drift */
+      while (next_frame <= now) {
+        next_frame += period;
+      }
+
+      continue;
+    }
+
+    struct pollfd fds[2] = {
+        {.fd = tz_run_fd(), .events = POLLIN},
+        {.fd = STDOUT_FILENO, .events = POLLOUT},
+    };
+
+    /* only wake for output once a frame is due and waiting on it */
+    int nfds = now >= next_frame ? 2 : 1;
+    int timeout = now >= next_frame ? -1 : (int)((next_frame - now + 999999) / 1000000);
+    int expire = tz.input_threaded ? -1 : tz_input_timeout();
+
+    if (expire >= 0 && (timeout < 0 || expire < timeout)) {
+      timeout = expire;
+    }
+
+    int n = poll(fds, nfds, timeout);
+
+    if (n > 0 && (fds[0].revents & (POLLIN | POLLHUP))) {
+      tz_run_read();
+    }
+
+    if (!tz_run_input(input)) {
+      tz.running = 0;
+    }
+  }
+}
+
+#endif
+
+void tz_stop() {
+  tz.running = 0;
+}
+
+int tz_record_start(const char *path, int flags) {
+  tz_record_stop();
+
+  if (!(tz.record = fopen(path, "wb"))) {
+    return 0;
+  }
+
+  char header[TZ_RECORD_HEADER];
+
+  memcpy(header, TZ_RECORD_MAGIC, 8);
+  tz_put_u32(header + 8, flags);
+  tz_put_u32(header + 12, tz.cell_cols);
+  tz_put_u32(header + 16, tz.cell_rows);
+
+  fwrite(header, 1, sizeof(header), tz.record);
+
+  tz.record_flags = flags;
+  tz.record_start = tz_time_ns();
+  tz.record_prev.len = 0;
+
+  /* start from a full repaint, so the recording doesn't depend on what was on
+     screen before it */
+  tz_set_dirty_all(tz.screen);
+
+  return 1;
+}
+
+void tz_record_stop() {
+  if (!tz.record) {
+    return;
+  }
+
+  fclose(tz.record);
+  tz.record = NULL;
+
+  free(tz.record_prev.data);
+  free(tz.record_delta.data);
+  memset(&tz.record_prev, 0, sizeof(tz.record_prev));
+  memset(&tz.record_delta, 0, sizeof(tz.record_delta));
+}
+
+int tz_serve(const char *path) {
+  tz_serve_stop();
+
+  if (strlen(path) >= sizeof(tz.serve_addr.sun_path)) {
+    return 0;
+  }
+
+  memset(&tz.serve_addr, 0, sizeof(tz.serve_addr));
+  tz.serve_addr.sun_family = AF_UNIX;
+  strcpy(tz.serve_addr.sun_path, path);
+
+  if ((tz.serve_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    return 0;
+  }
+
+  /* replace a socket left behind by an earlier run */
+  unlink(path);
+
+  if (bind(tz.serve_fd, (struct sockaddr *)&tz.serve_addr, sizeof(tz.serve_addr)) ||
+      listen(tz.serve_fd, SOMAXCONN)) {
+    close(tz.serve_fd);
+    return 0;
+  }
+
+  fcntl(tz.serve_fd, F_SETFL, O_NONBLOCK);
+  fcntl(tz.serve_fd, F_SETFD, FD_CLOEXEC);
+
+#ifndef MSG_NOSIGNAL
+  /* a viewer going away mustn't take the process with it */
+  signal(SIGPIPE, SIG_IGN);
+#endif
+
+  tz.serving = 1;
+
+  return 1;
+}
+
+void tz_serve_stop() {
+  if (!tz.serving) {
+    return;
+  }
+
+  while (tz.clients) {
+    struct tz_client *c = tz.clients;
+
+    tz.clients = c->next;
+    tz_free_client(c);
+  }
+
+  close(tz.serve_fd);
+  unlink(tz.serve_addr.sun_path);
+
+  tz.serving = 0;
+}
+
+struct tz_recording *tz_recording_open(const char *path) {
+  struct tz_recording *rec = calloc(1, sizeof(*rec));
+  char header[TZ_RECORD_HEADER];
+
+  if (!rec) {
+    return NULL;
+  }
+
+  if (!(rec->file = fopen(path, "rb")) || fread(header, 1, sizeof(header), rec->file) != sizeof(header) ||
+      memcmp(header, TZ_RECORD_MAGIC, 8)) {
+    tz_recording_close(rec);
+    return NULL;
+  }
+
+  rec->flags = tz_get_u32(header + 8);
+
+  return rec;
+}
+
+int tz_recording_read(struct tz_recording *rec, const char **data, int64_t *time_ns) {
+  char header[TZ_RECORD_FRAME];
+  size_t res = fread(header, 1, sizeof(header), rec->file);
+
+  if (!res && feof(rec->file)) {
+    return 0;
+  }
+
+  if (res != sizeof(header)) {
+    return -1;
+  }
+
+  uint32_t len = tz_get_u32(header + 8);
+  uint32_t size = tz_get_u32(header + 12);
+
+  if (len > INT32_MAX || size > INT32_MAX) {
+    return -1;
+  }
+
+  rec->stored.len = 0;
+
+  char *stored = tz_buf_reserve(&rec->stored, size);
+
+  if (fread(stored, 1, size, rec->file) != size) {
+    return -1;
+  }
+
+  /* the previous frame is what delta frames copy from */
+  struct tz_buf prev = rec->prev;
+
+  rec->prev = rec->frame;
+  rec->frame = prev;
+  rec->frame.len = 0;
+
+  if (rec->flags & TZ_RECORD_DELTA) {
+    if (!tz_delta_decode(&rec->frame, rec->prev.data, rec->prev.len, stored, size, len)) {
+      return -1;
+    }
+  } else {
+    if (size != len) {
+      return -1;
+    }
+
+    memcpy(tz_buf_reserve(&rec->frame, len), stored, len);
+    rec->frame.len = len;
+  }
+
+  *data = rec->frame.data;
+  *time_ns = (int64_t)((uint64_t)tz_get_u32(header) | ((uint64_t)tz_get_u32(header + 4) << 32));
+
+  return len;
+}
+
+void tz_recording_close(struct tz_recording *rec) {
+  if (!rec) {
+    return;
+  }
+
+  if (rec->file) {
+    fclose(rec->file);
+  }
+
+  free(rec->frame.data);
+  free(rec->prev.data);
+  free(rec->stored.data);
+  free(rec);
+}
+
+/* spreads the low 16 bits of x out to the even bits */
+static inline uint32_t tz_spread_bits(uint32_t x) {
+  x &= 0xffff;
+  x = (x | (x << 8)) & 0x00ff00ff;
+  x = (x | (x << 4)) & 0x0f0f0f0f;
+  x = (x | (x << 2)) & 0x33333333;
+  x = (x | (x << 1)) & 0x55555555;
+
+  return x;
+}
+
+/* index of texel (x, y) in a level, interleaving the bits the sides have in
+   common and appending the longer side's remaining ones */
+static inline uint32_t tz_texel_index(const struct tz_texture *t, int level, uint32_t x, uint32_t y) {
+  int bits = TZ_MIN(t->log_w[level], t->log_h[level]);
+  uint32_t mask = (1u << bits) - 1;
+
+  return tz_spread_bits(x & mask) | (tz_spread_bits(y & mask) << 1) | (((x | y) >> bits) << (bits << 1));
+}
+
+/* texel a coordinate falls on along a side of 1 << log texels, repeating.
+   coordinates too far out to cast to an int, such as a degenerate w can
+   produce, and infinite or nan ones all land on texel 0 */
+static inline uint32_t tz_wrap_texel(float u, int log) {
+  float x = floorf(u * (1 << log));
+
+  return (x >= -2147483648.0f && x < 2147483648.0f ? (uint32_t)(int)x : 0) & ((1u << log) - 1);
+}
+
+/* nearest texel at (u, v) in a level, repeating */
+static inline uint32_t tz_sample(const struct tz_texture *t, int level, float u, float v) {
+  uint32_t x = tz_wrap_texel(u, t->log_w[level]);
+  uint32_t y = tz_wrap_texel(v, t->log_h[level]);
+
+  return t->level[level][tz_texel_index(t, level, x, y)];
+}
+
+static int tz_skip_primitive(const struct tz_vertex *v0, const struct tz_vertex *v1, const struct tz_vertex *v2) {
+  const struct tz_vertex *prim[] = {v0, v1, v2};
+  int outside_viewport = 1;
+
+  for (int i = 0; i < 3; i++) {
+    const struct tz_vertex *v = prim[i];
+    int outside_xy = v->x < -v->w || v->x > v->w || v->y < -v->w || v->y > v->w;
+    int outside_z = v->z < 0.0f || v->z > v->w;
+
+    outside_viewport &= outside_xy;
+
+    /* ignore primitives with any vertex outside of the near / far plane */
+    if (outside_z) {
+      return 1;
+    }
+  }
+
+  /* ignore primitives completely outside of the viewport */
+  return outside_viewport;
+}
+
+void tz_triangle(const struct tz_vertex *v0, const struct tz_vertex *v1, const struct tz_vertex *v2) {
+  if (tz_skip_primitive(v0, v1, v2)) {
+    return;
+  }
+
+  /* translate to ndc space */
+  float x0_norm = v0->x / v0->w;
+  float y0_norm = v0->y / v0->w;
+  float z0_norm = v0->z / v0->w;
+  float x1_norm = v1->x / v1->w;
+  float y1_norm = v1->y / v1->w;
+  float z1_norm = v1->z / v1->w;
+  float x2_norm = v2->x / v2->w;
+  float y2_norm = v2->y / v2->w;
+  float z2_norm = v2->z / v2->w;
+
+  /* translate to screen space */
+  int half_w = (tz.x1 - tz.x0 + 1) >> 1;
+  int half_h = (tz.y1 - tz.y0 + 1) >> 1;
+  int mid_x = tz.x0 + half_w;
+  int mid_y = tz.y0 + half_h;
+
+  float x0_screen = x0_norm * half_w;
+  float y0_screen = y0_norm * -half_h;
+  float x1_screen = x1_norm * half_w;
+  float y1_screen = y1_norm * -half_h;
+  float x2_screen = x2_norm * half_w;
+  float y2_screen = y2_norm * -half_h;
+
+  /* calculate the adjoint matrix
+
+    FIXME ignore primitives that are going to overflow */
+  int x0 = (int)(x0_screen * TZ_SUBPIXEL_STEP - 0.5f);
+  int y0 = (int)(y0_screen * TZ_SUBPIXEL_STEP - 0.5f);
+  int x1 = (int)(x1_screen * TZ_SUBPIXEL_STEP - 0.5f);
+  int y1 = (int)(y1_screen * TZ_SUBPIXEL_STEP - 0.5f);
+  int x2 = (int)(x2_screen * TZ_SUBPIXEL_STEP - 0.5f);
+  int y2 = (int)(y2_screen * TZ_SUBPIXEL_STEP - 0.5f);
+
+  int a0 = y1 - y2;
+  int b0 = x2 - x1;
+  int c0 = (int)(((int64_t)x1 * y2 - y1 * x2) >> TZ_SUBPIXEL_BITS);
+  int a1 = y2 - y0;
+  int b1 = x0 - x2;
+  int c1 = (int)(((int64_t)x2 * y0 - y2 * x0) >> TZ_SUBPIXEL_BITS);
+  int a2 = y0 - y1;
+  int b2 = x1 - x0;
+  int c2 = (int)(((int64_t)x0 * y1 - y0 * x1) >> TZ_SUBPIXEL_BITS);
+
+  /* cull back faces */
+  int area = c0 + c1 + c2;
+
+  if (area <= 0) {
+    return;
+  }
+
+  /* textured triangles interpolate u / w, v / w and 1 / w for perspective
+     correct coordinates, and sample the mip level whose texels come closest
+     to one per pixel, judged by the ratio of the triangle's area in texels to
+     its area on screen */
+  const struct tz_texture *texture = tz.texture;
+  float inv_w[3], u[3], v[3];
+  int level = 0;
+
+  if (texture) {
+    const struct tz_vertex *prim[] = {v0, v1, v2};
+
+    for (int i = 0; i < 3; i++) {
+      inv_w[i] = 1.0f / prim[i]->w;
+      u[i] = prim[i]->u * inv_w[i];
+      v[i] = prim[i]->v * inv_w[i];
+    }
+
+    float uv_area = fabsf((v1->u - v0->u) * (v2->v - v0->v) - (v2->u - v0->u) * (v1->v - v0->v));
+    float texels = uv_area * (float)(1 << texture->log_w[0]) * (float)(1 << texture->log_h[0]);
+    float pixels = (float)area / TZ_SUBPIXEL_STEP;
+
+    if (texels > pixels) {
+      level = TZ_MIN((int)(0.5f * log2f(texels / pixels)), texture->levels - 1);
+    }
+  }
+
+  /* calculate bounding box for the primitive */
+  int min_x = TZ_MIN(x0, TZ_MIN(x1, x2)) >> TZ_SUBPIXEL_BITS;
+  int min_y = TZ_MIN(y0, TZ_MIN(y1, y2)) >> TZ_SUBPIXEL_BITS;
+  int max_x = TZ_MAX(x0, TZ_MAX(x1, x2)) >> TZ_SUBPIXEL_BITS;
+  int max_y = TZ_MAX(y0, TZ_MAX(y1, y2)) >> TZ_SUBPIXEL_BITS;
+
+  min_x = TZ_MAX(min_x, -half_w);
+  min_y = TZ_MAX(min_y, -half_h);
+  max_x = TZ_MIN(max_x, half_w - 1);
+  max_y = TZ_MIN(max_y, half_h - 1);
+
+  /* rasterize immediately since there's no transparency */
+  int w0_row = a0 * min_x + b0 * min_y + c0;
+  int w1_row = a1 * min_x + b1 * min_y + c1;
+  int w2_row = a2 * min_x + b2 * min_y + c2;
+
+  for (int i = min_y; i <= max_y; i++) {
+    int w0 = w0_row;
+    int w1 = w1_row;
+    int w2 = w2_row;
+
+    for (int j = min_x; j <= max_x; j++) {
+      /* check coverage */
+      if ((w0 | w1 | w2) >= 0) {
+        int x = mid_x + j;
+        int y = mid_y + i;
+
+        float z = z0_norm * w0 + z1_norm * w1 + z2_norm * w2;
+        uint8_t depth = tz_clamp_u8((int)((z / area) * 0xff));
+
+        /* check depth */
+        if (depth < *tz_depth_at(tz.target, x, y)) {
+          if (texture) {
+            float one = inv_w[0] * w0 + inv_w[1] * w1 + inv_w[2] * w2;
+            uint32_t texel = tz_sample(texture, level, (u[0] * w0 + u[1] * w1 + u[2] * w2) / one,
+                                       (v[0] * w0 + v[1] * w1 + v[2] * w2) / one);
+
+            tz_flush_pixel(x, y, tz_red(texel), tz_green(texel), tz_blue(texel), depth);
+          } else {
+            uint8_t r = tz_clamp_u8((int)((v0->r * w0 + v1->r * w1 + v2->r * w2) / z));
+            uint8_t g = tz_clamp_u8((int)((v0->g * w0 + v1->g * w1 + v2->g * w2) / z));
+            uint8_t b = tz_clamp_u8((int)((v0->b * w0 + v1->b * w1 + v2->b * w2) / z));
+
+            tz_flush_pixel(x, y, r, g, b, depth);
+          }
+        }
+      }
+
+      w0 += a0;
+      w1 += a1;
+      w2 += a2;
+    }
+
+    w0_row += b0;
+    w1_row += b1;
+    w2_row += b2;
+  }
+}
+
+void tz_line(const struct tz_vertex *v0, const struct tz_vertex *v1) {
+  if (tz_skip_primitive(v0, v1, v1)) {
+    return;
+  }
+
+  /* translate to ndc space */
+  float x0_norm = v0->x / v0->w;
+  float y0_norm = v0->y / v0->w;
+  float z0_norm = v0->z / v0->w;
+  float x1_norm = v1->x / v1->w;
+  float y1_norm = v1->y / v1->w;
+  float z1_norm = v1->z / v1->w;
+
+  /* translate to screen space */
+  int half_w = (tz.x1 - tz.x0 + 1) >> 1;
+  int half_h = (tz.y1 - tz.y0 + 1) >> 1;
+  int mid_x = tz.x0 + half_w;
+  int mid_y = tz.y0 + half_h;
+
+  int x0 = (int)(x0_norm * half_w + mid_x);
+  int y0 = (int)(y0_norm * -half_h + mid_y);
+  int x1 = (int)(x1_norm * half_w + mid_x);
+  int y1 = (int)(y1_norm * -half_h + mid_y);
+
+  /* rasterize immediately */
+  int dx = abs(x1 - x0);
+  int sx = x0 < x1 ? 1 : -1;
+  int dy = -abs(y1 - y0);
+  int sy = y0 < y1 ? 1 : -1;
+  int e = dx + dy;
+  int x = x0;
+  int y = y0;
+
+  float len = sqrt(dx * dx + dy * dy);
+  float sf = 1.0f / len;
+  float f = 0.0f;
+
+  while (1) {
+    float w0 = f;
+    float w1 = 1.0f - f;
+
+    float z = z0_norm * w0 + z1_norm * w1;
+    uint8_t depth = tz_clamp_u8((int)(z * 0xff));
+
+    /* check depth */
+    if (depth < *tz_depth_at(tz.target, x, y)) {
+      uint8_t r = tz_clamp_u8((int)((v0->r * w0 + v1->r * w1) / z));
+      uint8_t g = tz_clamp_u8((int)((v0->g * w0 + v1->g * w1) / z));
+      uint8_t b = tz_clamp_u8((int)((v0->b * w0 + v1->b * w1) / z));
+
+      tz_flush_pixel(x, y, r, g, b, depth);
+    }
+
+    if (x == x1 && y == y1) {
+      break;
+    }
+
+    int e2 = e * 2;
+
+    if (e2 >= dy) {
+      e += dy;
+      x += sx;
+      f += sf;
+    }
+
+    if (e2 <= dx) {
+      e += dx;
+      y += sy;
+      f += sf;
+    }
+  }
+}
+
+void tz_points(const struct tz_vertex *points, int n) {
+  struct tz_surface *target = tz.target;
+  int half_w = (tz.x1 - tz.x0 + 1) >> 1;
+  int half_h = (tz.y1 - tz.y0 + 1) >> 1;
+  int size = TZ_MAX(tz.point_size, 1);
+
+  /* offset to the middle of the viewport, less half the square, so each
+     point's square starts at its truncated position */
+  float mid_x = (float)(tz.x0 + half_w - ((size - 1) >> 1));
+  float mid_y = (float)(tz.y0 + half_h - ((size - 1) >> 1));
+
+  /* squares starting in here touch the viewport. the target's pixels are
+     bytes as far as aliasing goes, so everything read in the loop is kept
+     in locals rather than read back from tz after every write */
+  int x0_min = tz.x0 - size + 1;
+  int y0_min = tz.y0 - size + 1;
+  int x0_max = tz.x1;
+  int y0_max = tz.y1;
+  int x_min = tz.x0;
+  int y_min = tz.y0;
+
+  for (int i = 0; i < n; i++) {
+    const struct tz_vertex *v = &points[i];
+    float inv_w = 1.0f / v->w;
+    float x = v->x * inv_w * half_w + mid_x;
+    float y = v->y * inv_w * -half_h + mid_y;
+    float z = v->z * inv_w;
+
+    /* points behind the near plane, past the far one or with no w at all
+       fail this as well, and testing before converting keeps those far off
+       screen from overflowing */
+    if (!(v->w > 0.0f && z >= 0.0f && z <= 1.0f && x >= x0_min && x < x0_max + 1 && y >= y0_min && y < y0_max + 1)) {
+      continue;
+    }
+
+    /* truncating from the least start rounds down */
+    int x0 = (int)(x - x0_min) + x0_min;
+    int y0 = (int)(y - y0_min) + y0_min;
+    uint8_t depth = (uint8_t)(z * 0xff);
+    uint32_t color = tz_color(v->r, v->g, v->b);
+
+    if (size == 1) {
+      uint8_t *old_depth = tz_depth_at(target, x0, y0);
+
+      if (depth < *old_depth) {
+        *old_depth = depth;
+        *tz_color_at(target, x0, y0) = color;
+        *tz_char_at(target, x0, y0) = 0;
+        *tz_dirty_at(target, x0, y0 >> 1) |= UINT64_C(1) << (x0 & 63);
+      }
+
+      continue;
+    }
+
+    int x1 = TZ_MIN(x0 + size - 1, x0_max);
+    int y1 = TZ_MIN(y0 + size - 1, y0_max);
+
+    for (int y = TZ_MAX(y0, y_min); y <= y1; y++) {
+      for (int x = TZ_MAX(x0, x_min); x <= x1; x++) {
+        uint8_t *old_depth = tz_depth_at(target, x, y);
+
+        if (depth < *old_depth) {
+          *old_depth = depth;
+          *tz_color_at(target, x, y) = color;
+          *tz_char_at(target, x, y) = 0;
+          *tz_dirty_at(target, x, y >> 1) |= UINT64_C(1) << (x & 63);
+        }
+      }
+    }
+  }
+}
+
+void tz_point_size(int size) {
+  tz.point_size = size;
+}
+
+void tz_blit(int x, int y, int w, int h, const uint32_t *data) {
+  int x0 = tz.x0 + x;
+  int y0 = tz.y0 + y;
+  int x1 = TZ_MIN(x0 + w - 1, tz.x1);
+  int y1 = TZ_MIN(y0 + h - 1, tz.y1);
+
+  for (int y = y0; y <= y1; y++) {
+    for (int x = x0; x <= x1; x++) {
+      tz_set_color(x, y, *(data++));
+    }
+  }
+}
+
+/* set pixels [x0, x1) of a row of the target to the color, clipped to the
+   viewport. the cells that changed are gathered into a mask per word of
+   dirty bits rather than marked a pixel at a time */
+static void tz_fill_span(int y, int x0, int x1, uint32_t color) {
+  struct tz_surface *s = tz.target;
+
+  x0 = TZ_MAX(x0, tz.x0);
+  x1 = TZ_MIN(x1, tz.x1 + 1);
+
+  if (y < tz.y0 || y > tz.y1 || x0 >= x1) {
+    return;
+  }
+
+  /* step along the row by however far apart neighbouring pixels are laid
+     out, rather than finding each through the surface, whose fields would
+     be read again after every char stored */
+  uint32_t *colors = tz_color_at(s, x0, y);
+  uint8_t *chars = tz_char_at(s, x0, y);
+  uint64_t *dirty = tz_dirty_at(s, x0, y >> 1);
+
+  while (x0 < x1) {
+    int n = TZ_MIN((x0 | 63) + 1, x1) - x0;
+    int bit = x0 & 63;
+    uint64_t changed = 0;
+
+    for (int i = 0; i < n; i++) {
+      changed |= (uint64_t)((colors[i * TZ_COLOR_STEP] != color) | (chars[i * TZ_CHAR_STEP] != 0)) << (bit + i);
+      colors[i * TZ_COLOR_STEP] = color;
+      chars[i * TZ_CHAR_STEP] = 0;
+    }
+
+    *(dirty++) |= changed;
+    colors += n * TZ_COLOR_STEP;
+    chars += n * TZ_CHAR_STEP;
+    x0 += n;
+  }
+}
+
+/* half the width of the row dy away from the middle of a circle of the
+   radius. counting pixels within radius + 1/2 of the center rounds the
+   circle out rather than leaving single pixels at its ends */
+static int tz_circle_half(int radius, int dy) {
+  int r2 = radius * radius + radius - dy * dy;
+
+  return r2 < 0 ? -1 : (int)sqrtf((float)r2);
+}
+
+void tz_fill_rect(int x, int y, int w, int h, uint32_t color) {
+  for (int row = TZ_MAX(y, 0); row < y + h && tz.y0 + row <= tz.y1; row++) {
+    tz_fill_span(tz.y0 + row, tz.x0 + x, tz.x0 + x + w, color);
+  }
+}
+
+void tz_stroke_rect(int x, int y, int w, int h, int width, uint32_t color) {
+  width = TZ_MIN(width, TZ_MIN(w, h) / 2);
+
+  tz_fill_rect(x, y, w, width, color);
+  tz_fill_rect(x, y + h - width, w, width, color);
+  tz_fill_rect(x, y + width, width, h - 2 * width, color);
+  tz_fill_rect(x + w - width, y + width, width, h - 2 * width, color);
+}
+
+void tz_fill_round_rect(int x, int y, int w, int h, int radius, uint32_t color) {
+  radius = TZ_CLAMP(radius, 0, TZ_MIN(w, h) / 2);
+
+  for (int row = TZ_MAX(y, 0); row < y + h && tz.y0 + row <= tz.y1; row++) {
+    /* rows level with the corners are inset by their circles */
+    int dy = TZ_MAX(y + radius - row, row - (y + h - 1 - radius));
+    int inset = dy > 0 ? radius - tz_circle_half(radius, dy) : 0;
+
+    tz_fill_span(tz.y0 + row, tz.x0 + x + inset, tz.x0 + x + w - inset, color);
+  }
+}
+
+void tz_fill_circle(int x, int y, int radius, uint32_t color) {
+  for (int dy = -radius; dy <= radius; dy++) {
+    int half = tz_circle_half(radius, dy);
+
+    tz_fill_span(tz.y0 + y + dy, tz.x0 + x - half, tz.x0 + x + half + 1, color);
+  }
+}
+
+void tz_stroke_circle(int x, int y, int radius, int width, uint32_t color) {
+  int inner = radius - TZ_CLAMP(width, 1, radius + 1);
+
+  for (int dy = -radius; dy <= radius; dy++) {
+    int half = tz_circle_half(radius, dy);
+    int hole = abs(dy) <= inner ? tz_circle_half(inner, dy) : -1;
+
+    /* the whole row past the hole, or the ring either side of it */
+    if (hole < 0) {
+      tz_fill_span(tz.y0 + y + dy, tz.x0 + x - half, tz.x0 + x + half + 1, color);
+    } else {
+      tz_fill_span(tz.y0 + y + dy, tz.x0 + x - half, tz.x0 + x - hole, color);
+      tz_fill_span(tz.y0 + y + dy, tz.x0 + x + hole + 1, tz.x0 + x + half + 1, color);
+    }
+  }
+}
+
+void tz_fill_polygon(const int *points, int n, uint32_t color) {
+  if (n < 3) {
+    return;
+  }
+
+  int y_min = points[1];
+  int y_max = points[1];
+
+  for (int i = 1; i < n; i++) {
+    y_min = TZ_MIN(y_min, points[i * 2 + 1]);
+    y_max = TZ_MAX(y_max, points[i * 2 + 1]);
+  }
+
+  /* a row crosses each edge at most once */
+  if (n > tz.span_xs_cap) {
+    free(tz.span_xs);
+    tz.span_xs = tz_alloc(n * sizeof(float));
+    tz.span_xs_cap = n;
+  }
+
+  y_min = TZ_MAX(y_min, 0);
+  y_max = TZ_MIN(y_max, tz.y1 - tz.y0);
+
+  for (int row = y_min; row <= y_max; row++) {
+    float yc = row + 0.5f;
+    int num_xs = 0;
+
+    /* where the row's pixel centers cross the edges, each edge holding its
+       top end but not its bottom so shared vertices are crossed once */
+    for (int i = 0; i < n; i++) {
+      const int *a = &points[i * 2];
+      const int *b = &points[((i + 1) % n) * 2];
+
+      if ((a[1] <= yc) != (b[1] <= yc)) {
+        float x = a[0] + (yc - a[1]) * (float)(b[0] - a[0]) / (float)(b[1] - a[1]);
+        int k = num_xs++;
+
+        /* insertion sort, as rows seldom cross more than a few edges */
+        while (k > 0 && tz.span_xs[k - 1] > x) {
+          tz.span_xs[k] = tz.span_xs[k - 1];
+          k--;
+        }
+
+        tz.span_xs[k] = x;
+      }
+    }
+
+    /* fill the pixels whose centers fall between pairs of crossings */
+    for (int i = 0; i + 1 < num_xs; i += 2) {
+      int x0 = (int)ceilf(tz.span_xs[i] - 0.5f);
+      int x1 = (int)ceilf(tz.span_xs[i + 1] - 0.5f);
+
+      tz_fill_span(tz.y0 + row, tz.x0 + x0, tz.x0 + x1, color);
+    }
+  }
+}
+
+void tz_scroll(int x, int y, int w, int h, int dy) {
+  int x0 = TZ_MAX(tz.x0 + x, tz.x0);
+  int y0 = TZ_MAX(tz.y0 + y, tz.y0);
+  int x1 = TZ_MIN(tz.x0 + x + w - 1, tz.x1);
+  int y1 = TZ_MIN(tz.y0 + y + h - 1, tz.y1);
+
+  if (x0 > x1 || y0 > y1 || !dy) {
+    return;
+  }
+
+  struct tz_surface *s = tz.target;
+
+  /* the terminal can only scroll whole cell rows, and whole lines unless it
+     supports left / right margins. the finer glyph modes and the image
+     backends are left to repaint what moved */
+  int full_width = x0 == 0 && x1 == tz.cols - 1 && tz.cols == tz.term_cols;
+  int accelerate = s == tz.screen && tz.glyph_mode == TZ_GLYPH_HALF && tz.backend == TZ_BACKEND_CELLS &&
+                   !(y0 & 1) && (y1 & 1) && !(dy & 1) && abs(dy) <= y1 - y0 && tz.y >= 0 &&
+                   tz.num_scrolls < TZ_MAX_SCROLLS && (full_width || (tz.caps & TZ_CAP_LR_MARGINS));
+
+  if (accelerate) {
+    struct tz_scroll_op *op = &tz.scrolls[tz.num_scrolls++];
+    op->row0 = y0 >> 1;
+    op->row1 = y1 >> 1;
+    op->col0 = x0;
+    op->col1 = x1;
+    op->n = dy >> 1;
+  }
+
+  /* walk cell rows in the direction that reads each source before it's
+     overwritten */
+  int row0 = y0 >> 1;
+  int row1 = y1 >> 1;
+  int step = dy > 0 ? 1 : -1;
+  int first = dy > 0 ? row0 : row1;
+  int last = dy > 0 ? row1 : row0;
+
+  for (int row = first; row != last + step; row += step) {
+    for (int x = x0; x <= x1; x++) {
+      uint32_t color[2];
+      uint8_t depth[2];
+      uint32_t c = 0;
+      int dirty = 1;
+
+      for (int i = 0; i < 2; i++) {
+        int dst_y = (row << 1) + i;
+        int src_y = dst_y + dy;
+
+        if (dst_y < y0 || dst_y > y1) {
+          /* half of a cell outside of the rectangle stays put */
+          color[i] = *tz_color_at(s, x, dst_y);
+          depth[i] = *tz_depth_at(s, x, dst_y);
+        } else if (src_y < y0 || src_y > y1) {
+          /* exposed */
+          color[i] = s->clear_color;
+          depth[i] = 0xff;
+        } else {
+          color[i] = *tz_color_at(s, x, src_y);
+          depth[i] = *tz_depth_at(s, x, src_y);
+        }
+      }
+
+      /* text moves along with whole cell scrolls, and is dropped otherwise */
+      int src_row = row + (dy >> 1);
+
+      if (!(dy & 1) && src_row >= row0 && src_row <= row1) {
+        c = tz_get_char(s, x, src_row << 1);
+
+        if (accelerate) {
+          /* the terminal moves the cell too, so it's only out of date if the
+             source was */
+          dirty = (*tz_dirty_at(s, x, src_row) >> (x & 63)) & 1;
+        }
+      }
+
+      uint32_t *dst_color[2] = {tz_color_at(s, x, row << 1), tz_color_at(s, x, (row << 1) | 1)};
+      uint32_t dst_c = tz_get_char(s, x, row << 1);
+
+      if (!accelerate) {
+        /* the terminal still shows the old cell, so it's only out of date if
+           the old cell was or the content differs */
+        dirty = *dst_color[0] != color[0] || *dst_color[1] != color[1] || dst_c != c;
+      }
+
+      uint64_t *dirty_word = tz_dirty_at(s, x, row);
+      uint64_t dirty_bit = UINT64_C(1) << (x & 63);
+
+      if (accelerate) {
+        *dirty_word = (*dirty_word & ~dirty_bit) | (dirty ? dirty_bit : 0);
+      } else if (dirty) {
+        *dirty_word |= dirty_bit;
+      }
+
+      *dst_color[0] = color[0];
+      *dst_color[1] = color[1];
+      *tz_depth_at(s, x, row << 1) = depth[0];
+      *tz_depth_at(s, x, (row << 1) | 1) = depth[1];
+      tz_put_char(s, x, row << 1, c);
+    }
+
+    /* scrolled cells can be left clean while holding anything */
+    tz_set_span_bits(tz_drawn_at(s, 0, row), x0, x1 + 1);
+  }
+}
+
+/* parses formatted text into chars, decoding UTF-8 and applying the color
+   escapes, \x1b[f<n>] and \x1b[b<n>] for the foreground and background, with
+   any number of ;-separated settings between the brackets */
+static void tz_text_parse(struct tz_text *t) {
+  const uint8_t *p = (const uint8_t *)t->source.data;
+  int n = t->source.len;
+  uint32_t fg_color = t->fg_color[0];
+  uint32_t bg_color = t->bg_color[0];
+  int state = 0;
+  uint8_t cmd = 0;
+  int arg = 0;
+
+  t->len = 0;
+
+  for (int i = 0, len; i < n; i += len) {
+    uint8_t c = p[i];
+
+    len = 1;
+
+    switch (state) {
+      case 1: {
+        if (c == '[') {
+          state = 2;
+        }
+      } break;
+
+      case 2: {
+        state = 3;
+        cmd = c;
+      } break;
+
+      case 3: {
+        if (c == ';' || c == ']') {
+          if (cmd == 'f') {
+            fg_color = ansi_lut[arg & 0xff];
+          } else {
+            bg_color = ansi_lut[arg & 0xff];
+          }
+
+          arg = 0;
+          state = c == ';' ? 2 : 0;
+        } else {
+          arg = arg * 10 + (c - '0');
+        }
+      } break;
+
+      default: {
+        if (c == '\x1b') {
+          state = 1;
+          break;
+        }
+
+        if (t->len == t->cap) {
+          t->cap = TZ_MAX(t->cap * 2, 64);
+          t->chars = realloc(t->chars, t->cap * sizeof(struct tz_text_char));
+
+          if (!t->chars) {
+            fprintf(stderr, "terminizer: failed to allocate %zu bytes\n", t->cap * sizeof(struct tz_text_char));
+            exit(EXIT_FAILURE);
+          }
+        }
+
+        struct tz_text_char *ch = &t->chars[t->len++];
+
+        ch->c = tz_decode_utf8(p + i, n - i, &len);
+        ch->fg_color = fg_color;
+        ch->bg_color = bg_color;
+        ch->width = tz_char_width(ch->c);
+      } break;
+    }
+  }
+
+  t->fg_color[1] = fg_color;
+  t->bg_color[1] = bg_color;
+}
+
+/* formats text, only parsing it again if it or the colors it starts with
+   changed */
+static void tz_text_vset(struct tz_text *t, const char *fmt, va_list args) {
+  struct tz_buf *buf = &t->scratch;
+  va_list copy;
+
+  /* format into the spare buffer, growing it if the text didn't fit */
+  buf->len = 0;
+
+  char *p = tz_buf_reserve(buf, TZ_BUFFER_SIZE);
+
+  va_copy(copy, args);
+  int n = vsnprintf(p, buf->cap, fmt, copy);
+  va_end(copy);
+
+  if (n >= buf->cap) {
+    p = tz_buf_reserve(buf, n + 1);
+    vsnprintf(p, buf->cap, fmt, args);
+  }
+
+  buf->len = TZ_MAX(n, 0);
+
+  if (buf->len == t->source.len && tz.fg_color == t->fg_color[0] && tz.bg_color == t->bg_color[0] &&
+      !memcmp(buf->data, t->source.data, buf->len)) {
+    return;
+  }
+
+  struct tz_buf formatted = *buf;
+
+  t->scratch = t->source;
+  t->source = formatted;
+  t->fg_color[0] = tz.fg_color;
+  t->bg_color[0] = tz.bg_color;
+
+  tz_text_parse(t);
+}
+
+static int tz_draw_text(const struct tz_text *t, int x, int y) {
+  x += tz.x0;
+  y += tz.y0;
+
+  /* in the finer glyph modes text goes in the first framebuffer row starting
+     inside the terminal cell, which is the one the cell looks for it in */
+  if (y >= 0 && tz.cell_h > 2) {
+    y = ((y / tz.cell_h * tz.cell_h) + 1) & ~1;
+  }
+
+  for (int i = 0; i < t->len; i++) {
+    const struct tz_text_char *ch = &t->chars[i];
+
+    if (y < tz.y0 || y > tz.y1 || x > tz.x1) {
+      break;
+    }
+
+    if (!ch->width) {
+      continue;
+    }
+
+    /* a double width char has to fit whole, with its right half taken by a
+       tail, or a space if only that half shows */
+    if (ch->width == 2 && x + tz.cell_w > tz.x1) {
+      break;
+    }
+
+    if (x >= tz.x0) {
+      tz_set_char(x, y, ch->fg_color, ch->bg_color, ch->c);
+    }
+
+    if (ch->width == 2 && x + tz.cell_w >= tz.x0) {
+      tz_set_char(x + tz.cell_w, y, ch->fg_color, ch->bg_color, x >= tz.x0 ? TZ_WIDE_TAIL : ' ');
+    }
+
+    x += ch->width * tz.cell_w;
+  }
+
+  return x - tz.x0;
+}
+
+int tz_print(int x, int y, const char *fmt, ...) {
+  va_list args;
+
+  va_start(args, fmt);
+  tz_text_vset(&tz.print_text, fmt, args);
+  va_end(args);
+
+  /* escapes carry over to whatever's printed next */
+  tz.fg_color = tz.print_text.fg_color[1];
+  tz.bg_color = tz.print_text.bg_color[1];
+
+  return tz_draw_text(&tz.print_text, x, y);
+}
+
+struct tz_text *tz_text_create() {
+  return calloc(1, sizeof(struct tz_text));
+}
+
+void tz_text_destroy(struct tz_text *text) {
+  if (!text) {
+    return;
+  }
+
+  free(text->source.data);
+  free(text->scratch.data);
+  free(text->chars);
+  free(text);
+}
+
+void tz_text_set(struct tz_text *text, const char *fmt, ...) {
+  va_list args;
+
+  va_start(args, fmt);
+  tz_text_vset(text, fmt, args);
+  va_end(args);
+}
+
+int tz_text_draw(const struct tz_text *text, int x, int y) {
+  return tz_draw_text(text, x, y);
+}
+
+void tz_clear() {
+  struct tz_surface *s = tz.target;
+  uint32_t clear_color = s->clear_color;
+
+  if (tz.x0 > tz.x1 || tz.y0 > tz.y1) {
+    return;
+  }
+
+  /* only touch the cells of the active viewport drawn since they were last
+     cleared, a word of them at a time, as the rest are clear already */
+  for (int row = tz.y0 >> 1; row <= tz.y1 >> 1; row++) {
+    int y0 = TZ_MAX(row << 1, tz.y0);
+    int y1 = TZ_MIN((row << 1) | 1, tz.y1);
+
+    for (int col = tz.x0 & ~63; col <= tz.x1; col += 64) {
+      int bit0 = TZ_MAX(tz.x0 - col, 0);
+      int bit1 = TZ_MIN(tz.x1 - col, 63);
+      uint64_t mask = (UINT64_C(-1) >> (63 - bit1 + bit0)) << bit0;
+      uint64_t *drawn = tz_drawn_at(s, col, row);
+      uint64_t cells = (*drawn | *tz_dirty_at(s, col, row)) & mask;
+
+      /* cells the viewport only covers half of stay drawn */
+      if (y0 < y1) {
+        *drawn &= ~mask;
+      }
+
+      uint64_t changed = 0;
+
+      while (cells) {
+        int bit = tz_ctz64(cells);
+        int x = col | bit;
+        uint8_t *c = tz_char_at(s, x, y0);
+
+        cells &= cells - 1;
+
+        for (int y = y0; y <= y1; y++) {
+          uint32_t *color = tz_color_at(s, x, y);
+
+          if (*color != clear_color || *c) {
+            changed |= UINT64_C(1) << bit;
+          }
+
+          *color = clear_color;
+          *tz_depth_at(s, x, y) = 0xff;
+        }
+
+        *c = 0;
+      }
+
+      *tz_dirty_at(s, col, row) |= changed;
+    }
+  }
+}
+
+static void tz_link_layer(struct tz_layer *layer) {
+  struct tz_layer **link = &tz.layers;
+
+  while (*link && (*link)->z <= layer->z) {
+    link = &(*link)->next;
+  }
+
+  layer->next = *link;
+  *link = layer;
+}
+
+static void tz_unlink_layer(struct tz_layer *layer) {
+  struct tz_layer **link = &tz.layers;
+
+  while (*link != layer) {
+    link = &(*link)->next;
+  }
+
+  *link = layer->next;
+  layer->next = NULL;
+}
+
+struct tz_layer *tz_layer_create(int z) {
+  struct tz_layer *layer = calloc(1, sizeof(*layer));
+
+  if (!layer) {
+    return NULL;
+  }
+
+  layer->z = z;
+  layer->visible = 1;
+  layer->surface.clear_color = TZ_TRANSPARENT;
+
+  tz_resize_surface(&layer->surface, tz.rows, tz.cols);
+
+  layer->surface.x1 = tz.cols - 1;
+  layer->surface.y1 = (tz.rows << 1) - 1;
+
+  /* start compositing, seeding the screen with what the canvas would have
+     painted so only real differences get sent */
+  if (!tz.layers) {
+    tz_resize_surface(&tz.composite, tz.rows, tz.cols);
+
+    for (int row = 0; row < tz.rows; row++) {
+      for (int x = 0; x < tz.cols; x++) {
+        *tz_color_at(&tz.composite, x, row << 1) = *tz_color_at(&tz.canvas, x, row << 1);
+        *tz_color_at(&tz.composite, x, (row << 1) + 1) = *tz_color_at(&tz.canvas, x, (row << 1) + 1);
+        tz_put_char(&tz.composite, x, row << 1, tz_get_char(&tz.canvas, x, row << 1));
+      }
+
+      for (int col = 0; col < tz.cols; col += 64) {
+        *tz_dirty_at(&tz.composite, col, row) = *tz_dirty_at(&tz.canvas, col, row);
+      }
+    }
+
+    tz.screen = &tz.composite;
+  }
+
+  tz_link_layer(layer);
+
+  return layer;
+}
+
+void tz_layer_destroy(struct tz_layer *layer) {
+  if (!layer) {
+    return;
+  }
+
+  if (tz.target == &layer->surface) {
+    tz_bind(&tz.canvas);
+  }
+
+  tz_unlink_layer(layer);
+  tz_free_surface(&layer->surface);
+  free(layer);
+
+  if (tz.layers) {
+    /* recompose whatever the layer covered */
+    tz_set_dirty_all(&tz.canvas);
+    return;
+  }
+
+  /* stop compositing, the canvas is painted directly again so mark whatever
+     differs from what the screen last held */
+  for (int row = 0; row < tz.rows; row++) {
+    for (int x = 0; x < tz.cols; x++) {
+      int y = row << 1;
+      int differs = *tz_color_at(&tz.canvas, x, y) != *tz_color_at(&tz.composite, x, y) ||
+                    *tz_color_at(&tz.canvas, x, y + 1) != *tz_color_at(&tz.composite, x, y + 1) ||
+                    tz_get_char(&tz.canvas, x, y) != tz_get_char(&tz.composite, x, y);
+      int pending = (*tz_dirty_at(&tz.composite, x, row) >> (x & 63)) & 1;
+
+      if (differs || pending) {
+        *tz_dirty_at(&tz.canvas, x, row) |= UINT64_C(1) << (x & 63);
+      }
+    }
+  }
+
+  tz_free_surface(&tz.composite);
+  tz.screen = &tz.canvas;
+}
+
+void tz_layer_bind(struct tz_layer *layer) {
+  tz_bind(layer ? &layer->surface : &tz.canvas);
+}
+
+void tz_layer_z(struct tz_layer *layer, int z) {
+  tz_unlink_layer(layer);
+  layer->z = z;
+  tz_link_layer(layer);
+
+  tz_set_dirty_all(&tz.canvas);
+}
+
+void tz_layer_visible(struct tz_layer *layer, int visible) {
+  if (layer->visible == !!visible) {
+    return;
+  }
+
+  layer->visible = !!visible;
+
+  tz_set_dirty_all(&tz.canvas);
+}
+
+struct tz_surface *tz_surface_create(int w, int h) {
+  struct tz_surface *surface = calloc(1, sizeof(*surface));
+
+  if (!surface) {
+    return NULL;
+  }
+
+  surface->clear_color = TZ_TRANSPARENT;
+
+  /* storage is in whole cells, so round odd heights up */
+  tz_resize_surface(surface, (h + 1) >> 1, w);
+
+  surface->x1 = w - 1;
+  surface->y1 = h - 1;
+
+  return surface;
+}
+
+void tz_surface_destroy(struct tz_surface *surface) {
+  if (!surface) {
+    return;
+  }
+
+  if (tz.target == surface) {
+    tz_bind(&tz.canvas);
+  }
+
+  tz_free_surface(surface);
+  free(surface);
+}
+
+void tz_surface_bind(struct tz_surface *surface) {
+  tz_bind(surface ? surface : &tz.canvas);
+}
+
+struct tz_texture *tz_texture_create(int w, int h, const uint32_t *data) {
+  if (w <= 0 || h <= 0) {
+    return NULL;
+  }
+
+  struct tz_texture *t = calloc(1, sizeof(*t));
+
+  if (!t) {
+    return NULL;
+  }
+
+  /* round each side up to a power of two, halving both down to 1x1 */
+  int log_w = 0;
+  int log_h = 0;
+
+  while ((1 << log_w) < w && log_w < TZ_MAX_TEXTURE_LEVELS - 1) {
+    log_w++;
+  }
+
+  while ((1 << log_h) < h && log_h < TZ_MAX_TEXTURE_LEVELS - 1) {
+    log_h++;
+  }
+
+  size_t total = 0;
+
+  t->levels = TZ_MAX(log_w, log_h) + 1;
+
+  for (int i = 0; i < t->levels; i++) {
+    t->log_w[i] = TZ_MAX(log_w - i, 0);
+    t->log_h[i] = TZ_MAX(log_h - i, 0);
+    total += (size_t)1 << (t->log_w[i] + t->log_h[i]);
+  }
+
+  t->texels = tz_alloc(total * sizeof(uint32_t));
+
+  for (int i = 0, offset = 0; i < t->levels; i++) {
+    t->level[i] = t->texels + offset;
+    offset += 1 << (t->log_w[i] + t->log_h[i]);
+  }
+
+  /* the first level is the image resized to fit, the rest each average the
+     texels they cover in the one before */
+  int w0 = 1 << log_w;
+  int h0 = 1 << log_h;
+
+  for (int y = 0; y < h0; y++) {
+    for (int x = 0; x < w0; x++) {
+      t->level[0][tz_texel_index(t, 0, x, y)] = data[(int64_t)y * h / h0 * w + (int64_t)x * w / w0];
+    }
+  }
+
+  for (int i = 1; i < t->levels; i++) {
+    int step_x = t->log_w[i] < t->log_w[i - 1];
+    int step_y = t->log_h[i] < t->log_h[i - 1];
+
+    for (int y = 0; y < 1 << t->log_h[i]; y++) {
+      for (int x = 0; x < 1 << t->log_w[i]; x++) {
+        int sum[3] = {0};
+
+        for (int j = 0; j < 4; j++) {
+          uint32_t texel = t->level[i - 1][tz_texel_index(t, i - 1, (x << step_x) | ((j & 1) & step_x),
+                                                           (y << step_y) | ((j >> 1) & step_y))];
+
+          sum[0] += tz_red(texel);
+          sum[1] += tz_green(texel);
+          sum[2] += tz_blue(texel);
+        }
+
+        t->level[i][tz_texel_index(t, i, x, y)] = tz_color(sum[0] >> 2, sum[1] >> 2, sum[2] >> 2);
+      }
+    }
+  }
+
+  return t;
+}
+
+void tz_texture_destroy(struct tz_texture *texture) {
+  if (!texture) {
+    return;
+  }
+
+  if (tz.texture == texture) {
+    tz.texture = NULL;
+  }
+
+  free(texture->texels);
+  free(texture);
+}
+
+void tz_texture_bind(struct tz_texture *texture) {
+  tz.texture = texture;
+}
+
+/* bounds a mesh stored without them by a sphere around the center of its
+   vertices' bounding box */
+static void tz_measure_mesh(struct tz_mesh *mesh) {
+  float *sphere = mesh->sphere;
+
+  if (!mesh->num_vertices) {
+    return;
+  }
+
+  float min[3];
+  float max[3];
+
+  memcpy(min, mesh->vertices[0].pos, sizeof(min));
+  memcpy(max, mesh->vertices[0].pos, sizeof(max));
+
+  for (int i = 1; i < mesh->num_vertices; i++) {
+    for (int k = 0; k < 3; k++) {
+      min[k] = TZ_MIN(min[k], mesh->vertices[i].pos[k]);
+      max[k] = TZ_MAX(max[k], mesh->vertices[i].pos[k]);
+    }
+  }
+
+  float radius2 = 0.0f;
+
+  for (int k = 0; k < 3; k++) {
+    sphere[k] = (min[k] + max[k]) * 0.5f;
+  }
+
+  for (int i = 0; i < mesh->num_vertices; i++) {
+    const float *pos = mesh->vertices[i].pos;
+    float dx = pos[0] - sphere[0];
+    float dy = pos[1] - sphere[1];
+    float dz = pos[2] - sphere[2];
+
+    radius2 = TZ_MAX(radius2, dx * dx + dy * dy + dz * dz);
+  }
+
+  sphere[3] = sqrtf(radius2);
+}
+
+struct tz_mesh *tz_mesh_open(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+
+  if (fd < 0) {
+    return NULL;
+  }
+
+  if (fstat(fd, &st) || st.st_size < TZ_MESH_HEADER) {
+    close(fd);
+    return NULL;
+  }
+
+  /* the mapping outlives the descriptor */
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  close(fd);
+
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+
+  const char *header = map;
+  uint32_t vertex_size = tz_get_u32(header + 8);
+  uint32_t num_vertices = tz_get_u32(header + 12);
+  uint32_t num_triangles = tz_get_u32(header + 16);
+  uint32_t num_levels = tz_get_u32(header + 20);
+  uint64_t size = TZ_MESH_HEADER + (uint64_t)num_vertices * vertex_size + (uint64_t)num_triangles * 12;
+
+  struct tz_mesh *mesh = NULL;
+
+  if (!memcmp(header, TZ_MESH_MAGIC, 8) && vertex_size == sizeof(struct tz_vertex) && num_vertices <= INT32_MAX &&
+      num_triangles <= INT32_MAX / 3 && num_levels <= TZ_MAX_MESH_LEVELS && size <= (uint64_t)st.st_size) {
+    mesh = calloc(1, sizeof(*mesh));
+  }
+
+  if (!mesh) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  mesh->map = map;
+  mesh->size = st.st_size;
+  mesh->vertices = (const struct tz_vertex *)(header + TZ_MESH_HEADER);
+  mesh->indices = (const uint32_t *)(mesh->vertices + num_vertices);
+  mesh->num_vertices = num_vertices;
+  mesh->num_triangles = num_triangles;
+
+  /* the levels past the first are only used if they're all there */
+  if (num_levels > 1 && size + 4 * sizeof(float) + num_levels * sizeof(struct tz_mesh_level) <= (uint64_t)st.st_size) {
+    const float *bounds = (const float *)(mesh->indices + num_triangles * 3);
+
+    memcpy(mesh->sphere, bounds, sizeof(mesh->sphere));
+    mesh->levels = (const struct tz_mesh_level *)(bounds + 4);
+    size += 4 * sizeof(float) + num_levels * sizeof(struct tz_mesh_level);
+
+    const uint32_t *indices = (const uint32_t *)(mesh->levels + num_levels);
+
+    mesh->level_indices[0] = mesh->indices;
+
+    for (uint32_t i = 1; i < num_levels && mesh->levels[i].num_triangles <= INT32_MAX / 3; i++) {
+      size += (uint64_t)mesh->levels[i].num_triangles * 12;
+
+      if (size > (uint64_t)st.st_size) {
+        break;
+      }
+
+      mesh->level_indices[i] = indices;
+      indices += mesh->levels[i].num_triangles * 3;
+      mesh->num_levels = i + 1;
+    }
+
+    if (mesh->num_levels != (int)num_levels) {
+      mesh->num_levels = 0;
+    }
+  } else {
+    tz_measure_mesh(mesh);
+  }
+
+  return mesh;
+}
+
+void tz_mesh_close(struct tz_mesh *mesh) {
+  if (!mesh) {
+    return;
+  }
+
+  munmap(mesh->map, mesh->size);
+  free(mesh);
+}
+
+int tz_mesh_vertices(const struct tz_mesh *mesh, const struct tz_vertex **vertices) {
+  *vertices = mesh->vertices;
+
+  return mesh->num_vertices;
+}
+
+int tz_mesh_triangles(const struct tz_mesh *mesh, const uint32_t **indices) {
+  *indices = mesh->indices;
+
+  return mesh->num_triangles;
+}
+
+int tz_mesh_level(const struct tz_mesh *mesh, const float *matrix) {
+  const float *m = matrix;
+  const float *c = mesh->sphere;
+
+  if (mesh->num_levels < 2) {
+    return 0;
+  }
+
+  /* w is the depth in front of the eye, so the nearest the bounding sphere
+     gets is its center's w less its radius scaled into w's units */
+  float w = m[3] * c[0] + m[7] * c[1] + m[11] * c[2] + m[15];
+  float w_scale = sqrtf(m[3] * m[3] + m[7] * m[7] + m[11] * m[11]);
+  float nearest = w - w_scale * c[3];
+
+  if (nearest <= 0.0f) {
+    return 0;
+  }
+
+  /* the most pixels a unit of error can span there, along x or y */
+  float x_scale = sqrtf(m[0] * m[0] + m[4] * m[4] + m[8] * m[8]) * ((tz.x1 - tz.x0 + 1) >> 1);
+  float y_scale = sqrtf(m[1] * m[1] + m[5] * m[5] + m[9] * m[9]) * ((tz.y1 - tz.y0 + 1) >> 1);
+  float pixels = TZ_MAX(x_scale, y_scale) / nearest;
+  int level = 0;
+
+  while (level + 1 < mesh->num_levels && mesh->levels[level + 1].error * pixels <= TZ_MESH_LEVEL_PIXELS) {
+    level++;
+  }
+
+  return level;
+}
+
+/* draw a level of the mesh through the matrix, with its vertex colors
+   multiplied by the tint unless that's white */
+static void tz_mesh_draw_level(const struct tz_mesh *mesh, const float *m, int level, uint32_t tint) {
+  const uint32_t *indices = mesh->indices;
+  int num_triangles = mesh->num_triangles;
+  int n = mesh->num_vertices;
+
+  /* coarser levels only use the vertices at the start */
+  if (level) {
+    indices = mesh->level_indices[level];
+    num_triangles = mesh->levels[level].num_triangles;
+    n = TZ_MIN((int)mesh->levels[level].num_vertices, n);
+  }
+
+  if (n > tz.mesh_verts_cap) {
+    free(tz.mesh_verts);
+    tz.mesh_verts = tz_alloc(n * sizeof(struct tz_vertex));
+    tz.mesh_verts_cap = n;
+  }
+
+  /* transform each vertex once, however many triangles share it */
+  for (int i = 0; i < n; i++) {
+    const struct tz_vertex *in = &mesh->vertices[i];
+    struct tz_vertex *out = &tz.mesh_verts[i];
+
+    *out = *in;
+    out->x = m[0] * in->x + m[4] * in->y + m[8] * in->z + m[12] * in->w;
+    out->y = m[1] * in->x + m[5] * in->y + m[9] * in->z + m[13] * in->w;
+    out->z = m[2] * in->x + m[6] * in->y + m[10] * in->z + m[14] * in->w;
+    out->w = m[3] * in->x + m[7] * in->y + m[11] * in->z + m[15] * in->w;
+  }
+
+  /* scaling by one more than the tint leaves colors alone under white */
+  if ((tint & 0xffffff) != 0xffffff) {
+    int r = tz_red(tint) + 1;
+    int g = tz_green(tint) + 1;
+    int b = tz_blue(tint) + 1;
+
+    for (int i = 0; i < n; i++) {
+      struct tz_vertex *out = &tz.mesh_verts[i];
+
+      out->r = (out->r * r) >> 8;
+      out->g = (out->g * g) >> 8;
+      out->b = (out->b * b) >> 8;
+    }
+  }
+
+  /* the indices come straight from the file, so skip any out of range */
+  for (int i = 0; i < num_triangles; i++) {
+    const uint32_t *tri = &indices[i * 3];
+
+    if (tri[0] < (uint32_t)n && tri[1] < (uint32_t)n && tri[2] < (uint32_t)n) {
+      tz_triangle(&tz.mesh_verts[tri[0]], &tz.mesh_verts[tri[1]], &tz.mesh_verts[tri[2]]);
+    }
+  }
+}
+
+void tz_mesh_draw(const struct tz_mesh *mesh, const float *matrix) {
+  tz_mesh_draw_level(mesh, matrix, tz_mesh_level(mesh, matrix), 0xffffff);
+}
+
+/* a * b for column major 4x4 matrices */
+static void tz_mat4_mul(float *out, const float *a, const float *b) {
+  for (int c = 0; c < 4; c++) {
+    for (int r = 0; r < 4; r++) {
+      out[c * 4 + r] = a[r] * b[c * 4] + a[4 + r] * b[c * 4 + 1] + a[8 + r] * b[c * 4 + 2] + a[12 + r] * b[c * 4 + 3];
+    }
+  }
+}
+
+static int tz_compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* bits of a float that sort as unsigned integers in the float's order */
+static uint32_t tz_float_key(float f) {
+  uint32_t bits;
+
+  memcpy(&bits, &f, sizeof(bits));
+
+  return bits ^ ((bits >> 31) ? 0xffffffffu : 0x80000000u);
+}
+
+/* take the object's bounding sphere into the world, its radius scaled by the
+   longest of the matrix's axes, which covers rotations and scales */
+static void tz_scene_place(struct tz_scene_object *o) {
+  const float *m = o->matrix;
+  const float *c = o->local;
+  float scale = 0.0f;
+
+  for (int i = 0; i < 3; i++) {
+    scale = TZ_MAX(scale, m[i * 4] * m[i * 4] + m[i * 4 + 1] * m[i * 4 + 1] + m[i * 4 + 2] * m[i * 4 + 2]);
+  }
+
+  o->sphere[0] = m[0] * c[0] + m[4] * c[1] + m[8] * c[2] + m[12];
+  o->sphere[1] = m[1] * c[0] + m[5] * c[1] + m[9] * c[2] + m[13];
+  o->sphere[2] = m[2] * c[0] + m[6] * c[1] + m[10] * c[2] + m[14];
+  o->sphere[3] = c[3] * sqrtf(scale);
+}
+
+/* fit the node's box around its objects' spheres or its children's boxes */
+static void tz_scene_fit(struct tz_scene *scene, struct tz_scene_node *node) {
+  if (!node->count) {
+    const struct tz_scene_node *a = &scene->nodes[node->first];
+    const struct tz_scene_node *b = a + 1;
+
+    for (int k = 0; k < 3; k++) {
+      node->min[k] = TZ_MIN(a->min[k], b->min[k]);
+      node->max[k] = TZ_MAX(a->max[k], b->max[k]);
+    }
+
+    return;
+  }
+
+  for (int i = 0; i < node->count; i++) {
+    const float *sphere = scene->objects[scene->order[node->first + i]].sphere;
+
+    for (int k = 0; k < 3; k++) {
+      float lo = sphere[k] - sphere[3];
+      float hi = sphere[k] + sphere[3];
+
+      node->min[k] = i ? TZ_MIN(node->min[k], lo) : lo;
+      node->max[k] = i ? TZ_MAX(node->max[k], hi) : hi;
+    }
+  }
+}
+
+/* build the node over count objects from first in the order, splitting them
+   at the median along the axis their centers spread furthest on */
+static void tz_scene_split(struct tz_scene *scene, int index, int first, int count) {
+  struct tz_scene_node *node = &scene->nodes[index];
+
+  if (count <= TZ_SCENE_LEAF) {
+    node->first = first;
+    node->count = count;
+    tz_scene_fit(scene, node);
+    return;
+  }
+
+  float lo[3];
+  float hi[3];
+
+  for (int i = 0; i < count; i++) {
+    const float *sphere = scene->objects[scene->order[first + i]].sphere;
+
+    for (int k = 0; k < 3; k++) {
+      lo[k] = i ? TZ_MIN(lo[k], sphere[k]) : sphere[k];
+      hi[k] = i ? TZ_MAX(hi[k], sphere[k]) : sphere[k];
+    }
+  }
+
+  int axis = hi[1] - lo[1] > hi[0] - lo[0] ? 1 : 0;
+
+  if (hi[2] - lo[2] > hi[axis] - lo[axis]) {
+    axis = 2;
+  }
+
+  for (int i = 0; i < count; i++) {
+    int id = scene->order[first + i];
+
+    scene->keys[i] = (uint64_t)tz_float_key(scene->objects[id].sphere[axis]) << 32 | (uint32_t)id;
+  }
+
+  qsort(scene->keys, count, sizeof(uint64_t), tz_compare_u64);
+
+  for (int i = 0; i < count; i++) {
+    scene->order[first + i] = (int)(uint32_t)scene->keys[i];
+  }
+
+  int children = scene->num_nodes;
+
+  scene->num_nodes += 2;
+  node->first = children;
+  node->count = 0;
+
+  tz_scene_split(scene, children, first, count / 2);
+  tz_scene_split(scene, children + 1, first + count / 2, count - count / 2);
+  tz_scene_fit(scene, node);
+}
+
+static void tz_scene_build(struct tz_scene *scene) {
+  int n = 0;
+
+  for (int id = 0; id < scene->num_objects; id++) {
+    if (scene->objects[id].mesh) {
+      scene->order[n++] = id;
+    }
+  }
+
+  scene->num_nodes = n ? 1 : 0;
+
+  if (n) {
+    tz_scene_split(scene, 0, 0, n);
+  }
+
+  scene->built = 1;
+  scene->moved = 0;
+}
+
+/* children come after their parents, so fitting the nodes backwards fits
+   each around children already fitted */
+static void tz_scene_refit(struct tz_scene *scene) {
+  for (int i = scene->num_nodes - 1; i >= 0; i--) {
+    tz_scene_fit(scene, &scene->nodes[i]);
+  }
+
+  scene->moved = 0;
+}
+
+/* draw what's in view under the node, testing only against the planes in
+   the mask, which drops those its parents were found wholly inside */
+static void tz_scene_visit(struct tz_scene *scene, const float *matrix, int index, int mask) {
+  const struct tz_scene_node *node = &scene->nodes[index];
+
+  for (int i = 0; i < 6; i++) {
+    const float *p = scene->planes[i];
 
-  float x0_screen = x0_norm * half_w;
-  float y0_screen = y0_norm * -half_h;
-  float x1_screen = x1_norm * half_w;
-  float y1_screen = y1_norm * -half_h;
-  float x2_screen = x2_norm * half_w;
-  float y2_screen = y2_norm * -half_h;
+    if (!(mask & (1 << i))) {
+      continue;
+    }
 
-  /* calculate the adjoint matrix
+    /* the box is out if its corner furthest along the plane's normal is
+       behind the plane, and wholly in if its nearest corner isn't */
+    float far = p[3];
+    float near = p[3];
 
-    FIXME ignore primitives that are going to overflow */
-  int x0 = (int)(x0_screen * TZ_SUBPIXEL_STEP - 0.5f);
-  int y0 = (int)(y0_screen * TZ_SUBPIXEL_STEP - 0.5f);
-  int x1 = (int)(x1_screen * TZ_SUBPIXEL_STEP - 0.5f);
-  int y1 = (int)(y1_screen * TZ_SUBPIXEL_STEP - 0.5f);
-  int x2 = (int)(x2_screen * TZ_SUBPIXEL_STEP - 0.5f);
-  int y2 = (int)(y2_screen * TZ_SUBPIXEL_STEP - 0.5f);
+    for (int k = 0; k < 3; k++) {
+      far += p[k] * (p[k] >= 0.0f ? node->max[k] : node->min[k]);
+      near += p[k] * (p[k] >= 0.0f ? node->min[k] : node->max[k]);
+    }
 
-  int a0 = y1 - y2;
-  int b0 = x2 - x1;
-  int c0 = (int)(((int64_t)x1 * y2 - y1 * x2) >> TZ_SUBPIXEL_BITS);
-  int a1 = y2 - y0;
-  int b1 = x0 - x2;
-  int c1 = (int)(((int64_t)x2 * y0 - y2 * x0) >> TZ_SUBPIXEL_BITS);
-  int a2 = y0 - y1;
-  int b2 = x1 - x0;
-  int c2 = (int)(((int64_t)x0 * y1 - y0 * x1) >> TZ_SUBPIXEL_BITS);
+    if (far < 0.0f) {
+      return;
+    }
 
-  /* cull back faces */
-  int area = c0 + c1 + c2;
+    if (near >= 0.0f) {
+      mask &= ~(1 << i);
+    }
+  }
 
-  if (area <= 0) {
+  if (!node->count) {
+    tz_scene_visit(scene, matrix, node->first, mask);
+    tz_scene_visit(scene, matrix, node->first + 1, mask);
     return;
   }
 
-  /* calculate bounding box for the primitive */
-  int min_x = TZ_MIN(x0, TZ_MIN(x1, x2)) >> TZ_SUBPIXEL_BITS;
-  int min_y = TZ_MIN(y0, TZ_MIN(y1, y2)) >> TZ_SUBPIXEL_BITS;
-  int max_x = TZ_MAX(x0, TZ_MAX(x1, x2)) >> TZ_SUBPIXEL_BITS;
-  int max_y = TZ_MAX(y0, TZ_MAX(y1, y2)) >> TZ_SUBPIXEL_BITS;
+  for (int i = 0; i < node->count; i++) {
+    const struct tz_scene_object *o = &scene->objects[scene->order[node->first + i]];
+    const float *c = o->sphere;
+    int out = 0;
 
-  min_x = TZ_MAX(min_x, -half_w);
-  min_y = TZ_MAX(min_y, -half_h);
-  max_x = TZ_MIN(max_x, half_w - 1);
-  max_y = TZ_MIN(max_y, half_h - 1);
+    /* spheres sit tighter than the leaf's box around them */
+    for (int k = 0; k < 6 && !out; k++) {
+      const float *p = scene->planes[k];
 
-  /* rasterize immediately since there's no transparency */
-  int w0_row = a0 * min_x + b0 * min_y + c0;
-  int w1_row = a1 * min_x + b1 * min_y + c1;
-  int w2_row = a2 * min_x + b2 * min_y + c2;
+      out = (mask & (1 << k)) && p[0] * c[0] + p[1] * c[1] + p[2] * c[2] + p[3] < -c[3] * scene->plane_len[k];
+    }
 
-  for (int i = min_y; i <= max_y; i++) {
-    int w0 = w0_row;
-    int w1 = w1_row;
-    int w2 = w2_row;
+    if (!out) {
+      float m[16];
 
-    for (int j = min_x; j <= max_x; j++) {
-      /* check coverage */
-      if ((w0 | w1 | w2) >= 0) {
-        int x = mid_x + j;
-        int y = mid_y + i;
+      tz_mat4_mul(m, matrix, o->matrix);
+      tz_mesh_draw(o->mesh, m);
+      scene->drawn++;
+    }
+  }
+}
 
-        float z = z0_norm * w0 + z1_norm * w1 + z2_norm * w2;
-        uint8_t depth = tz_clamp_u8((int)((z / area) * 0xff));
+struct tz_scene *tz_scene_create() {
+  struct tz_scene *scene = calloc(1, sizeof(struct tz_scene));
 
-        /* check depth */
-        if (depth < tz.depth[y][x]) {
-          uint8_t r = tz_clamp_u8((int)((v0->r * w0 + v1->r * w1 + v2->r * w2) / z));
-          uint8_t g = tz_clamp_u8((int)((v0->g * w0 + v1->g * w1 + v2->g * w2) / z));
-          uint8_t b = tz_clamp_u8((int)((v0->b * w0 + v1->b * w1 + v2->b * w2) / z));
+  if (scene) {
+    scene->free_id = -1;
+  }
 
-          tz_flush_pixel(x, y, r, g, b, depth);
-        }
+  return scene;
+}
+
+void tz_scene_destroy(struct tz_scene *scene) {
+  if (!scene) {
+    return;
+  }
+
+  free(scene->objects);
+  free(scene->nodes);
+  free(scene->order);
+  free(scene->keys);
+  free(scene);
+}
+
+int tz_scene_add(struct tz_scene *scene, const struct tz_mesh *mesh, const float *matrix) {
+  int id = scene->free_id;
+
+  if (id >= 0) {
+    scene->free_id = scene->objects[id].next_free;
+  } else {
+    if (scene->num_objects == scene->cap) {
+      int cap = TZ_MAX(scene->cap * 2, 64);
+
+      /* a hierarchy over n objects has at most 2n - 1 nodes */
+      scene->objects = realloc(scene->objects, cap * sizeof(struct tz_scene_object));
+      scene->nodes = realloc(scene->nodes, 2 * cap * sizeof(struct tz_scene_node));
+      scene->order = realloc(scene->order, cap * sizeof(int));
+      scene->keys = realloc(scene->keys, cap * sizeof(uint64_t));
+
+      if (!scene->objects || !scene->nodes || !scene->order || !scene->keys) {
+        fprintf(stderr, "terminizer: failed to allocate %zu bytes\n", cap * sizeof(struct tz_scene_object));
+        exit(EXIT_FAILURE);
       }
 
-      w0 += a0;
-      w1 += a1;
-      w2 += a2;
+      scene->cap = cap;
     }
 
-    w0_row += b0;
-    w1_row += b1;
-    w2_row += b2;
+    id = scene->num_objects++;
   }
+
+  struct tz_scene_object *o = &scene->objects[id];
+
+  o->mesh = mesh;
+  memcpy(o->matrix, matrix, sizeof(o->matrix));
+  memcpy(o->local, mesh->sphere, sizeof(o->local));
+  tz_scene_place(o);
+
+  scene->built = 0;
+
+  return id;
 }
 
-void tz_line(const struct tz_vertex *v0, const struct tz_vertex *v1) {
-  if (tz_skip_primitive(v0, v1, v1)) {
+void tz_scene_move(struct tz_scene *scene, int id, const float *matrix) {
+  if (id < 0 || id >= scene->num_objects || !scene->objects[id].mesh) {
     return;
   }
 
-  /* translate to ndc space */
-  float x0_norm = v0->x / v0->w;
-  float y0_norm = v0->y / v0->w;
-  float z0_norm = v0->z / v0->w;
-  float x1_norm = v1->x / v1->w;
-  float y1_norm = v1->y / v1->w;
-  float z1_norm = v1->z / v1->w;
+  struct tz_scene_object *o = &scene->objects[id];
 
-  /* translate to screen space */
-  int half_w = (tz.x1 - tz.x0 + 1) >> 1;
-  int half_h = (tz.y1 - tz.y0 + 1) >> 1;
-  int mid_x = tz.x0 + half_w;
-  int mid_y = tz.y0 + half_h;
+  memcpy(o->matrix, matrix, sizeof(o->matrix));
+  tz_scene_place(o);
 
-  int x0 = (int)(x0_norm * half_w + mid_x);
-  int y0 = (int)(y0_norm * -half_h + mid_y);
-  int x1 = (int)(x1_norm * half_w + mid_x);
-  int y1 = (int)(y1_norm * -half_h + mid_y);
+  scene->moved = 1;
+}
 
-  /* rasterize immediately */
-  int dx = abs(x1 - x0);
-  int sx = x0 < x1 ? 1 : -1;
-  int dy = -abs(y1 - y0);
-  int sy = y0 < y1 ? 1 : -1;
-  int e = dx + dy;
-  int x = x0;
-  int y = y0;
+void tz_scene_remove(struct tz_scene *scene, int id) {
+  if (id < 0 || id >= scene->num_objects || !scene->objects[id].mesh) {
+    return;
+  }
 
-  float len = sqrt(dx * dx + dy * dy);
-  float sf = 1.0f / len;
-  float f = 0.0f;
+  scene->objects[id].mesh = NULL;
+  scene->objects[id].next_free = scene->free_id;
+  scene->free_id = id;
 
-  while (1) {
-    float w0 = f;
-    float w1 = 1.0f - f;
+  scene->built = 0;
+}
 
-    float z = z0_norm * w0 + z1_norm * w1;
-    uint8_t depth = tz_clamp_u8((int)(z * 0xff));
+int tz_scene_draw(struct tz_scene *scene, const float *matrix) {
+  const float *m = matrix;
 
-    /* check depth */
-    if (depth < tz.depth[y][x]) {
-      uint8_t r = tz_clamp_u8((int)((v0->r * w0 + v1->r * w1) / z));
-      uint8_t g = tz_clamp_u8((int)((v0->g * w0 + v1->g * w1) / z));
-      uint8_t b = tz_clamp_u8((int)((v0->b * w0 + v1->b * w1) / z));
+  if (!scene->built) {
+    tz_scene_build(scene);
+  } else if (scene->moved) {
+    tz_scene_refit(scene);
+  }
 
-      tz_flush_pixel(x, y, r, g, b, depth);
-    }
+  /* the planes bounding clip space, -w <= x <= w, -w <= y <= w and
+     0 <= z <= w, as sums of the matrix's x, y, z and w rows */
+  static const float rows[6][4] = {
+      {1.0f, 0.0f, 0.0f, 1.0f},
+      {-1.0f, 0.0f, 0.0f, 1.0f},
+      {0.0f, 1.0f, 0.0f, 1.0f},
+      {0.0f, -1.0f, 0.0f, 1.0f},
+      {0.0f, 0.0f, 1.0f, 0.0f},
+      {0.0f, 0.0f, -1.0f, 1.0f},
+  };
 
-    if (x == x1 && y == y1) {
-      break;
-    }
+  for (int i = 0; i < 6; i++) {
+    float *p = scene->planes[i];
 
-    int e2 = e * 2;
+    for (int k = 0; k < 4; k++) {
+      const float *col = &m[k * 4];
 
-    if (e2 >= dy) {
-      e += dy;
-      x += sx;
-      f += sf;
+      p[k] = rows[i][0] * col[0] + rows[i][1] * col[1] + rows[i][2] * col[2] + rows[i][3] * col[3];
     }
 
-    if (e2 <= dx) {
-      e += dx;
-      y += sy;
-      f += sf;
-    }
+    scene->plane_len[i] = sqrtf(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+  }
+
+  scene->drawn = 0;
+
+  if (scene->num_nodes) {
+    tz_scene_visit(scene, matrix, 0, 0x3f);
+  }
+
+  return scene->drawn;
+}
+
+/* whether the sphere is wholly outside clip space through the matrix. the
+   sphere's x, say, strays from its center's by at most its radius times the
+   length of the matrix's x row, so it's out past |x| <= w when its center is
+   further out than that and the same for w */
+static int tz_sphere_outside(const float *m, const float *sphere) {
+  const float *c = sphere;
+  float clip[4];
+  float reach[4];
+
+  for (int k = 0; k < 4; k++) {
+    clip[k] = m[k] * c[0] + m[4 + k] * c[1] + m[8 + k] * c[2] + m[12 + k];
+    reach[k] = c[3] * sqrtf(m[k] * m[k] + m[4 + k] * m[4 + k] + m[8 + k] * m[8 + k]);
   }
+
+  float w = clip[3];
+
+  return fabsf(clip[0]) - w > reach[0] + reach[3] || fabsf(clip[1]) - w > reach[1] + reach[3] ||
+         clip[2] < -reach[2] || clip[2] - w > reach[2] + reach[3];
 }
 
-void tz_blit(int x, int y, int w, int h, const uint32_t *data) {
-  int x0 = tz.x0 + x;
-  int y0 = tz.y0 + y;
-  int x1 = TZ_MIN(x0 + w - 1, tz.x1);
-  int y1 = TZ_MIN(y0 + h - 1, tz.y1);
+void tz_draw_instanced(const struct tz_mesh *mesh, const float *matrices, const uint32_t *colors, int count) {
+  const float *sphere = mesh->sphere;
 
-  for (int y = y0; y <= y1; y++) {
-    for (int x = x0; x <= x1; x++) {
-      tz_set_color(x, y, *(data++));
+  for (int i = 0; i < count; i++) {
+    const float *m = &matrices[i * 16];
+
+    if (!tz_sphere_outside(m, sphere)) {
+      tz_mesh_draw_level(mesh, m, tz_mesh_level(mesh, m), colors ? colors[i] : 0xffffff);
     }
   }
 }
 
-int tz_print(int x, int y, const char *fmt, ...) {
-  x += tz.x0;
-  y += tz.y0;
+void tz_surface_blit(const struct tz_surface *surface, int sx, int sy, int w, int h, int x, int y) {
+  /* clip against the source surface and the target viewport */
+  if (sx < 0) {
+    w += sx;
+    x -= sx;
+    sx = 0;
+  }
 
-  /* format the message */
-  char buf[TZ_MAX_COLS * 8];
-  va_list args;
-  int n;
+  if (sy < 0) {
+    h += sy;
+    y -= sy;
+    sy = 0;
+  }
 
-  va_start(args, fmt);
-  n = vsnprintf(buf, sizeof(buf), fmt, args);
-  va_end(args);
+  if (x < 0) {
+    w += x;
+    sx -= x;
+    x = 0;
+  }
 
-  /* parse escape codes while printing each character */
-  int state = 0;
-  char cmd = 0;
-  int arg = 0;
+  if (y < 0) {
+    h += y;
+    sy -= y;
+    y = 0;
+  }
 
-  for (int i = 0, state = 0, cmd = 0; i < n; i++) {
-    if (y < tz.y0 || y > tz.y1 || x > tz.x1) {
-      break;
-    }
+  w = TZ_MIN(w, TZ_MIN(surface->cols - sx, tz.x1 - tz.x0 + 1 - x));
+  h = TZ_MIN(h, TZ_MIN((surface->rows << 1) - sy, tz.y1 - tz.y0 + 1 - y));
 
-    char c = buf[i];
+  if (w <= 0 || h <= 0) {
+    return;
+  }
 
-    switch (state) {
-      case 1: {
-        if (c == '[') {
-          state = 2;
-        }
-      } break;
+  int x0 = tz.x0 + x;
+  int y0 = tz.y0 + y;
 
-      case 2: {
-        state = 3;
-        cmd = c;
-      } break;
+  /* text only survives when cells line up between the two */
+  int cell_aligned = !(sy & 1) && !(y0 & 1);
 
-      case 3: {
-        if (c == ';' || c == ']') {
-          if (cmd == 'f') {
-            tz.fg_color = ansi_lut[arg];
-          } else {
-            tz.bg_color = ansi_lut[arg];
-          }
+  for (int j = 0; j < h; j++) {
+    int src_y = sy + j;
+    int dst_y = y0 + j;
 
-          arg = 0;
+    for (int i = 0; i < w; i++) {
+      uint32_t color = *tz_color_at(surface, sx + i, src_y);
+      uint32_t c = tz_get_char(surface, sx + i, src_y);
 
-          if (c == ';') {
-            state = 2;
-          } else {
-            state = 0;
-          }
-        } else {
-          arg *= 10;
-          arg += c - '0';
-        }
-      } break;
+      if (c) {
+        uint32_t bg_color = *tz_color_at(surface, sx + i, src_y | 1);
 
-      default: {
-        if (c == '\x1b') {
-          state = 1;
-        } else {
-          if (x >= tz.x0) {
-            tz_set_char(x, y, tz.fg_color, tz.bg_color, c);
+        if (cell_aligned) {
+          /* copy the whole cell when reaching its top half */
+          if (!(src_y & 1)) {
+            tz_set_char(x0 + i, dst_y, color, bg_color, c);
           }
 
-          x += 1;
+          continue;
         }
-      } break;
-    }
-  }
-
-  return x - tz.x0;
-}
-
-void tz_clear() {
-  static const uint32_t clear_buffer[TZ_MAX_ROWS << 1][TZ_MAX_COLS];
 
-  tz_blit(0, 0, tz.x1 - tz.x0 + 1, tz.y1 - tz.y0 + 1, (const uint32_t *)clear_buffer);
+        color = bg_color;
+      }
 
-  memset(tz.depth, 0xff, sizeof(tz.depth));
+      if (color != TZ_TRANSPARENT) {
+        tz_set_color(x0 + i, dst_y, color);
+      }
+    }
+  }
 }
 
 void tz_viewport(int x, int y, int w, int h) {
   tz.x0 = TZ_MAX(x, 0);
   tz.y0 = TZ_MAX(y, 0);
-  tz.x1 = TZ_MIN(x + w - 1, tz.cols - 1);
-  tz.y1 = TZ_MIN(y + h - 1, (tz.rows << 1) - 1);
+  tz.x1 = TZ_MIN(x + w - 1, tz.target->cols - 1);
+  tz.y1 = TZ_MIN(y + h - 1, (tz.target->rows << 1) - 1);
+}
+
+void tz_on_resize(void (*callback)(int w, int h)) {
+  tz.resize_callback = callback;
+}
+
+int tz_caps() {
+  return tz.caps;
 }
 
 int tz_height() {
-  return tz.rows << 1;
+  return tz.cell_rows * tz.cell_h;
 }
 
 int tz_width() {
-  return tz.cols;
+  return tz.cell_cols * tz.cell_w;
+}
+
+void tz_glyph_mode(int mode) {
+  if (mode == tz.glyph_mode || mode < TZ_GLYPH_HALF || mode > TZ_GLYPH_BRAILLE) {
+    return;
+  }
+
+  tz.glyph_mode = mode;
+
+  if (mode != TZ_GLYPH_HALF) {
+    tz_build_glyphs(mode);
+  }
+
+  /* before init this only picks the mode to start in */
+  if (!tz.screen) {
+    return;
+  }
+
+  tz.cell_w = tz_cell_sizes[mode][0];
+  tz.cell_h = tz_cell_sizes[mode][1];
+
+  /* the same cells now hold a different number of pixels, so the pixels
+     kept by the resize no longer line up with anything */
+  tz_resize_canvas(tz.cell_rows, tz.cell_cols, tz.y);
+  tz_set_dirty_all(tz.screen);
+}
+
+void tz_backend(int backend) {
+  if (backend == tz.backend || backend < TZ_BACKEND_CELLS || backend > TZ_BACKEND_SIXEL) {
+    return;
+  }
+
+  tz_delete_images();
+
+  /* keep sixels at the bottom of the screen from scrolling it, by leaving
+     the cursor to the right of them rather than below */
+  tz_write(backend == TZ_BACKEND_SIXEL ? "\x1b[?8452h" : "\x1b[?8452l");
+
+  tz.backend = backend;
+
+  if (tz.screen) {
+    tz_forget_shown();
+    tz_set_dirty_all(tz.screen);
+  }
 }
 
 void tz_init(int w, int h) {
@@ -766,8 +6468,15 @@ void tz_init(int w, int h) {
   new_sa.sa_flags = 0;
   sigaction(SIGINT, &new_sa, &tz.old_sa);
 
+  /* install SIGWINCH handler */
+  struct sigaction winch_sa;
+  sigemptyset(&winch_sa.sa_mask);
+  winch_sa.sa_handler = tz_sigwinch;
+  winch_sa.sa_flags = SA_RESTART;
+  sigaction(SIGWINCH, &winch_sa, &tz.old_winch_sa);
+
   /* install exit handler */
-  atexit(tz_reset);
+  atexit(tz_exit);
 
   /* setup raw tty */
   struct termios new_attrs;
@@ -780,27 +6489,65 @@ void tz_init(int w, int h) {
   /* hide the cursor */
   tz_write("\x1b[?25l");
 
-  /* enable utf-8 support */
-  setlocale(LC_ALL, "en_US.UTF-8");
-
   /* determine canvas bounds */
+  int rows, cols;
+
+  tz.cell_w = tz_cell_sizes[tz.glyph_mode][0];
+  tz.cell_h = tz_cell_sizes[tz.glyph_mode][1];
+  tz.cell_px_w = TZ_CELL_PX_W;
+  tz.cell_px_h = TZ_CELL_PX_H;
+  tz.req_rows = h / tz.cell_h;
+  tz.req_cols = w / tz.cell_w;
+
+  /* prefer the kernel's idea of the terminal size, only probing with the
+     cursor if that isn't available */
+  int term_rows, term_cols;
+  int have_winsize = tz_get_winsize(&term_rows, &term_cols);
+
+  tz.term_cols = have_winsize ? term_cols : 0;
+
   if (w && h) {
-    tz.rows = h >> 1;
-    tz.cols = w;
+    rows = tz.req_rows;
+    cols = tz.req_cols;
+  } else if (have_winsize) {
+    rows = term_rows;
+    cols = term_cols;
   } else {
-    tz_get_bounds(&tz.rows, &tz.cols);
+    tz_get_bounds(&rows, &cols);
   }
 
-  /* make room for the canvas and work out where the top is */
-  int row, col;
+  /* allocate the framebuffer for the actual canvas size, marking all cells
+     dirty for the first paint */
+  tz.screen = &tz.canvas;
+  tz.target = &tz.canvas;
 
-  for (int i = 0; i < tz.rows - 1; i++) {
+  tz_resize_framebuffer(rows, cols);
+
+  /* make room for the canvas and park the cursor at its top left */
+  for (int i = 0; i < tz.cell_rows - 1; i++) {
     tz_write("\n");
   }
 
-  tz_get_cursor(&row, &col);
+  tz_write("\r");
+
+  if (tz.cell_rows > 1) {
+    tz_write("\x1b[%dA", tz.cell_rows - 1);
+  }
+
+  /* a canvas filling the terminal starts at the top, otherwise ask where the
+     top is without waiting on the answer, addressing the canvas relative to
+     the saved cursor until it arrives */
+  if (have_winsize && tz.cell_rows >= term_rows) {
+    tz.y = 0;
+  } else {
+    tz.y = -1;
+    tz.cursor_pending = 1;
+    tz_write("\x1b" "7\x1b[6n");
+  }
+
+  tz_probe_caps();
 
-  tz.y = row - tz.rows;
+  tz_flush();
 
   /* default viewport */
   tz.x0 = 0;
@@ -812,13 +6559,11 @@ void tz_init(int w, int h) {
   tz.fg_color = tz_color(0xff, 0xff, 0xff);
   tz.bg_color = tz_color(0x00, 0x00, 0x00);
 
-  /* mark all cells dirty for the first paint */
-  for (int row = 0; row < tz.rows; row++) {
-    for (int col = 0; col < tz.cols; col += 64) {
-      int bits = TZ_MIN(tz.cols - col, 64);
+  /* record any program by setting TERMINIZER_RECORD to a path */
+  const char *record_path = getenv("TERMINIZER_RECORD");
 
-      tz.dirty[row][col / 64] = UINT64_C(-1) >> (64 - bits);
-    }
+  if (record_path && *record_path) {
+    tz_record_start(record_path, TZ_RECORD_DELTA);
   }
 }
 
@@ -0,0 +1,107 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+static struct termios old_tty;
+
+static void restore() {
+  /* leave the alternate screen and show the cursor again */
+  const char reset[] = "\x1b[0m\x1b[?25h\x1b[?1049l";
+  ssize_t res = write(STDOUT_FILENO, reset, sizeof(reset) - 1);
+  (void)res;
+
+  tcsetattr(STDIN_FILENO, TCSANOW, &old_tty);
+}
+
+int main(int argc, char **argv) {
+  /* views a program serving its canvas with tz_serve, e.g. ./a.out /tmp/tz.sock,
+     quit with q or ctrl-c */
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s socket\n", argv[0]);
+    return 1;
+  }
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+
+  /* setup raw tty on the alternate screen */
+  struct termios new_attrs;
+
+  tcgetattr(STDIN_FILENO, &old_tty);
+  memcpy(&new_attrs, &old_tty, sizeof(new_attrs));
+  cfmakeraw(&new_attrs);
+  tcsetattr(STDIN_FILENO, TCSANOW, &new_attrs);
+
+  const char setup[] = "\x1b[?1049h\x1b[?25l";
+  ssize_t res = write(STDOUT_FILENO, setup, sizeof(setup) - 1);
+  (void)res;
+
+  char buf[65536];
+  int done = 0;
+
+  while (!done) {
+    struct pollfd fds[2] = {
+        {.fd = fd, .events = POLLIN},
+        {.fd = STDIN_FILENO, .events = POLLIN},
+    };
+
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      break;
+    }
+
+    if (fds[0].revents) {
+      ssize_t len = read(fd, buf, sizeof(buf));
+
+      /* the server went away */
+      if (len <= 0) {
+        break;
+      }
+
+      for (ssize_t off = 0; off < len;) {
+        ssize_t n = write(STDOUT_FILENO, buf + off, len - off);
+
+        if (n < 0 && errno != EINTR) {
+          done = 1;
+          break;
+        }
+
+        off += n > 0 ? n : 0;
+      }
+    }
+
+    if (fds[1].revents) {
+      ssize_t len = read(STDIN_FILENO, buf, sizeof(buf));
+
+      for (ssize_t i = 0; i < len; i++) {
+        if (buf[i] == 'q' || buf[i] == '\x3') {
+          done = 1;
+        }
+      }
+
+      if (len <= 0) {
+        done = 1;
+      }
+    }
+  }
+
+  restore();
+  close(fd);
+
+  return 0;
+}
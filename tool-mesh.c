@@ -0,0 +1,1214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TERMINIZER_IMPLEMENTATION
+#include "terminizer.h"
+
+/* the mesh being written, through one stream for the vertices and another
+   for the triangles, each at its own offset into the file, so neither has to
+   be held in memory however large the model is */
+struct mesh_out {
+  FILE *vertices;
+  FILE *triangles;
+  uint32_t num_vertices;
+  uint32_t max_vertices;
+  uint32_t num_triangles;
+};
+
+static int out_open(struct mesh_out *out, const char *path, uint32_t num_vertices) {
+  memset(out, 0, sizeof(*out));
+
+  if (!(out->vertices = fopen(path, "wb")) || !(out->triangles = fopen(path, "r+b"))) {
+    return 0;
+  }
+
+  setvbuf(out->vertices, NULL, _IOFBF, 1 << 20);
+  setvbuf(out->triangles, NULL, _IOFBF, 1 << 20);
+
+  out->max_vertices = num_vertices;
+
+  return !fseeko(out->vertices, TZ_MESH_HEADER, SEEK_SET) &&
+         !fseeko(out->triangles, TZ_MESH_HEADER + (off_t)num_vertices * sizeof(struct tz_vertex), SEEK_SET);
+}
+
+static void out_vertex(struct mesh_out *out, const float *pos, const float *color, const float *uv) {
+  struct tz_vertex v;
+
+  /* zero the padding too, so the same model always converts the same */
+  memset(&v, 0, sizeof(v));
+
+  v.x = pos[0];
+  v.y = pos[1];
+  v.z = pos[2];
+  v.w = 1.0f;
+  v.r = (uint8_t)(color[0] < 0.0f ? 0.0f : color[0] > 1.0f ? 255.0f : color[0] * 255.0f + 0.5f);
+  v.g = (uint8_t)(color[1] < 0.0f ? 0.0f : color[1] > 1.0f ? 255.0f : color[1] * 255.0f + 0.5f);
+  v.b = (uint8_t)(color[2] < 0.0f ? 0.0f : color[2] > 1.0f ? 255.0f : color[2] * 255.0f + 0.5f);
+  v.u = uv[0];
+  v.v = uv[1];
+
+  fwrite(&v, sizeof(v), 1, out->vertices);
+  out->num_vertices++;
+}
+
+/* splits a convex polygon into a fan of triangles around its first vertex */
+static void out_polygon(struct mesh_out *out, const uint32_t *indices, int n) {
+  for (int i = 2; i < n; i++) {
+    uint32_t tri[3] = {indices[0], indices[i - 1], indices[i]};
+
+    fwrite(tri, sizeof(tri), 1, out->triangles);
+    out->num_triangles++;
+  }
+}
+
+static int out_close(struct mesh_out *out) {
+  char header[TZ_MESH_HEADER] = {0};
+  int ok = out->vertices && out->triangles && out->num_vertices == out->max_vertices;
+
+  memcpy(header, TZ_MESH_MAGIC, 8);
+  tz_put_u32(header + 8, sizeof(struct tz_vertex));
+  tz_put_u32(header + 12, out->num_vertices);
+  tz_put_u32(header + 16, out->num_triangles);
+
+  /* flush the triangles first, as the header is only written once the rest
+     of the file is */
+  if (out->triangles) {
+    ok &= !ferror(out->triangles);
+    ok &= !fclose(out->triangles);
+  }
+
+  if (out->vertices) {
+    ok &= !fseeko(out->vertices, 0, SEEK_SET) && fwrite(header, sizeof(header), 1, out->vertices) == 1;
+    ok &= !ferror(out->vertices);
+    ok &= !fclose(out->vertices);
+  }
+
+  return ok;
+}
+
+/* grows a polygon's index list to hold at least n */
+static uint32_t *reserve_indices(uint32_t *indices, int *cap, int n) {
+  if (n > *cap) {
+    *cap = n * 2;
+    indices = realloc(indices, *cap * sizeof(uint32_t));
+  }
+
+  return indices;
+}
+
+static int convert_obj(FILE *in, const char *in_path, const char *out_path) {
+  char *line = NULL;
+  size_t line_cap = 0;
+  uint32_t num_vertices = 0;
+
+  /* count the vertices first, so the triangles can be written after them as
+     they're read */
+  while (getline(&line, &line_cap, in) > 0) {
+    num_vertices += line[0] == 'v' && (line[1] == ' ' || line[1] == '\t');
+  }
+
+  rewind(in);
+
+  struct mesh_out out;
+  uint32_t *indices = NULL;
+  int indices_cap = 0;
+  int line_num = 0;
+  int ok = out_open(&out, out_path, num_vertices);
+
+  while (ok && getline(&line, &line_cap, in) > 0) {
+    line_num++;
+
+    if (line[0] == 'v' && (line[1] == ' ' || line[1] == '\t')) {
+      /* positions, optionally followed by a color */
+      float pos[3] = {0.0f};
+      float color[3] = {1.0f, 1.0f, 1.0f};
+      float uv[2] = {0.0f};
+      int n = sscanf(line + 2, "%f %f %f %f %f %f", &pos[0], &pos[1], &pos[2], &color[0], &color[1], &color[2]);
+
+      if (n < 6) {
+        color[0] = color[1] = color[2] = 1.0f;
+      }
+
+      if (n < 3) {
+        fprintf(stderr, "%s:%d: bad vertex\n", in_path, line_num);
+        ok = 0;
+      } else {
+        out_vertex(&out, pos, color, uv);
+      }
+    } else if (line[0] == 'f' && (line[1] == ' ' || line[1] == '\t')) {
+      /* vertex indices count from 1, or back from the last vertex read if
+         negative. anything after a slash indexes texture coordinates and
+         normals, which aren't kept */
+      int n = 0;
+      char *p = line + 2;
+
+      while (ok) {
+        while (*p == ' ' || *p == '\t') {
+          p++;
+        }
+
+        if (!*p || *p == '\n' || *p == '\r') {
+          break;
+        }
+
+        char *end;
+        long index = strtol(p, &end, 10);
+
+        index = index < 0 ? (long)out.num_vertices + index : index - 1;
+
+        if (end == p || index < 0 || index >= (long)num_vertices) {
+          fprintf(stderr, "%s:%d: bad face\n", in_path, line_num);
+          ok = 0;
+        }
+
+        indices = reserve_indices(indices, &indices_cap, n + 1);
+        indices[n++] = (uint32_t)index;
+
+        for (p = end; *p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r'; p++) {
+        }
+      }
+
+      if (ok) {
+        out_polygon(&out, indices, n);
+      }
+    }
+  }
+
+  free(line);
+  free(indices);
+
+  return out_close(&out) && ok;
+}
+
+/* ply property types, by the names used in headers */
+static const struct {
+  const char *name[2];
+  int size;
+  int is_float;
+  int is_signed;
+} ply_types[] = {
+    {{"char", "int8"}, 1, 0, 1},     {{"uchar", "uint8"}, 1, 0, 0},    {{"short", "int16"}, 2, 0, 1},
+    {{"ushort", "uint16"}, 2, 0, 0}, {{"int", "int32"}, 4, 0, 1},      {{"uint", "uint32"}, 4, 0, 0},
+    {{"float", "float32"}, 4, 1, 1}, {{"double", "float64"}, 8, 1, 1},
+};
+
+enum {
+  PLY_ASCII,
+  PLY_LITTLE_ENDIAN,
+  PLY_BIG_ENDIAN,
+};
+
+#define PLY_MAX_PROPS    32
+#define PLY_MAX_ELEMENTS 16
+
+struct ply_prop {
+  char name[64];
+  int type;
+
+  /* type of the count ahead of a list's values, or -1 for a single value */
+  int count_type;
+};
+
+struct ply_element {
+  char name[64];
+  uint32_t count;
+  struct ply_prop props[PLY_MAX_PROPS];
+  int num_props;
+};
+
+static int ply_type(const char *name) {
+  for (int i = 0; i < (int)(sizeof(ply_types) / sizeof(ply_types[0])); i++) {
+    if (!strcmp(name, ply_types[i].name[0]) || !strcmp(name, ply_types[i].name[1])) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/* reads a value of the given type, as stored in the given format */
+static int ply_read(FILE *in, int format, int type, double *value) {
+  if (format == PLY_ASCII) {
+    return fscanf(in, "%lf", value) == 1;
+  }
+
+  uint8_t bytes[8];
+  int size = ply_types[type].size;
+  const uint16_t one = 1;
+  int swap = (format == PLY_LITTLE_ENDIAN) != *(const uint8_t *)&one;
+
+  if (fread(bytes, 1, size, in) != (size_t)size) {
+    return 0;
+  }
+
+  for (int i = 0; swap && i < size / 2; i++) {
+    uint8_t b = bytes[i];
+    bytes[i] = bytes[size - 1 - i];
+    bytes[size - 1 - i] = b;
+  }
+
+  union {
+    int8_t i8;
+    uint8_t u8;
+    int16_t i16;
+    uint16_t u16;
+    int32_t i32;
+    uint32_t u32;
+    float f32;
+    double f64;
+  } v;
+
+  memcpy(&v, bytes, size);
+
+  if (ply_types[type].is_float) {
+    *value = size == 4 ? v.f32 : v.f64;
+  } else if (ply_types[type].is_signed) {
+    *value = size == 1 ? v.i8 : size == 2 ? v.i16 : v.i32;
+  } else {
+    *value = size == 1 ? v.u8 : size == 2 ? v.u16 : v.u32;
+  }
+
+  return 1;
+}
+
+/* where a vertex property goes, as an index into position, color and uv */
+static int ply_vertex_slot(const char *name) {
+  static const char *names[][3] = {
+      {"x"}, {"y"}, {"z"}, {"red", "diffuse_red", "r"}, {"green", "diffuse_green", "g"},
+      {"blue", "diffuse_blue", "b"}, {"u", "s", "texture_u"}, {"v", "t", "texture_v"},
+  };
+
+  for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+    for (int j = 0; j < 3; j++) {
+      if (names[i][j] && !strcmp(name, names[i][j])) {
+        return i;
+      }
+    }
+  }
+
+  return -1;
+}
+
+static int convert_ply(FILE *in, const char *in_path, const char *out_path) {
+  struct ply_element elements[PLY_MAX_ELEMENTS];
+  int num_elements = 0;
+  int format = -1;
+  char line[256];
+
+  /* the header lists each element with its count and properties, ahead of
+     all their values */
+  while (fgets(line, sizeof(line), in) && strncmp(line, "end_header", 10)) {
+    char a[64], b[64], c[64], d[64];
+    unsigned long count;
+
+    if (sscanf(line, "format %63s", a) == 1) {
+      format = !strcmp(a, "ascii")                  ? PLY_ASCII
+               : !strcmp(a, "binary_little_endian") ? PLY_LITTLE_ENDIAN
+               : !strcmp(a, "binary_big_endian")    ? PLY_BIG_ENDIAN
+                                                    : -1;
+    } else if (sscanf(line, "element %63s %lu", a, &count) == 2 && num_elements < PLY_MAX_ELEMENTS) {
+      struct ply_element *e = &elements[num_elements++];
+
+      strcpy(e->name, a);
+      e->count = (uint32_t)count;
+      e->num_props = 0;
+    } else if (sscanf(line, "property list %63s %63s %63s", a, b, c) == 3 && num_elements) {
+      struct ply_element *e = &elements[num_elements - 1];
+
+      if (e->num_props < PLY_MAX_PROPS) {
+        struct ply_prop *prop = &e->props[e->num_props++];
+
+        strcpy(prop->name, c);
+        prop->count_type = ply_type(a);
+        prop->type = ply_type(b);
+
+        if (prop->count_type < 0 || prop->type < 0) {
+          format = -1;
+        }
+      }
+    } else if (sscanf(line, "property %63s %63s %63s", a, b, d) == 2 && num_elements) {
+      struct ply_element *e = &elements[num_elements - 1];
+
+      if (e->num_props < PLY_MAX_PROPS) {
+        struct ply_prop *prop = &e->props[e->num_props++];
+
+        strcpy(prop->name, b);
+        prop->count_type = -1;
+        prop->type = ply_type(a);
+
+        if (prop->type < 0) {
+          format = -1;
+        }
+      }
+    }
+  }
+
+  uint32_t num_vertices = 0;
+
+  for (int i = 0; i < num_elements; i++) {
+    if (!strcmp(elements[i].name, "vertex")) {
+      num_vertices = elements[i].count;
+    }
+  }
+
+  if (format < 0 || feof(in)) {
+    fprintf(stderr, "%s: unsupported ply header\n", in_path);
+    return 0;
+  }
+
+  struct mesh_out out;
+  uint32_t *indices = NULL;
+  int indices_cap = 0;
+  int ok = out_open(&out, out_path, num_vertices);
+
+  for (int i = 0; ok && i < num_elements; i++) {
+    struct ply_element *e = &elements[i];
+    int is_vertex = !strcmp(e->name, "vertex");
+    int is_face = !strcmp(e->name, "face");
+
+    for (uint32_t j = 0; ok && j < e->count; j++) {
+      /* position, color and uv, with colors stored as integers scaled to 1 */
+      float attribs[8] = {0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f, 0.0f, 0.0f};
+      int n = 0;
+
+      for (int k = 0; ok && k < e->num_props; k++) {
+        struct ply_prop *prop = &e->props[k];
+        double value;
+
+        if (prop->count_type < 0) {
+          ok = ply_read(in, format, prop->type, &value);
+
+          int slot = is_vertex ? ply_vertex_slot(prop->name) : -1;
+
+          if (slot >= 3 && slot < 6 && !ply_types[prop->type].is_float) {
+            value /= 255.0;
+          }
+
+          if (slot >= 0) {
+            attribs[slot] = (float)value;
+          }
+
+          continue;
+        }
+
+        /* lists are kept as the face's indices, or skipped */
+        int keep = is_face && (!strcmp(prop->name, "vertex_indices") || !strcmp(prop->name, "vertex_index"));
+        double count;
+
+        ok = ply_read(in, format, prop->count_type, &count) && count >= 0.0 && count <= INT32_MAX;
+
+        for (int l = 0; ok && l < (int)count; l++) {
+          ok = ply_read(in, format, prop->type, &value);
+
+          if (keep) {
+            if (value < 0.0 || value >= num_vertices) {
+              fprintf(stderr, "%s: bad face %u\n", in_path, j);
+              ok = 0;
+            }
+
+            indices = reserve_indices(indices, &indices_cap, n + 1);
+            indices[n++] = (uint32_t)value;
+          }
+        }
+      }
+
+      if (!ok) {
+        break;
+      }
+
+      if (is_vertex) {
+        out_vertex(&out, &attribs[0], &attribs[3], &attribs[6]);
+      } else if (is_face) {
+        out_polygon(&out, indices, n);
+      }
+    }
+  }
+
+  if (!ok) {
+    fprintf(stderr, "%s: truncated or damaged\n", in_path);
+  }
+
+  free(indices);
+
+  return out_close(&out) && ok;
+}
+
+/* levels of detail are built by collapsing edges into one of their two
+   vertices, cheapest first by the quadric error metric, snapshotting the
+   triangles left each time they halve. as no vertex moves, every level can
+   share the vertices of the full mesh, ordered so the ones a level keeps come
+   first */
+#define LOD_MIN_TRIANGLES   64
+#define LOD_BOUNDARY_WEIGHT 8.0
+
+/* a symmetric 4x4 matrix summing the squared distances to a set of planes,
+   as its upper triangle, followed by the planes' total weight */
+typedef double quadric_t[11];
+
+struct lod_edge {
+  float cost;
+  uint32_t from;
+  uint32_t to;
+
+  /* versions of the two vertices when the cost was found, telling whether
+     it's still current */
+  uint32_t from_version;
+  uint32_t to_version;
+
+  /* set once the cheaper way has been tried and would have folded over */
+  int reversed;
+};
+
+struct lod_refs {
+  uint32_t *tris;
+  int len;
+  int cap;
+};
+
+struct lod_level {
+  uint32_t *tris;
+  uint32_t num_triangles;
+  uint32_t num_vertices;
+  float error;
+};
+
+struct lod_state {
+  const struct tz_vertex *vertices;
+  uint32_t num_vertices;
+  uint32_t *tris;
+  uint32_t num_triangles;
+  uint8_t *dead;
+
+  quadric_t *quadrics;
+  uint32_t *versions;
+  struct lod_refs *refs;
+
+  /* when each vertex was collapsed, in collapses since the start, and the
+     vertex it was collapsed into */
+  uint32_t *collapsed_at;
+  uint32_t *collapsed_into;
+  uint32_t num_collapses;
+
+  /* triangles gathered around a vertex, marked as they're gathered */
+  uint32_t *marks;
+  uint32_t mark;
+  uint32_t *ring;
+  size_t ring_cap;
+
+  struct lod_edge *heap;
+  size_t heap_len;
+  size_t heap_cap;
+};
+
+static void quadric_add_plane(double *q, const double *n, double d, double weight) {
+  q[0] += weight * n[0] * n[0];
+  q[1] += weight * n[0] * n[1];
+  q[2] += weight * n[0] * n[2];
+  q[3] += weight * n[0] * d;
+  q[4] += weight * n[1] * n[1];
+  q[5] += weight * n[1] * n[2];
+  q[6] += weight * n[1] * d;
+  q[7] += weight * n[2] * n[2];
+  q[8] += weight * n[2] * d;
+  q[9] += weight * d * d;
+  q[10] += weight;
+}
+
+/* the mean squared distance from p to the planes of two quadrics */
+static double quadric_error(const double *a, const double *b, const float *p) {
+  double q[11];
+
+  for (int i = 0; i < 11; i++) {
+    q[i] = a[i] + b[i];
+  }
+
+  double x = p[0], y = p[1], z = p[2];
+  double sum = q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x + q[4] * y * y +
+               2 * q[5] * y * z + 2 * q[6] * y + q[7] * z * z + 2 * q[8] * z + q[9];
+
+  return q[10] > 0.0 ? TZ_MAX(sum, 0.0) / q[10] : 0.0;
+}
+
+/* unit normal of a triangle, returning its length before normalizing */
+static double lod_normal(const float *a, const float *b, const float *c, double *n) {
+  double e0[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+  double e1[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+
+  n[0] = e0[1] * e1[2] - e0[2] * e1[1];
+  n[1] = e0[2] * e1[0] - e0[0] * e1[2];
+  n[2] = e0[0] * e1[1] - e0[1] * e1[0];
+
+  double len = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+  if (len > 0.0) {
+    n[0] /= len;
+    n[1] /= len;
+    n[2] /= len;
+  }
+
+  return len;
+}
+
+static double lod_segment_distance2(const double *p, const float *a, const float *b) {
+  double ab[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+  double ap[3] = {p[0] - a[0], p[1] - a[1], p[2] - a[2]};
+  double len2 = ab[0] * ab[0] + ab[1] * ab[1] + ab[2] * ab[2];
+  double t = len2 > 0.0 ? (ap[0] * ab[0] + ap[1] * ab[1] + ap[2] * ab[2]) / len2 : 0.0;
+
+  t = TZ_MIN(TZ_MAX(t, 0.0), 1.0);
+
+  double d[3] = {ap[0] - t * ab[0], ap[1] - t * ab[1], ap[2] - t * ab[2]};
+
+  return d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+}
+
+/* distance from p to the closest point of a triangle */
+static double lod_triangle_distance(const double *p, const float *a, const float *b, const float *c) {
+  const float *v[3] = {a, b, c};
+  double n[3];
+
+  /* inside the triangle seen along its normal, it's the distance to its
+     plane, and otherwise to the nearest of its edges */
+  if (lod_normal(a, b, c, n) > 0.0) {
+    int inside = 1;
+
+    for (int i = 0; i < 3; i++) {
+      const float *e0 = v[i];
+      const float *e1 = v[(i + 1) % 3];
+      double e[3] = {e1[0] - e0[0], e1[1] - e0[1], e1[2] - e0[2]};
+      double q[3] = {p[0] - e0[0], p[1] - e0[1], p[2] - e0[2]};
+      double side[3] = {e[1] * q[2] - e[2] * q[1], e[2] * q[0] - e[0] * q[2], e[0] * q[1] - e[1] * q[0]};
+
+      inside &= side[0] * n[0] + side[1] * n[1] + side[2] * n[2] >= 0.0;
+    }
+
+    if (inside) {
+      return fabs((p[0] - a[0]) * n[0] + (p[1] - a[1]) * n[1] + (p[2] - a[2]) * n[2]);
+    }
+  }
+
+  double d2 = lod_segment_distance2(p, a, b);
+
+  d2 = TZ_MIN(d2, lod_segment_distance2(p, b, c));
+  d2 = TZ_MIN(d2, lod_segment_distance2(p, c, a));
+
+  return sqrt(d2);
+}
+
+static void lod_push_edge(struct lod_state *st, uint32_t from, uint32_t to, int reversed) {
+  float cost = (float)quadric_error(st->quadrics[from], st->quadrics[to], st->vertices[to].pos);
+  struct lod_edge e = {cost, from, to, st->versions[from], st->versions[to], reversed};
+
+  if (st->heap_len == st->heap_cap) {
+    st->heap_cap = st->heap_cap ? st->heap_cap * 2 : 1024;
+    st->heap = realloc(st->heap, st->heap_cap * sizeof(struct lod_edge));
+  }
+
+  size_t i = st->heap_len++;
+
+  while (i && st->heap[(i - 1) / 2].cost > e.cost) {
+    st->heap[i] = st->heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+
+  st->heap[i] = e;
+}
+
+static void lod_push(struct lod_state *st, uint32_t a, uint32_t b) {
+  /* collapse whichever way costs less */
+  float cost_ab = (float)quadric_error(st->quadrics[a], st->quadrics[b], st->vertices[b].pos);
+  float cost_ba = (float)quadric_error(st->quadrics[a], st->quadrics[b], st->vertices[a].pos);
+
+  if (cost_ba < cost_ab) {
+    lod_push_edge(st, b, a, 0);
+  } else {
+    lod_push_edge(st, a, b, 0);
+  }
+}
+
+static struct lod_edge lod_pop(struct lod_state *st) {
+  struct lod_edge top = st->heap[0];
+  struct lod_edge last = st->heap[--st->heap_len];
+  size_t i = 0;
+
+  for (;;) {
+    size_t child = i * 2 + 1;
+
+    if (child >= st->heap_len) {
+      break;
+    }
+
+    if (child + 1 < st->heap_len && st->heap[child + 1].cost < st->heap[child].cost) {
+      child++;
+    }
+
+    if (st->heap[child].cost >= last.cost) {
+      break;
+    }
+
+    st->heap[i] = st->heap[child];
+    i = child;
+  }
+
+  st->heap[i] = last;
+
+  return top;
+}
+
+static void lod_add_ref(struct lod_refs *refs, uint32_t tri) {
+  if (refs->len == refs->cap) {
+    refs->cap = refs->cap ? refs->cap * 2 : 8;
+    refs->tris = realloc(refs->tris, refs->cap * sizeof(uint32_t));
+  }
+
+  refs->tris[refs->len++] = tri;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void lod_init(struct lod_state *st, const struct tz_vertex *vertices, uint32_t num_vertices,
+                     const uint32_t *tris, uint32_t num_triangles) {
+  memset(st, 0, sizeof(*st));
+
+  st->vertices = vertices;
+  st->num_vertices = num_vertices;
+  st->num_triangles = num_triangles;
+  st->tris = malloc((size_t)num_triangles * 3 * sizeof(uint32_t));
+  st->dead = calloc(num_triangles, 1);
+  st->marks = calloc(num_triangles, sizeof(uint32_t));
+  st->quadrics = calloc(num_vertices, sizeof(quadric_t));
+  st->versions = calloc(num_vertices, sizeof(uint32_t));
+  st->refs = calloc(num_vertices, sizeof(struct lod_refs));
+  st->collapsed_at = malloc(num_vertices * sizeof(uint32_t));
+  st->collapsed_into = malloc(num_vertices * sizeof(uint32_t));
+
+  memcpy(st->tris, tris, (size_t)num_triangles * 3 * sizeof(uint32_t));
+
+  for (uint32_t i = 0; i < num_vertices; i++) {
+    st->collapsed_at[i] = UINT32_MAX;
+  }
+
+  /* each vertex starts with the planes of the triangles around it */
+  for (uint32_t i = 0; i < num_triangles; i++) {
+    const uint32_t *t = &st->tris[i * 3];
+    double n[3];
+
+    if (t[0] == t[1] || t[1] == t[2] || t[2] == t[0]) {
+      st->dead[i] = 1;
+      continue;
+    }
+
+    lod_normal(vertices[t[0]].pos, vertices[t[1]].pos, vertices[t[2]].pos, n);
+
+    double d = -(n[0] * vertices[t[0]].x + n[1] * vertices[t[0]].y + n[2] * vertices[t[0]].z);
+
+    for (int j = 0; j < 3; j++) {
+      quadric_add_plane(st->quadrics[t[j]], n, d, 1.0);
+      lod_add_ref(&st->refs[t[j]], i);
+    }
+  }
+
+  /* list the edges of every triangle, as their vertices followed by the
+     triangle, sorted so that an edge only one triangle has, on an open
+     boundary of the mesh, stands alone */
+  uint64_t *edges = malloc((size_t)num_triangles * 3 * sizeof(uint64_t) * 2);
+  size_t num_edges = 0;
+
+  for (uint32_t i = 0; i < num_triangles; i++) {
+    for (int j = 0; j < 3 && !st->dead[i]; j++) {
+      uint32_t a = st->tris[i * 3 + j];
+      uint32_t b = st->tris[i * 3 + (j + 1) % 3];
+
+      edges[num_edges * 2] = ((uint64_t)TZ_MIN(a, b) << 32) | TZ_MAX(a, b);
+      edges[num_edges * 2 + 1] = i;
+      num_edges++;
+    }
+  }
+
+  qsort(edges, num_edges, 2 * sizeof(uint64_t), compare_u64);
+
+  for (size_t i = 0; i < num_edges;) {
+    size_t j = i + 1;
+
+    while (j < num_edges && edges[j * 2] == edges[i * 2]) {
+      j++;
+    }
+
+    uint32_t a = (uint32_t)(edges[i * 2] >> 32);
+    uint32_t b = (uint32_t)edges[i * 2];
+
+    /* keep the mesh's open edges in place with a plane through them at right
+       angles to their triangle */
+    if (j == i + 1) {
+      const uint32_t *t = &st->tris[edges[i * 2 + 1] * 3];
+      const float *pa = vertices[a].pos;
+      const float *pb = vertices[b].pos;
+      double n[3];
+      double e[3] = {pb[0] - pa[0], pb[1] - pa[1], pb[2] - pa[2]};
+
+      lod_normal(vertices[t[0]].pos, vertices[t[1]].pos, vertices[t[2]].pos, n);
+
+      double side[3] = {e[1] * n[2] - e[2] * n[1], e[2] * n[0] - e[0] * n[2], e[0] * n[1] - e[1] * n[0]};
+      double len = sqrt(side[0] * side[0] + side[1] * side[1] + side[2] * side[2]);
+
+      if (len > 0.0) {
+        side[0] /= len;
+        side[1] /= len;
+        side[2] /= len;
+
+        double d = -(side[0] * pa[0] + side[1] * pa[1] + side[2] * pa[2]);
+
+        quadric_add_plane(st->quadrics[a], side, d, LOD_BOUNDARY_WEIGHT);
+        quadric_add_plane(st->quadrics[b], side, d, LOD_BOUNDARY_WEIGHT);
+      }
+    }
+
+    i = j;
+  }
+
+  for (size_t i = 0; i < num_edges; i++) {
+    if (!i || edges[i * 2] != edges[(i - 1) * 2]) {
+      lod_push(st, (uint32_t)(edges[i * 2] >> 32), (uint32_t)edges[i * 2]);
+    }
+  }
+
+  free(edges);
+}
+
+/* collapses from into to, unless that would fold a triangle over */
+static int lod_collapse(struct lod_state *st, uint32_t from, uint32_t to, uint32_t *num_triangles) {
+  struct lod_refs *refs = &st->refs[from];
+
+  for (int i = 0; i < refs->len; i++) {
+    const uint32_t *t = &st->tris[refs->tris[i] * 3];
+
+    if (st->dead[refs->tris[i]] || t[0] == to || t[1] == to || t[2] == to) {
+      continue;
+    }
+
+    const float *p[3];
+    const float *moved[3];
+    double before[3];
+    double after[3];
+
+    for (int j = 0; j < 3; j++) {
+      p[j] = st->vertices[t[j]].pos;
+      moved[j] = t[j] == from ? st->vertices[to].pos : p[j];
+    }
+
+    /* triangles already without area, as at the poles of a sphere, have no
+       way to face to fold over from */
+    if (lod_normal(p[0], p[1], p[2], before) <= 0.0) {
+      continue;
+    }
+
+    if (lod_normal(moved[0], moved[1], moved[2], after) <= 0.0 ||
+        before[0] * after[0] + before[1] * after[1] + before[2] * after[2] < 0.2) {
+      return 0;
+    }
+  }
+
+  for (int i = 0; i < refs->len; i++) {
+    uint32_t tri = refs->tris[i];
+    uint32_t *t = &st->tris[tri * 3];
+
+    if (st->dead[tri]) {
+      continue;
+    }
+
+    if (t[0] == to || t[1] == to || t[2] == to) {
+      st->dead[tri] = 1;
+      (*num_triangles)--;
+      continue;
+    }
+
+    for (int j = 0; j < 3; j++) {
+      t[j] = t[j] == from ? to : t[j];
+    }
+
+    lod_add_ref(&st->refs[to], tri);
+  }
+
+  for (int i = 0; i < 11; i++) {
+    st->quadrics[to][i] += st->quadrics[from][i];
+  }
+
+  free(refs->tris);
+  memset(refs, 0, sizeof(*refs));
+
+  st->collapsed_at[from] = st->num_collapses++;
+  st->collapsed_into[from] = to;
+  st->versions[to]++;
+
+  /* drop the triangles gone from around to, then requeue its edges */
+  struct lod_refs *to_refs = &st->refs[to];
+  int len = 0;
+
+  for (int i = 0; i < to_refs->len; i++) {
+    if (!st->dead[to_refs->tris[i]]) {
+      to_refs->tris[len++] = to_refs->tris[i];
+    }
+  }
+
+  to_refs->len = len;
+
+  for (int i = 0; i < to_refs->len; i++) {
+    const uint32_t *t = &st->tris[to_refs->tris[i] * 3];
+
+    for (int j = 0; j < 3; j++) {
+      if (t[j] != to) {
+        lod_push(st, to, t[j]);
+      }
+    }
+  }
+
+  return 1;
+}
+
+static void lod_snapshot(struct lod_state *st, struct lod_level *level, uint32_t num_triangles, float error) {
+  level->tris = malloc((size_t)num_triangles * 3 * sizeof(uint32_t));
+  level->num_triangles = 0;
+  level->num_vertices = st->num_vertices - st->num_collapses;
+
+  /* the error is how far the vertices collapsed so far are from the
+     triangles around the vertex that took their place and its neighbours,
+     which is close to, and never less than, how far they are from the whole
+     level. the vertices are grouped by the vertex that took their place to
+     gather those triangles once for each */
+  uint64_t *groups = malloc(st->num_collapses * sizeof(uint64_t));
+  uint32_t num_grouped = 0;
+
+  for (uint32_t i = 0; i < st->num_vertices; i++) {
+    if (st->collapsed_at[i] == UINT32_MAX) {
+      continue;
+    }
+
+    uint32_t v = st->collapsed_into[i];
+
+    while (st->collapsed_at[v] != UINT32_MAX) {
+      v = st->collapsed_into[v];
+    }
+
+    /* shorten the way there for the next level */
+    st->collapsed_into[i] = v;
+    groups[num_grouped++] = ((uint64_t)v << 32) | i;
+  }
+
+  qsort(groups, num_grouped, sizeof(uint64_t), compare_u64);
+
+  for (uint32_t i = 0; i < num_grouped;) {
+    uint32_t v = (uint32_t)(groups[i] >> 32);
+    const struct lod_refs *refs = &st->refs[v];
+    size_t ring_len = 0;
+
+    st->mark++;
+
+    for (int j = 0; j < refs->len; j++) {
+      const uint32_t *t = &st->tris[refs->tris[j] * 3];
+
+      for (int k = 0; k < 3; k++) {
+        const struct lod_refs *around = &st->refs[t[k]];
+
+        for (int l = 0; l < around->len; l++) {
+          uint32_t tri = around->tris[l];
+
+          if (st->dead[tri] || st->marks[tri] == st->mark) {
+            continue;
+          }
+
+          if (ring_len == st->ring_cap) {
+            st->ring_cap = st->ring_cap ? st->ring_cap * 2 : 256;
+            st->ring = realloc(st->ring, st->ring_cap * sizeof(uint32_t));
+          }
+
+          st->marks[tri] = st->mark;
+          st->ring[ring_len++] = tri;
+        }
+      }
+    }
+
+    for (; i < num_grouped && (uint32_t)(groups[i] >> 32) == v; i++) {
+      const struct tz_vertex *collapsed = &st->vertices[(uint32_t)groups[i]];
+      double p[3] = {collapsed->x, collapsed->y, collapsed->z};
+      double nearest = INFINITY;
+
+      /* only the farthest vertex counts, so stop once one is no farther */
+      for (size_t j = 0; j < ring_len && nearest > error; j++) {
+        const uint32_t *t = &st->tris[st->ring[j] * 3];
+
+        nearest = TZ_MIN(nearest, lod_triangle_distance(p, st->vertices[t[0]].pos, st->vertices[t[1]].pos,
+                                                        st->vertices[t[2]].pos));
+      }
+
+      if (ring_len) {
+        error = TZ_MAX(error, (float)nearest);
+      }
+    }
+  }
+
+  free(groups);
+
+  level->error = error;
+
+  for (uint32_t i = 0; i < st->num_triangles; i++) {
+    if (!st->dead[i]) {
+      memcpy(&level->tris[level->num_triangles++ * 3], &st->tris[i * 3], 3 * sizeof(uint32_t));
+    }
+  }
+}
+
+/* builds the levels past the full mesh, returning how many */
+static int lod_build(struct lod_state *st, struct lod_level *levels) {
+  uint32_t num_triangles = 0;
+  int num_levels = 0;
+
+  for (uint32_t i = 0; i < st->num_triangles; i++) {
+    num_triangles += !st->dead[i];
+  }
+
+  uint32_t target = num_triangles / 2;
+
+  while (st->heap_len && num_levels < TZ_MAX_MESH_LEVELS - 1 && target >= LOD_MIN_TRIANGLES) {
+    struct lod_edge e = lod_pop(st);
+
+    if (st->collapsed_at[e.from] != UINT32_MAX || st->collapsed_at[e.to] != UINT32_MAX ||
+        st->versions[e.from] != e.from_version || st->versions[e.to] != e.to_version) {
+      continue;
+    }
+
+    if (!lod_collapse(st, e.from, e.to, &num_triangles)) {
+      if (!e.reversed) {
+        lod_push_edge(st, e.to, e.from, 1);
+      }
+
+      continue;
+    }
+
+    if (num_triangles <= target) {
+      lod_snapshot(st, &levels[num_levels], num_triangles, num_levels ? levels[num_levels - 1].error : 0.0f);
+      target = num_triangles / 2;
+      num_levels++;
+    }
+  }
+
+  return num_levels;
+}
+
+/* rewrites the mesh at path with levels of detail, returning how many */
+static int write_levels(const char *path) {
+  struct tz_mesh *mesh = tz_mesh_open(path);
+
+  if (!mesh) {
+    return 0;
+  }
+
+  const struct tz_vertex *vertices;
+  const uint32_t *tris;
+  uint32_t num_vertices = tz_mesh_vertices(mesh, &vertices);
+  uint32_t num_triangles = tz_mesh_triangles(mesh, &tris);
+  struct lod_state st;
+  struct lod_level levels[TZ_MAX_MESH_LEVELS];
+
+  lod_init(&st, vertices, num_vertices, tris, num_triangles);
+
+  int num_levels = lod_build(&st, &levels[1]) + 1;
+
+  levels[0] = (struct lod_level){(uint32_t *)tris, num_triangles, num_vertices, 0.0f};
+
+  /* order the vertices by how long they last, so each level's come first */
+  uint64_t *order = malloc(num_vertices * sizeof(uint64_t));
+  uint32_t *remap = malloc(num_vertices * sizeof(uint32_t));
+
+  for (uint32_t i = 0; i < num_vertices; i++) {
+    order[i] = ((uint64_t)~st.collapsed_at[i] << 32) | i;
+  }
+
+  qsort(order, num_vertices, sizeof(uint64_t), compare_u64);
+
+  for (uint32_t i = 0; i < num_vertices; i++) {
+    remap[(uint32_t)order[i]] = i;
+  }
+
+  /* the bounding sphere around the middle of the bounding box */
+  float lo[3] = {INFINITY, INFINITY, INFINITY};
+  float hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+  float bounds[4] = {0.0f};
+
+  for (uint32_t i = 0; i < num_vertices; i++) {
+    for (int j = 0; j < 3; j++) {
+      lo[j] = TZ_MIN(lo[j], vertices[i].pos[j]);
+      hi[j] = TZ_MAX(hi[j], vertices[i].pos[j]);
+    }
+  }
+
+  for (int j = 0; j < 3 && num_vertices; j++) {
+    bounds[j] = (lo[j] + hi[j]) * 0.5f;
+  }
+
+  for (uint32_t i = 0; i < num_vertices; i++) {
+    float dx = vertices[i].x - bounds[0];
+    float dy = vertices[i].y - bounds[1];
+    float dz = vertices[i].z - bounds[2];
+
+    bounds[3] = TZ_MAX(bounds[3], sqrtf(dx * dx + dy * dy + dz * dz));
+  }
+
+  /* write it all out next to the mesh, replacing it once complete */
+  char *tmp_path = malloc(strlen(path) + 5);
+  char header[TZ_MESH_HEADER] = {0};
+
+  sprintf(tmp_path, "%s.tmp", path);
+
+  memcpy(header, TZ_MESH_MAGIC, 8);
+  tz_put_u32(header + 8, sizeof(struct tz_vertex));
+  tz_put_u32(header + 12, num_vertices);
+  tz_put_u32(header + 16, num_triangles);
+  tz_put_u32(header + 20, num_levels > 1 ? num_levels : 0);
+
+  FILE *out = fopen(tmp_path, "wb");
+  int ok = out != NULL;
+
+  if (ok) {
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+    fwrite(header, sizeof(header), 1, out);
+
+    for (uint32_t i = 0; i < num_vertices; i++) {
+      fwrite(&vertices[(uint32_t)order[i]], sizeof(struct tz_vertex), 1, out);
+    }
+  }
+
+  for (int i = 0; ok && i < num_levels; i++) {
+    if (i == 1) {
+      fwrite(bounds, sizeof(bounds), 1, out);
+
+      for (int j = 0; j < num_levels; j++) {
+        struct tz_mesh_level level = {levels[j].num_triangles, levels[j].num_vertices, levels[j].error};
+
+        fwrite(&level, sizeof(level), 1, out);
+      }
+    }
+
+    for (uint32_t j = 0; j < levels[i].num_triangles * 3; j++) {
+      uint32_t index = remap[levels[i].tris[j]];
+
+      fwrite(&index, sizeof(index), 1, out);
+    }
+  }
+
+  if (out) {
+    ok &= !ferror(out);
+    ok &= !fclose(out);
+  }
+
+  ok = ok && !rename(tmp_path, path);
+
+  if (!ok) {
+    remove(tmp_path);
+  }
+
+  for (uint32_t i = 0; i < num_vertices; i++) {
+    free(st.refs[i].tris);
+  }
+
+  for (int i = 1; i < num_levels; i++) {
+    free(levels[i].tris);
+  }
+
+  free(st.tris);
+  free(st.dead);
+  free(st.marks);
+  free(st.ring);
+  free(st.quadrics);
+  free(st.versions);
+  free(st.refs);
+  free(st.collapsed_at);
+  free(st.collapsed_into);
+  free(st.heap);
+  free(order);
+  free(remap);
+  free(tmp_path);
+  tz_mesh_close(mesh);
+
+  return ok ? num_levels : 0;
+}
+
+int main(int argc, char **argv) {
+  /* converts an OBJ or PLY model into a mesh for tz_mesh_open, e.g.
+     ./a.out model.obj model.tzm. only positions and vertex colors are kept,
+     and texture coordinates from PLY models. files are read and written in a
+     stream, so models larger than memory convert too. with -lods, levels of
+     detail are then built from the mesh, which has to fit in memory */
+  const char *paths[2] = {NULL};
+  int lods = 0;
+
+  for (int i = 1, n = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "-lods")) {
+      lods = 1;
+    } else if (n < 2) {
+      paths[n++] = argv[i];
+    }
+  }
+
+  if (!paths[1]) {
+    fprintf(stderr, "usage: %s [-lods] model.obj|model.ply mesh\n", argv[0]);
+    return 1;
+  }
+
+  FILE *in = fopen(paths[0], "rb");
+  char magic[4] = {0};
+
+  if (!in) {
+    perror(paths[0]);
+    return 1;
+  }
+
+  setvbuf(in, NULL, _IOFBF, 1 << 20);
+
+  size_t res = fread(magic, 1, sizeof(magic), in);
+  int is_ply = res == sizeof(magic) && !memcmp(magic, "ply", 3) && (magic[3] == '\n' || magic[3] == '\r');
+
+  if (!is_ply) {
+    rewind(in);
+  }
+
+  int ok = is_ply ? convert_ply(in, paths[0], paths[1]) : convert_obj(in, paths[0], paths[1]);
+
+  fclose(in);
+
+  if (!ok) {
+    fprintf(stderr, "%s: conversion failed\n", paths[1]);
+    remove(paths[1]);
+    return 1;
+  }
+
+  if (lods && !write_levels(paths[1])) {
+    fprintf(stderr, "%s: building levels of detail failed\n", paths[1]);
+    return 1;
+  }
+
+  struct tz_mesh *mesh = tz_mesh_open(paths[1]);
+  const struct tz_vertex *vertices;
+  const uint32_t *indices;
+
+  if (!mesh) {
+    fprintf(stderr, "%s: written mesh doesn't open\n", paths[1]);
+    return 1;
+  }
+
+  fprintf(stderr, "%d vertices, %d triangles\n", tz_mesh_vertices(mesh, &vertices), tz_mesh_triangles(mesh, &indices));
+
+  for (int i = 1; i < mesh->num_levels; i++) {
+    fprintf(stderr, "level %d: %u vertices, %u triangles, error %g\n", i, mesh->levels[i].num_vertices,
+            mesh->levels[i].num_triangles, mesh->levels[i].error);
+  }
+
+  tz_mesh_close(mesh);
+
+  return 0;
+}
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define TERMINIZER_IMPLEMENTATION
+#include "terminizer.h"
+
+static int64_t gettime_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (((int64_t)ts.tv_sec) * 1000000000) + ts.tv_nsec;
+}
+
+static void sleep_ns(int64_t ns) {
+  struct timespec ts = {ns / 1000000000, ns % 1000000000};
+
+  while (nanosleep(&ts, &ts)) {
+  }
+}
+
+int main(int argc, char **argv) {
+  /* replays a recording made with tz_record_start or TERMINIZER_RECORD, e.g.
+     ./a.out session.tzr, or ./a.out -max -null session.tzr to measure */
+  const char *path = NULL;
+  int max_speed = 0;
+  int null_sink = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-max")) {
+      max_speed = 1;
+    } else if (!strcmp(argv[i], "-null")) {
+      null_sink = 1;
+    } else {
+      path = argv[i];
+    }
+  }
+
+  if (!path) {
+    fprintf(stderr, "usage: %s [-max] [-null] recording\n", argv[0]);
+    return 1;
+  }
+
+  struct tz_recording *rec = tz_recording_open(path);
+
+  if (!rec) {
+    fprintf(stderr, "%s: not a recording\n", path);
+    return 1;
+  }
+
+  const char *data;
+  int64_t time_ns;
+  int64_t start = gettime_ns();
+  int64_t total = 0;
+  int max_len = 0;
+  int frames = 0;
+  int len;
+
+  /* fnv-1a over every frame, so replays of the same recording can be
+     compared against a known good one */
+  uint64_t hash = 0xcbf29ce484222325;
+
+  while ((len = tz_recording_read(rec, &data, &time_ns)) > 0) {
+    if (!max_speed) {
+      int64_t wait = time_ns - (gettime_ns() - start);
+
+      if (wait > 0) {
+        sleep_ns(wait);
+      }
+    }
+
+    if (!null_sink) {
+      fwrite(data, 1, len, stdout);
+      fflush(stdout);
+    }
+
+    for (int i = 0; i < len; i++) {
+      hash = (hash ^ (uint8_t)data[i]) * 0x100000001b3;
+    }
+
+    total += len;
+    max_len = len > max_len ? len : max_len;
+    frames++;
+  }
+
+  double elapsed = (gettime_ns() - start) / 1e9;
+
+  tz_recording_close(rec);
+
+  if (!null_sink) {
+    /* leave the terminal the way tz_reset would */
+    printf("\x1b[0m\x1b[?25h\n");
+  }
+
+  if (len < 0) {
+    fprintf(stderr, "%s: damaged after %d frames\n", path, frames);
+  }
+
+  fprintf(stderr, "%d frames, %lld bytes\n", frames, (long long)total);
+  fprintf(stderr, "bytes/frame:  %10.1f avg %10d max\n", frames ? (double)total / frames : 0.0, max_len);
+  fprintf(stderr, "throughput:   %10.1f MB/s %8.1f frames/s\n", total / 1e6 / elapsed, frames / elapsed);
+  fprintf(stderr, "hash:         %016llx\n", (unsigned long long)hash);
+
+  return len < 0;
+}